@@ -32,10 +32,8 @@
 #ifndef ARPS_H
 #define ARPS_H
 
-// OpenMP library
-#include <omp.h>
-
 // C++ headers
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
@@ -44,12 +42,27 @@
 // Armadillo library
 #include <armadillo>
 
+// Own headers
+#include "blocksize.hpp"
+#include "parallel.hpp"
+
+// SIMD intrinsics for the block matching cost
+#if defined(__AVX512F__) || defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
+// Block matching on frames of element type eT (double or float).
+// Costs are accumulated in double either way (for float frames,
+// after summing each block column in float)
+template <typename eT>
 class MotionEstimator {
  public:
         MotionEstimator() {}
         ~MotionEstimator() {}
 
-        void Estimate(const arma::cube &A,
+        void Estimate(const arma::Cube<eT> &A,
                       int iter,
                       int timewindow,
                       int num_images,
@@ -135,235 +148,367 @@ class MotionEstimator {
             return patches;
         }
 
+        // Set the frame and search sizes for Match()
+        void Configure(int w,
+                       int h,
+                       int blocksize,
+                       int MotionP) {
+            Nx = w;
+            Ny = h;
+            wind = MotionP;
+            Bs = blocksize;
+            vecSize = (1+(Nx-Bs))*(1+(Ny-Bs));
+            return;
+        }
+
+        // Match every block of the reference frame into the new frame
+        // (both Nx x Ny, column-major). Positions and motions are 2 x
+        // vecSize, column-major, as slices of patches and motions.
+        // Each block reads its predicted motion before writing its own,
+        // so predictor and motionsOut may alias. Blocks are independent,
+        // so they are searched in parallel
+        void Match(const eT *refFrame,
+                   const eT *newFrame,
+                   int curFr,
+                   const arma::sword *refPositions,
+                   const arma::sword *predictor,
+                   arma::sword *positions,
+                   arma::sword *motionsOut) const {
+            DispatchBlockSize(Bs, [&](auto B) {
+                MatchFixed<decltype(B)::value>(refFrame, newFrame, curFr,
+                                               refPositions, predictor,
+                                               positions, motionsOut);
+            });
+            return;
+        }
+
  private:
         arma::icube patches, motions;
         int Nx, Ny, T, Bs, vecSize, wind;
 
-        // Adaptive Rood Pattern Search ( ARPS) method
-        void ARPSMotionEstimation(const arma::cube &A,
-                                  int curFr,
-                                  int iARPS1,
-                                  int iARPS2,
-                                  int iARPS3) {
-
-            //#pragma omp parallel for
-            for (int it = 0; it < vecSize; it++) {
-                arma::vec costs = arma::ones<arma::vec>(6) * 1E8;
-                arma::umat chkMat = arma::zeros<arma::umat>(2*wind+1, 2*wind+1);
-                arma::imat LDSP = arma::zeros<arma::imat>(6, 2);
-                arma::imat SDSP = arma::zeros<arma::imat>(5, 2);
-                SDSP(0, 0) = 0;
-                SDSP(0, 1) = -1;
-                SDSP(1, 0) = -1;
-                SDSP(1, 1) = 0;
-                SDSP(2, 0) = 0;
-                SDSP(2, 1) = 0;
-                SDSP(3, 0) = 1;
-                SDSP(3, 1) = 0;
-                SDSP(4, 0) = 0;
-                SDSP(4, 1) = 1;
-                LDSP.rows(arma::span(0, 4)) = SDSP;
-
-                int i = it % (1+(Nx-Bs));
-                int j = it / (1+(Ny-Bs));
-
-                int x = j;
-                int y = i;
-
-                arma::cube refblock = A(arma::span(i, i+Bs-1),
-                                        arma::span(j, j+Bs-1),
-                                        arma::span(iARPS1));
-                arma::cube newblock = A(arma::span(i, i+Bs-1),
-                                        arma::span(j, j+Bs-1),
-                                        arma::span(iARPS2));
-                costs(2) = std::pow(arma::norm(
-                                refblock.slice(0) - newblock.slice(0), "fro"),
-                             2) / (Bs*Bs);
-                chkMat(wind, wind) = 1;
-
-                int stepSize, maxIdx;
-                if (j == 0) {
-                    stepSize = 2;
-                    maxIdx = 5;
-                } else {
-                    int ytmp = std::abs(motions(0, it, iARPS3));
-                    int xtmp = std::abs(motions(1, it, iARPS3));
-                    stepSize = (xtmp <= ytmp) ? ytmp : xtmp;
-                    if ((xtmp == stepSize && ytmp == 0)
-                        || (xtmp == 0 && ytmp == stepSize)) {
+        // As Match(), with the block costs for block size B
+        // (see blocksize.hpp)
+        template <int B>
+        void MatchFixed(const eT *refFrame,
+                        const eT *newFrame,
+                        int curFr,
+                        const arma::sword *refPositions,
+                        const arma::sword *predictor,
+                        arma::sword *positions,
+                        arma::sword *motionsOut) const {
+            // Small diamond search pattern, as (horizontal, vertical) steps
+            static const int SDSP[5][2] = {{0, -1}, {-1, 0}, {0, 0}, {1, 0}, {0, 1}};
+
+            int chkSize = 2*wind+1;
+            double norm = 1. / (Bs*Bs);
+
+            parallel_chunks([&](int first, int last) {
+                // Search points already checked, marked with the block
+                // index so the grid never needs clearing between blocks
+                std::vector<int> chkMat(chkSize*chkSize, -1);
+
+                for (int it = first; it < last; it++) {
+                    double costs[6];
+                    int LDSP[6][2] = {};
+                    std::fill_n(costs, 6, 1E8);
+
+                    int i = it % (1+(Nx-Bs));
+                    int j = it / (1+(Ny-Bs));
+
+                    int x = j;
+                    int y = i;
+
+                    const eT *refblock = refFrame + i + j*Nx;
+                    costs[2] = BlockSSD<B>(refblock, newFrame + i + j*Nx, Nx, Bs) * norm;
+                    chkMat[wind*chkSize + wind] = it;
+
+                    int stepSize, maxIdx;
+                    if (j == 0) {
+                        stepSize = 2;
                         maxIdx = 5;
                     } else {
-                        maxIdx = 6;
-                        LDSP(5, 0) = motions(1, it, iARPS3);
-                        LDSP(5, 1) = motions(0, it, iARPS3);
-                    }
-                }
-                LDSP(0, 0) = 0;
-                LDSP(0, 1) = -stepSize;
-                LDSP(1, 0) = -stepSize;
-                LDSP(1, 1) = 0;
-                LDSP(2, 0) = 0;
-                LDSP(2, 1) = 0;
-                LDSP(3, 0) = stepSize;
-                LDSP(3, 1) = 0;
-                LDSP(4, 0) = 0;
-                LDSP(4, 1) = stepSize;
-
-                // Currently not used, but motion estimation can be predictive
-                // if this value is larger than 0!
-                double pMot = 0.0;
-                // Do the LDSP
-                for (int k = 0; k < maxIdx; k++) {
-                    int refBlkVer = y + LDSP(k, 1);
-                    int refBlkHor = x + LDSP(k, 0);
-                    if (refBlkHor < 0
-                        || refBlkHor+Bs-1 >= Ny
-                        || refBlkVer < 0
-                        || refBlkVer+Bs-1 >= Nx) {
-                        continue;
-                    } else if (k == 2 || stepSize == 0) {
-                        continue;
-                    } else {
-                        arma::cube powblock = A(arma::span(refBlkVer,
-                                                           refBlkVer+Bs-1),
-                                                arma::span(refBlkHor,
-                                                           refBlkHor+Bs-1),
-                                                arma::span(iARPS2));
-                        if (curFr == 0) {
-                            costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                 - powblock.slice(0), "fro"),
-                                             2) / (Bs*Bs);
-                        } else if (curFr < 0) {
-                            arma::ivec predpos = arma::vectorise(
-                                                   patches(arma::span(),
-                                                           arma::span(it),
-                                                           arma::span(iARPS1))
-                                                 - motions(arma::span(),
-                                                           arma::span(it),
-                                                           arma::span(iARPS3)));
-                            costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                 - powblock.slice(0), "fro"),
-                                             2) / (Bs*Bs)
-                                        + pMot * std::sqrt(
-                                            std::pow(predpos(0)-refBlkVer, 2)
-                                            + std::pow(predpos(1)-refBlkHor, 2));
-                        } else if (curFr > 0) {
-                            arma::ivec predpos = arma::vectorise(
-                                                   patches(arma::span(),
-                                                           arma::span(it),
-                                                           arma::span(iARPS1))
-                                                 + motions(arma::span(),
-                                                          arma::span(it),
-                                                          arma::span(iARPS3)));
-                            costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                 - powblock.slice(0), "fro"),
-                                             2) / (Bs*Bs)
-                                        + pMot * std::sqrt(
-                                            std::pow(predpos(0)-refBlkVer, 2)
-                                            + std::pow(predpos(1)-refBlkHor, 2));
+                        int ytmp = std::abs(predictor[2*it]);
+                        int xtmp = std::abs(predictor[2*it+1]);
+                        stepSize = (xtmp <= ytmp) ? ytmp : xtmp;
+                        if ((xtmp == stepSize && ytmp == 0)
+                            || (xtmp == 0 && ytmp == stepSize)) {
+                            maxIdx = 5;
+                        } else {
+                            maxIdx = 6;
+                            LDSP[5][0] = predictor[2*it+1];
+                            LDSP[5][1] = predictor[2*it];
                         }
-                        chkMat(LDSP(k, 1)+wind,
-                               LDSP(k, 0)+wind) = 1;
                     }
-                }
-
-                arma::uvec point = arma::find(costs == costs.min());
-                x += LDSP(point(0), 0);
-                y += LDSP(point(0), 1);
-                double cost = costs.min();
-                costs.ones();
-                costs *= 1E8;
-                costs(2) = cost;
-
-                // Do the SDSP
-                int doneFlag = 0;
-                do {
                     for (int k = 0; k < 5; k++) {
-                        int refBlkVer = y + SDSP(k, 1);
-                        int refBlkHor = x + SDSP(k, 0);
+                        LDSP[k][0] = SDSP[k][0] * stepSize;
+                        LDSP[k][1] = SDSP[k][1] * stepSize;
+                    }
 
+                    // Do the LDSP
+                    for (int k = 0; k < maxIdx; k++) {
+                        int refBlkVer = y + LDSP[k][1];
+                        int refBlkHor = x + LDSP[k][0];
                         if (refBlkHor < 0
                             || refBlkHor+Bs-1 >= Ny
                             || refBlkVer < 0
                             || refBlkVer+Bs-1 >= Nx) {
                             continue;
-                        } else if (k == 2) {
-                            continue;
-                        } else if (refBlkHor < j-wind
-                                   || refBlkHor > j+wind
-                                   || refBlkVer < i-wind
-                                   || refBlkVer > i+wind ) {
-                            continue;
-                        } else if (chkMat(y-i+SDSP(k, 1)+wind,
-                                          x-j+SDSP(k, 0)+wind) == 1) {
+                        } else if (k == 2 || stepSize == 0) {
                             continue;
                         } else {
-                            arma::cube powblock = A(arma::span(refBlkVer,
-                                                               refBlkVer+Bs-1),
-                                                    arma::span(refBlkHor,
-                                                               refBlkHor+Bs-1),
-                                                    arma::span(iARPS2));
-                            if (curFr == 0) {
-                                costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                     - powblock.slice(0), "fro"),
-                                                 2) / (Bs*Bs);
-                            } else if (curFr < 0) {
-                                arma::ivec predpos = arma::vectorise(
-                                                       patches(arma::span(),
-                                                               arma::span(it),
-                                                               arma::span(iARPS1))
-                                                     - motions(arma::span(),
-                                                               arma::span(it),
-                                                               arma::span(iARPS3)));
-                                costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                     - powblock.slice(0), "fro"),
-                                                 2) / (Bs*Bs)
-                                            + pMot * std::sqrt(
-                                                std::pow(predpos(0)-refBlkVer, 2)
-                                                + std::pow(predpos(1)-refBlkHor, 2));
-                            } else if (curFr > 0) {
-                                arma::ivec predpos = arma::vectorise(
-                                                       patches(arma::span(),
-                                                               arma::span(it),
-                                                               arma::span(iARPS1))
-                                                     + motions(arma::span(),
-                                                               arma::span(it),
-                                                               arma::span(iARPS3)));
-                                costs(k) = std::pow(arma::norm(refblock.slice(0)
-                                                     - powblock.slice(0), "fro"),
-                                                 2) / (Bs*Bs)
-                                            + pMot * std::sqrt(
-                                                std::pow(predpos(0)-refBlkVer, 2)
-                                                + std::pow(predpos(1)-refBlkHor, 2));
-                            }
-                            chkMat(y-i+SDSP(k, 1)+wind,
-                                   x-j+SDSP(k, 0)+wind) = 1;
+                            costs[k] = BlockSSD<B>(refblock,
+                                                newFrame + refBlkVer + refBlkHor*Nx,
+                                                Nx, Bs) * norm
+                                       + MotionPenalty(curFr, refPositions + 2*it,
+                                                       predictor + 2*it,
+                                                       refBlkVer, refBlkHor);
+                            chkMat[(LDSP[k][1]+wind)*chkSize + LDSP[k][0]+wind] = it;
                         }
                     }
-                    point = arma::find(costs == costs.min());
-                    cost = costs.min();
 
-                    if (point(0) == 2) {
-                        doneFlag = 1;
-                    } else {
-                        x += SDSP(point(0), 0);
-                        y += SDSP(point(0), 1);
-                        costs.ones();
-                        costs *= 1E8;
-                        costs(2) = cost;
-                    }
-                } while (doneFlag == 0);
+                    int point = std::min_element(costs, costs+6) - costs;
+                    x += LDSP[point][0];
+                    y += LDSP[point][1];
+                    double cost = costs[point];
+                    std::fill_n(costs, 6, 1E8);
+                    costs[2] = cost;
+
+                    // Do the SDSP
+                    int doneFlag = 0;
+                    do {
+                        for (int k = 0; k < 5; k++) {
+                            int refBlkVer = y + SDSP[k][1];
+                            int refBlkHor = x + SDSP[k][0];
+                            int chkIdx = (y-i+SDSP[k][1]+wind)*chkSize
+                                         + x-j+SDSP[k][0]+wind;
+
+                            if (refBlkHor < 0
+                                || refBlkHor+Bs-1 >= Ny
+                                || refBlkVer < 0
+                                || refBlkVer+Bs-1 >= Nx) {
+                                continue;
+                            } else if (k == 2) {
+                                continue;
+                            } else if (refBlkHor < j-wind
+                                       || refBlkHor > j+wind
+                                       || refBlkVer < i-wind
+                                       || refBlkVer > i+wind ) {
+                                continue;
+                            } else if (chkMat[chkIdx] == it) {
+                                continue;
+                            } else {
+                                costs[k] = BlockSSD<B>(refblock,
+                                                    newFrame + refBlkVer + refBlkHor*Nx,
+                                                    Nx, Bs) * norm
+                                           + MotionPenalty(curFr, refPositions + 2*it,
+                                                           predictor + 2*it,
+                                                           refBlkVer, refBlkHor);
+                                chkMat[chkIdx] = it;
+                            }
+                        }
+                        point = std::min_element(costs, costs+5) - costs;
+                        cost = costs[point];
 
-                int ystep = y - i;
-                int xstep = x - j;
+                        if (point == 2) {
+                            doneFlag = 1;
+                        } else {
+                            x += SDSP[point][0];
+                            y += SDSP[point][1];
+                            std::fill_n(costs, 6, 1E8);
+                            costs[2] = cost;
+                        }
+                    } while (doneFlag == 0);
 
-                motions(0, it, iARPS3) = ystep;
-                motions(1, it, iARPS3) = xstep;
-                patches(0, it, iARPS2) = y;
-                patches(1, it, iARPS2) = x;
-            }
+                    int ystep = y - i;
+                    int xstep = x - j;
+
+                    motionsOut[2*it] = ystep;
+                    motionsOut[2*it+1] = xstep;
+                    positions[2*it] = y;
+                    positions[2*it+1] = x;
+                }
+            }, 0, vecSize, 64);
+            return;
+        }
+
+        // Adaptive Rood Pattern Search ( ARPS) method
+        void ARPSMotionEstimation(const arma::Cube<eT> &A,
+                                  int curFr,
+                                  int iARPS1,
+                                  int iARPS2,
+                                  int iARPS3) {
+            Match(A.slice_memptr(iARPS1),
+                  A.slice_memptr(iARPS2),
+                  curFr,
+                  patches.slice_memptr(iARPS1),
+                  motions.slice_memptr(iARPS3),
+                  patches.slice_memptr(iARPS2),
+                  motions.slice_memptr(iARPS3));
             return;
         }
+
+        // Penalty on the distance from the position predicted by the
+        // previous motion vector. Currently not used, but motion
+        // estimation can be predictive if pMot is larger than 0!
+        static double MotionPenalty(int curFr,
+                                    const arma::sword *refPosition,
+                                    const arma::sword *predictor,
+                                    int refBlkVer,
+                                    int refBlkHor) {
+            const double pMot = 0.0;
+            if (pMot == 0. || curFr == 0) {
+                return 0.;
+            }
+            int sgn = (curFr < 0) ? -1 : 1;
+            int predVer = refPosition[0] + sgn * predictor[0];
+            int predHor = refPosition[1] + sgn * predictor[1];
+            return pMot * std::sqrt(std::pow(predVer-refBlkVer, 2)
+                                    + std::pow(predHor-refBlkHor, 2));
+        }
+
+        // Sum of squared differences between two Bs x Bs blocks
+        // of column-major frames with leading dimension ld, where
+        // Bs is B if that is given at compile time (B > 0)
+        template <int B>
+        static double BlockSSD(const double *a,
+                               const double *b,
+                               int ld,
+                               int size) {
+            const int Bs = (B > 0) ? B : size;
+            double sum = 0.;
+            #if defined(__AVX512F__)
+              __m512d acc = _mm512_setzero_pd();
+              __mmask8 tail = static_cast<__mmask8>((1u << (Bs % 8)) - 1);
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  int r = 0;
+                  for (; r + 8 <= Bs; r += 8) {
+                      __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a+r), _mm512_loadu_pd(b+r));
+                      acc = _mm512_fmadd_pd(d, d, acc);
+                  }
+                  if (r < Bs) {
+                      __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(tail, a+r),
+                                                _mm512_maskz_loadu_pd(tail, b+r));
+                      acc = _mm512_fmadd_pd(d, d, acc);
+                  }
+              }
+              sum = _mm512_reduce_add_pd(acc);
+            #elif defined(__AVX2__)
+              __m256d acc = _mm256_setzero_pd();
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  int r = 0;
+                  for (; r + 4 <= Bs; r += 4) {
+                      __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a+r), _mm256_loadu_pd(b+r));
+                      acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+                  }
+                  for (; r < Bs; r++) {
+                      double d = a[r] - b[r];
+                      sum += d * d;
+                  }
+              }
+              __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(acc),
+                                      _mm256_extractf128_pd(acc, 1));
+              sum += _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+            #elif defined(__ARM_NEON) && defined(__aarch64__)
+              float64x2_t acc = vdupq_n_f64(0.);
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  int r = 0;
+                  for (; r + 2 <= Bs; r += 2) {
+                      float64x2_t d = vsubq_f64(vld1q_f64(a+r), vld1q_f64(b+r));
+                      acc = vfmaq_f64(acc, d, d);
+                  }
+                  for (; r < Bs; r++) {
+                      double d = a[r] - b[r];
+                      sum += d * d;
+                  }
+              }
+              sum += vaddvq_f64(acc);
+            #else
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  for (int r = 0; r < Bs; r++) {
+                      double d = a[r] - b[r];
+                      sum += d * d;
+                  }
+              }
+            #endif
+            return sum;
+        }
+
+        // As above for single-precision frames, with twice the lanes.
+        // The squares are summed in float lanes down each column only,
+        // and the column sums are widened and accumulated in double
+        template <int B>
+        static double BlockSSD(const float *a,
+                               const float *b,
+                               int ld,
+                               int size) {
+            const int Bs = (B > 0) ? B : size;
+            double sum = 0.;
+            #if defined(__AVX512F__)
+              __m512d acc = _mm512_setzero_pd();
+              __mmask16 tail = static_cast<__mmask16>((1u << (Bs % 16)) - 1);
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  __m512 col = _mm512_setzero_ps();
+                  int r = 0;
+                  for (; r + 16 <= Bs; r += 16) {
+                      __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a+r), _mm512_loadu_ps(b+r));
+                      col = _mm512_fmadd_ps(d, d, col);
+                  }
+                  if (r < Bs) {
+                      __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, a+r),
+                                               _mm512_maskz_loadu_ps(tail, b+r));
+                      col = _mm512_fmadd_ps(d, d, col);
+                  }
+                  __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(col), 1));
+                  acc = _mm512_add_pd(acc, _mm512_cvtps_pd(_mm512_castps512_ps256(col)));
+                  acc = _mm512_add_pd(acc, _mm512_cvtps_pd(hi));
+              }
+              sum = _mm512_reduce_add_pd(acc);
+            #elif defined(__AVX2__)
+              __m256d acc = _mm256_setzero_pd();
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  __m256 col = _mm256_setzero_ps();
+                  int r = 0;
+                  for (; r + 8 <= Bs; r += 8) {
+                      __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+r), _mm256_loadu_ps(b+r));
+                      col = _mm256_add_ps(col, _mm256_mul_ps(d, d));
+                  }
+                  for (; r < Bs; r++) {
+                      double d = static_cast<double>(a[r]) - b[r];
+                      sum += d * d;
+                  }
+                  acc = _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_castps256_ps128(col)));
+                  acc = _mm256_add_pd(acc, _mm256_cvtps_pd(_mm256_extractf128_ps(col, 1)));
+              }
+              __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(acc),
+                                      _mm256_extractf128_pd(acc, 1));
+              sum += _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+            #elif defined(__ARM_NEON) && defined(__aarch64__)
+              float64x2_t acc = vdupq_n_f64(0.);
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  float32x4_t col = vdupq_n_f32(0.f);
+                  int r = 0;
+                  for (; r + 4 <= Bs; r += 4) {
+                      float32x4_t d = vsubq_f32(vld1q_f32(a+r), vld1q_f32(b+r));
+                      col = vfmaq_f32(col, d, d);
+                  }
+                  for (; r < Bs; r++) {
+                      double d = static_cast<double>(a[r]) - b[r];
+                      sum += d * d;
+                  }
+                  acc = vaddq_f64(acc, vcvt_f64_f32(vget_low_f32(col)));
+                  acc = vaddq_f64(acc, vcvt_high_f64_f32(col));
+              }
+              sum += vaddvq_f64(acc);
+            #else
+              for (int c = 0; c < Bs; c++, a += ld, b += ld) {
+                  for (int r = 0; r < Bs; r++) {
+                      double d = static_cast<double>(a[r]) - b[r];
+                      sum += d * d;
+                  }
+              }
+            #endif
+            return sum;
+        }
 };
 
 #endif
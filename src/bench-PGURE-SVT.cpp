@@ -0,0 +1,351 @@
+/***************************************************************************
+
+    PGURE-SVT Benchmark
+
+    Author: Tom Furnival
+    Email:  tjof2@cam.ac.uk
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Times each stage of the denoising separately on a synthetic
+    Poisson-Gaussian sequence, and writes the results as JSON so
+    they can be compared between releases and used to size jobs.
+
+    Usage: ./pgure-bench [key:value ...] with the keys
+
+        frame_size              Nx = Ny of the frames (default 256)
+        trajectory_length       T, frames in the sequence (default 15)
+        patch_size              Bs (default 8)
+        patch_overlap           Bo (default 2)
+        alpha, mu, sigma        noise parameters (default 0.1)
+        motion_neighbourhood    ARPS search size (default 7)
+        median_filter           median filter radius (default 5)
+        hot_pixel               hot-pixel threshold (default 10)
+        svd_method              see SVDMethod in svt.hpp (default 0)
+        precision               see Precision in pgure.hpp (default 0)
+        num_threads             threads (default 4)
+        repeats                 timed runs of each stage (default 5)
+        seed                    of the synthetic sequence (default 1)
+        output                  JSON file (default standard output)
+
+    This file is part of PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+// C++ headers
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// OpenMP library
+#include <omp.h>
+
+// Armadillo library
+#include <armadillo>
+
+// Constant-time median filter
+#include "medfilter.h"
+
+// Own headers
+#include "arps.hpp"
+#include "hotpixel.hpp"
+#include "noise.hpp"
+#include "params.hpp"
+#include "parallel.hpp"
+#include "pgure.hpp"
+#include "svt.hpp"
+
+// Timings of one stage over the repeats, in seconds
+struct StageTiming {
+    std::string name;
+    std::string per;
+    std::vector<double> seconds;
+};
+
+// Run func once untimed (to warm caches and allocations),
+// then time it repeats times
+StageTiming TimeStage(const std::string &name,
+                      const std::string &per,
+                      int repeats,
+                      const std::function<void()> &func) {
+    StageTiming timing;
+    timing.name = name;
+    timing.per = per;
+    func();
+    for (int i = 0; i < repeats; i++) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        timing.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    return timing;
+}
+
+// Synthetic sequence of Gaussian spots drifting by about a pixel
+// per frame, with a peak of 4095 counts, corrupted as in
+// PoissonGaussianNoiseGenerator() of the Python package: scaled to
+// [0, 1], y = alpha * Poisson(x / alpha) + mu + sigma * N(0, 1),
+// then shifted to be non-negative and scaled back to the peak.
+// Counts are rounded, as read from a detector, and a few hot
+// pixels are set to the maximum
+arma::cube SyntheticSequence(int Nx,
+                             int T,
+                             double alpha,
+                             double mu,
+                             double sigma,
+                             unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    std::normal_distribution<double> gaussian(0., 1.);
+
+    const double peak = 4095.;
+    const int spots = std::max(4, Nx * Nx / 1024);
+    arma::mat spot(spots, 5);
+    for (int s = 0; s < spots; s++) {
+        spot(s, 0) = uniform(rng) * Nx;            // x
+        spot(s, 1) = uniform(rng) * Nx;            // y
+        spot(s, 2) = 2. * uniform(rng) - 1.;       // dx per frame
+        spot(s, 3) = 2. * uniform(rng) - 1.;       // dy per frame
+        spot(s, 4) = 2. + 4. * uniform(rng);       // width
+    }
+
+    arma::cube X(Nx, Nx, T, arma::fill::zeros);
+    for (int k = 0; k < T; k++) {
+        for (int s = 0; s < spots; s++) {
+            double cx = spot(s, 0) + k * spot(s, 2);
+            double cy = spot(s, 1) + k * spot(s, 3);
+            double w2 = 2. * spot(s, 4) * spot(s, 4);
+            for (int j = 0; j < Nx; j++) {
+                for (int i = 0; i < Nx; i++) {
+                    double d2 = (i - cx) * (i - cx) + (j - cy) * (j - cy);
+                    X(i, j, k) += std::exp(-d2 / w2);
+                }
+            }
+        }
+    }
+    X /= X.max();
+
+    arma::cube Y(Nx, Nx, T);
+    for (arma::uword i = 0; i < X.n_elem; i++) {
+        std::poisson_distribution<long> poisson(X(i) / alpha);
+        Y(i) = alpha * poisson(rng) + mu + sigma * gaussian(rng);
+    }
+    Y += std::abs(Y.min());
+    Y = arma::round(peak * Y / Y.max());
+
+    for (int h = 0; h < T * std::max(1, Nx * Nx / 4096); h++) {
+        Y(rng() % Y.n_elem) = peak;
+    }
+    return Y;
+}
+
+// The stages that depend on the element type of the decompositions
+template <typename eT, typename accT>
+void TimeDecompositions(const arma::cube &u,
+                        const arma::icube &patches,
+                        int Bs,
+                        int Bo,
+                        double alpha,
+                        double mu,
+                        double sigma,
+                        int SVDMethod,
+                        int repeats,
+                        std::vector<StageTiming> &results) {
+    int Nx = u.n_rows, Ny = u.n_cols, T = u.n_slices;
+    double lambda = arma::accu(u) / (Nx * Ny * T);
+
+    arma::Cube<eT> ue = arma::conv_to<arma::Cube<eT>>::from(u);
+    SVT<eT> svt;
+    svt.Initialize(patches, Nx, Ny, T, Bs, Bo, SVDMethod, u.max());
+    results.push_back(TimeStage("SVT::Decompose", "window", repeats, [&]() {
+        svt.Decompose(ue);
+    }));
+    arma::Cube<eT> v;
+    results.push_back(TimeStage("SVT::Reconstruct", "window", repeats, [&]() {
+        svt.Reconstruct(lambda, v);
+    }));
+
+    PGURE<eT, accT> optimizer;
+    optimizer.Initialize(u, patches, Bs, Bo, alpha, mu, sigma,
+                         SVDMethod, u.max(), false);
+    std::vector<double> x(1, lambda), grad;
+    results.push_back(TimeStage("PGURE::CalculatePGURE", "evaluation", repeats, [&]() {
+        optimizer.CalculatePGURE(x, grad, &optimizer);
+    }));
+    return;
+}
+
+int main(int argc, char** argv) {
+    // Options are given as key:value, and parsed as a parameter file
+    std::stringstream params;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        size_t colon = arg.find(':');
+        if (colon == std::string::npos) {
+            std::cout<<"  Usage: ./pgure-bench [key:value ...]"<<std::endl;
+            return -1;
+        }
+        params<<arg.substr(0, colon)<<" : "<<arg.substr(colon + 1)<<std::endl;
+    }
+    std::map<std::string, std::string> programOptions;
+    ParseParameters(params, programOptions);
+
+    int Nx = (programOptions.count("frame_size") == 1) ? std::stoi(programOptions.at("frame_size")) : 256;
+    int T = (programOptions.count("trajectory_length") == 1) ? std::stoi(programOptions.at("trajectory_length")) : 15;
+    int Bs = (programOptions.count("patch_size") == 1) ? std::stoi(programOptions.at("patch_size")) : 8;
+    int Bo = (programOptions.count("patch_overlap") == 1) ? std::stoi(programOptions.at("patch_overlap")) : 2;
+    double alpha = (programOptions.count("alpha") == 1) ? std::stod(programOptions.at("alpha")) : 0.1;
+    double mu = (programOptions.count("mu") == 1) ? std::stod(programOptions.at("mu")) : 0.1;
+    double sigma = (programOptions.count("sigma") == 1) ? std::stod(programOptions.at("sigma")) : 0.1;
+    int MotionP = (programOptions.count("motion_neighbourhood") == 1) ? std::stoi(programOptions.at("motion_neighbourhood")) : 7;
+    int MedianSize = (programOptions.count("median_filter") == 1) ? std::stoi(programOptions.at("median_filter")) : 5;
+    double hotpixelthreshold = (programOptions.count("hot_pixel") == 1) ? std::stod(programOptions.at("hot_pixel")) : 10;
+    int SVDMethod = (programOptions.count("svd_method") == 1) ? std::stoi(programOptions.at("svd_method")) : 0;
+    int Precision = (programOptions.count("precision") == 1) ? std::stoi(programOptions.at("precision")) : 0;
+    int num_threads = (programOptions.count("num_threads") == 1) ? std::max(1, std::stoi(programOptions.at("num_threads"))) : 4;
+    int repeats = (programOptions.count("repeats") == 1) ? std::max(1, std::stoi(programOptions.at("repeats"))) : 5;
+    unsigned seed = (programOptions.count("seed") == 1) ? std::stoul(programOptions.at("seed")) : 1;
+
+    // As checked by the executable and the Python package
+    T = (Bs*Bs<T) ? (Bs*Bs)-1 : T;
+    if (T % 2 == 0) {
+        std::cout<<"**WARNING** Trajectory length must be odd"<<std::endl;
+        return -1;
+    }
+    int framewindow = T / 2;
+
+    // Threads go to the block-level loops on the pool, as for a
+    // single window, with OpenMP teams kept to one thread
+    #if defined(_OPENMP)
+      omp_set_dynamic(0);
+      omp_set_num_threads(1);
+    #endif
+    parallel_set_num_threads(num_threads);
+    parallel_set_blas_threads(1);
+
+    // The stages print progress, which would get into the JSON
+    std::ostringstream quiet;
+    std::streambuf *console = std::cout.rdbuf(quiet.rdbuf());
+
+    arma::cube noisy = SyntheticSequence(Nx, T, alpha, mu, sigma, seed);
+    std::vector<StageTiming> results;
+
+    // Median filtering of each frame, from 16-bit counts
+    arma::Cube<unsigned short> counts = arma::conv_to<arma::Cube<unsigned short>>::from(noisy);
+    arma::Cube<unsigned short> filtcounts(Nx, Nx, T);
+    results.push_back(TimeStage("ConstantTimeMedianFilter", "frame", repeats, [&]() {
+        ConstantTimeMedianFilter(counts.slice_memptr(0), filtcounts.slice_memptr(0),
+                                 Nx, Nx, Nx, Nx, MedianSize, 1, MedianFilterCacheSize());
+    }));
+    for (int k = 1; k < T; k++) {
+        ConstantTimeMedianFilter(counts.slice_memptr(k), filtcounts.slice_memptr(k),
+                                 Nx, Nx, Nx, Nx, MedianSize, 1, MedianFilterCacheSize());
+    }
+    arma::cube filtered = arma::conv_to<arma::cube>::from(filtcounts);
+    filtered /= filtered.max();
+
+    // Hot-pixel filtering of the sequence (of a fresh copy each time)
+    arma::cube cleaned;
+    results.push_back(TimeStage("HotPixelFilter", "sequence", repeats, [&]() {
+        cleaned = noisy;
+        HotPixelFilter(cleaned, hotpixelthreshold);
+    }));
+
+    // The remaining stages work on the normalized window
+    arma::cube u = cleaned / cleaned.max();
+
+    // Noise estimation needs square frames of 2^N pixels for the quadtree
+    if (Nx > 0 && (Nx & (Nx - 1)) == 0) {
+        results.push_back(TimeStage("NoiseEstimator::Estimate", "window", repeats, [&]() {
+            double a = -1., m = -1., s = -1.;
+            NoiseEstimator noise;
+            noise.Estimate(u, a, m, s, 4, 4);
+        }));
+    }
+
+    // Motion estimation of the window around its middle frame
+    arma::icube sequencePatches;
+    results.push_back(TimeStage("ARPSMotionEstimation", "window", repeats, [&]() {
+        MotionEstimator<double> motion;
+        motion.Estimate(filtered, framewindow, framewindow, T, Bs, MotionP);
+        sequencePatches = motion.GetEstimate();
+    }));
+
+    switch (Precision) {
+        case PRECISION_FLOAT:
+            TimeDecompositions<float, float>(u, sequencePatches, Bs, Bo, alpha, mu, sigma,
+                                             SVDMethod, repeats, results);
+            break;
+        case PRECISION_MIXED:
+            TimeDecompositions<float, double>(u, sequencePatches, Bs, Bo, alpha, mu, sigma,
+                                              SVDMethod, repeats, results);
+            break;
+        default:
+            TimeDecompositions<double, double>(u, sequencePatches, Bs, Bo, alpha, mu, sigma,
+                                               SVDMethod, repeats, results);
+            break;
+    }
+    std::cout.rdbuf(console);
+
+    // Write the results
+    std::ofstream outfile;
+    if (programOptions.count("output") == 1) {
+        outfile.open(programOptions.at("output"), std::ios::out);
+    }
+    std::ostream &json = outfile.is_open() ? outfile : std::cout;
+    json<<std::setprecision(9);
+    json<<"{"<<std::endl;
+    json<<"  \"version\": \"0.3.2\","<<std::endl;
+    json<<"  \"parameters\": {"
+        <<"\"frame_size\": "<<Nx<<", "
+        <<"\"trajectory_length\": "<<T<<", "
+        <<"\"patch_size\": "<<Bs<<", "
+        <<"\"patch_overlap\": "<<Bo<<", "
+        <<"\"alpha\": "<<alpha<<", "
+        <<"\"mu\": "<<mu<<", "
+        <<"\"sigma\": "<<sigma<<", "
+        <<"\"motion_neighbourhood\": "<<MotionP<<", "
+        <<"\"median_filter\": "<<MedianSize<<", "
+        <<"\"hot_pixel\": "<<hotpixelthreshold<<", "
+        <<"\"svd_method\": "<<SVDMethod<<", "
+        <<"\"precision\": "<<Precision<<", "
+        <<"\"num_threads\": "<<num_threads<<", "
+        <<"\"repeats\": "<<repeats<<", "
+        <<"\"seed\": "<<seed<<"},"<<std::endl;
+    json<<"  \"stages\": ["<<std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        arma::vec s(results[i].seconds);
+        json<<"    {\"name\": \""<<results[i].name<<"\", "
+            <<"\"per\": \""<<results[i].per<<"\", "
+            <<"\"min\": "<<s.min()<<", "
+            <<"\"median\": "<<arma::median(s)<<", "
+            <<"\"mean\": "<<arma::mean(s)<<", "
+            <<"\"max\": "<<s.max()<<"}"
+            <<((i + 1 < results.size()) ? "," : "")<<std::endl;
+    }
+    json<<"  ]"<<std::endl;
+    json<<"}"<<std::endl;
+    return 0;
+}
@@ -0,0 +1,56 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Compile-time block sizes for the block kernels.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef BLOCKSIZE_H
+#define BLOCKSIZE_H
+
+// C++ headers
+#include <type_traits>
+
+// Block kernels are templated on the block size B, with B = 0
+// for a size only known at run time. Fixed sizes give loops of
+// constant trip count, which the compiler fully unrolls and
+// vectorizes, while the arithmetic (and its order) is the same,
+// so results don't depend on which version runs.
+// Calls f(std::integral_constant<int, B>()) with B = Bs for the
+// commonly used block sizes, and B = 0 otherwise
+template <typename F>
+inline void DispatchBlockSize(int Bs, F &&f) {
+    switch (Bs) {
+        case 4:
+            f(std::integral_constant<int, 4>());
+            break;
+        case 8:
+            f(std::integral_constant<int, 8>());
+            break;
+        case 16:
+            f(std::integral_constant<int, 16>());
+            break;
+        default:
+            f(std::integral_constant<int, 0>());
+            break;
+    }
+    return;
+}
+
+#endif
@@ -0,0 +1,292 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Checkpoints of cleaned frames, for resuming interrupted jobs.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// C++ headers
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// File truncation
+#include <unistd.h>
+
+// Armadillo library
+#include <armadillo>
+
+// Per-frame results kept with each cleaned frame
+struct FrameState {
+    double lambda;
+    double alpha;
+    double mu;
+    double sigma;
+};
+
+// Cleaned frames are appended to the checkpoint file as they are
+// done, with their state and the motion fields of the frame computed
+// so far, so a job that is stopped can pick up where it left off.
+// The file is a header identifying the job (its key, which should
+// hold every parameter the results depend on, and the frame and
+// motion field sizes), then one record per frame:
+//   frame, motion fields present           2 x int32
+//   lambda, alpha, mu, sigma               4 x double
+//   cleaned frame (before normalization)   rows x cols doubles
+//   forward, backward, predicted fields    2 x blocks int16 each
+//   end marker                             uint32
+// On opening, a record cut short by the job being killed is dropped,
+// and a file written by a different job is started afresh
+class Checkpoint {
+ public:
+        Checkpoint() {}
+        ~Checkpoint() {
+            Close();
+        }
+
+        // Open or create the checkpoint, reading the frames done so
+        // far. Returns false if the file can't be written
+        bool Open(const std::string &filenameIn,
+                  const std::string &key,
+                  int rowsIn,
+                  int colsIn,
+                  int blocksIn) {
+            filename = filenameIn;
+            rows = rowsIn;
+            cols = colsIn;
+            blocks = blocksIn;
+            index.clear();
+
+            std::streamoff end = Scan(key);
+            if (end > 0) {
+                if (truncate(filename.c_str(), end) != 0) {
+                    return false;
+                }
+            } else {
+                std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+                uint32_t length = key.size();
+                int32_t sizes[3] = {rows, cols, blocks};
+                out.write(magic, sizeof(magic));
+                out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+                out.write(key.data(), length);
+                out.write(reinterpret_cast<const char *>(sizes), sizeof(sizes));
+                if (!out) {
+                    return false;
+                }
+            }
+            file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(0, std::ios::end);
+            return file.good();
+        }
+
+        void Close() {
+            if (file.is_open()) {
+                file.close();
+            }
+            return;
+        }
+
+        bool IsOpen() const {
+            return file.is_open();
+        }
+
+        // Frames in the checkpoint, in order
+        std::vector<int> Frames() {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<int> frames;
+            for (auto &entry : index) {
+                frames.push_back(entry.first);
+            }
+            return frames;
+        }
+
+        // Whether every frame in [first, last) is in the checkpoint
+        bool Has(int first,
+                 int last) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int k = first; k < last; k++) {
+                if (index.count(k) == 0) {
+                    return false;
+                }
+            }
+            return file.is_open();
+        }
+
+        // State of a frame, without reading the frame back
+        FrameState State(int frame) {
+            std::lock_guard<std::mutex> guard(lock);
+            FrameState state = {};
+            file.seekg(index.at(frame) + static_cast<std::streamoff>(2 * sizeof(int32_t)));
+            file.read(reinterpret_cast<char *>(&state), sizeof(state));
+            return state;
+        }
+
+        // Read back a frame, with whichever of its motion fields were
+        // saved (the others are left empty). Safe from any thread
+        FrameState Read(int frame,
+                        arma::mat &clean,
+                        arma::Mat<short> &forward,
+                        arma::Mat<short> &backward,
+                        arma::Mat<short> &predicted) {
+            std::lock_guard<std::mutex> guard(lock);
+            FrameState state = {};
+            int32_t head[2] = {0, 0};
+            file.seekg(index.at(frame));
+            file.read(reinterpret_cast<char *>(head), sizeof(head));
+            file.read(reinterpret_cast<char *>(&state), sizeof(state));
+            clean.set_size(rows, cols);
+            file.read(reinterpret_cast<char *>(clean.memptr()), clean.n_elem * sizeof(double));
+            arma::Mat<short> *fields[3] = {&forward, &backward, &predicted};
+            for (int i = 0; i < 3; i++) {
+                fields[i]->reset();
+                if (head[1] & (1 << i)) {
+                    fields[i]->set_size(2, blocks);
+                    file.read(reinterpret_cast<char *>(fields[i]->memptr()), FieldBytes());
+                }
+            }
+            return state;
+        }
+
+        // Append a cleaned frame, with the motion fields given by the
+        // bits of fields (forward = 1, backward = 2, predicted = 4).
+        // Frames already in the checkpoint are not written again.
+        // The record is flushed before returning. Safe from any thread
+        void Write(int frame,
+                   const FrameState &state,
+                   const arma::mat &clean,
+                   int fields,
+                   const arma::Mat<short> &forward,
+                   const arma::Mat<short> &backward,
+                   const arma::Mat<short> &predicted) {
+            const arma::Mat<short> *field[3] = {&forward, &backward, &predicted};
+            int32_t head[2] = {frame, 0};
+            for (int i = 0; i < 3; i++) {
+                if ((fields & (1 << i)) && field[i]->n_rows == 2
+                    && static_cast<int>(field[i]->n_cols) == blocks) {
+                    head[1] |= (1 << i);
+                }
+            }
+
+            // Assemble the record first, so it goes out in one write
+            std::vector<char> record(RecordBytes(head[1]));
+            char *p = record.data();
+            std::memcpy(p, head, sizeof(head));
+            p += sizeof(head);
+            std::memcpy(p, &state, sizeof(state));
+            p += sizeof(state);
+            std::memcpy(p, clean.memptr(), static_cast<size_t>(rows) * cols * sizeof(double));
+            p += static_cast<size_t>(rows) * cols * sizeof(double);
+            for (int i = 0; i < 3; i++) {
+                if (head[1] & (1 << i)) {
+                    std::memcpy(p, field[i]->memptr(), FieldBytes());
+                    p += FieldBytes();
+                }
+            }
+            std::memcpy(p, &endMarker, sizeof(endMarker));
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!file.is_open() || index.count(frame) > 0) {
+                return;
+            }
+            file.seekp(0, std::ios::end);
+            std::streamoff offset = file.tellp();
+            file.write(record.data(), record.size());
+            file.flush();
+            if (file.good()) {
+                index[frame] = offset;
+            }
+            return;
+        }
+
+ private:
+        std::string filename;
+        std::fstream file;
+        std::mutex lock;
+        int rows = 0, cols = 0, blocks = 0;
+
+        // Offset of the record of each frame
+        std::map<int, std::streamoff> index;
+
+        static constexpr char magic[8] = {'P', 'G', 'U', 'R', 'E', 'C', 'K', '1'};
+        static constexpr uint32_t endMarker = 0x454E4F44;
+
+        size_t FieldBytes() const {
+            return static_cast<size_t>(2) * blocks * sizeof(short);
+        }
+
+        size_t RecordBytes(int fields) const {
+            size_t bytes = 2 * sizeof(int32_t) + sizeof(FrameState)
+                           + static_cast<size_t>(rows) * cols * sizeof(double)
+                           + sizeof(endMarker);
+            for (int i = 0; i < 3; i++) {
+                bytes += (fields & (1 << i)) ? FieldBytes() : 0;
+            }
+            return bytes;
+        }
+
+        // Index the complete records of an existing checkpoint of this
+        // job, returning the end of the last one (0 if there is none)
+        std::streamoff Scan(const std::string &key) {
+            std::ifstream in(filename, std::ios::binary);
+            if (!in) {
+                return 0;
+            }
+            char header[sizeof(magic)];
+            uint32_t length = 0;
+            in.read(header, sizeof(header));
+            in.read(reinterpret_cast<char *>(&length), sizeof(length));
+            if (!in || std::memcmp(header, magic, sizeof(magic)) != 0 || length != key.size()) {
+                return 0;
+            }
+            std::string stored(length, '\0');
+            int32_t sizes[3];
+            in.read(&stored[0], length);
+            in.read(reinterpret_cast<char *>(sizes), sizeof(sizes));
+            if (!in || stored != key || sizes[0] != rows || sizes[1] != cols || sizes[2] != blocks) {
+                return 0;
+            }
+
+            std::streamoff end = in.tellg();
+            for (;;) {
+                int32_t head[2];
+                uint32_t marker = 0;
+                in.read(reinterpret_cast<char *>(head), sizeof(head));
+                if (!in) {
+                    break;
+                }
+                in.seekg(RecordBytes(head[1]) - sizeof(head) - sizeof(marker), std::ios::cur);
+                in.read(reinterpret_cast<char *>(&marker), sizeof(marker));
+                if (!in || marker != endMarker) {
+                    break;
+                }
+                index[head[0]] = end;
+                end = in.tellg();
+            }
+            return end;
+        }
+};
+
+#endif
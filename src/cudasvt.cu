@@ -0,0 +1,265 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    GPU evaluation of the SVT reconstruction and PGURE data term.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+// C++ headers
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// CUDA runtime
+#include <cuda_runtime.h>
+
+// Own header
+#include "cudasvt.hpp"
+
+static const int numThreads = 256;
+
+static void Check(cudaError_t err) {
+    if (err != cudaSuccess) {
+        throw std::runtime_error(std::string("CUDA error: ") + cudaGetErrorString(err));
+    }
+}
+
+// Grow a device buffer to hold at least n elements
+template <typename T>
+static void Reserve(T *&ptr, size_t &capacity, size_t n) {
+    if (n > capacity) {
+        if (ptr != nullptr) {
+            Check(cudaFree(ptr));
+        }
+        Check(cudaMalloc(reinterpret_cast<void **>(&ptr), n * sizeof(T)));
+        capacity = n;
+    }
+}
+
+// One thread block per SVT block: threshold its singular values
+// into shared memory as in SVT::Threshold(), then rebuild the
+// Bs*Bs x T block and add it into uhat along its trajectory
+__global__ void ReconstructKernel(const double *factors,
+                                  const int *ranks,
+                                  const int *positions,
+                                  int stride,
+                                  int Bs,
+                                  int K,
+                                  int Nx,
+                                  int Ny,
+                                  int T,
+                                  double lambda,
+                                  double *uhat) {
+    extern __shared__ double fS[];
+
+    int it = blockIdx.x;
+    int BsBs = Bs*Bs;
+    const double *Ub = factors + static_cast<size_t>(it) * stride;
+    const double *Sb = Ub + BsBs*K;
+    const double *Vb = Sb + K;
+    int rank = ranks[it];
+
+    // Singular values are descending, so Sb[0] is the maximum
+    double smax = Sb[0];
+    for (int r = threadIdx.x; r < rank; r += blockDim.x) {
+        double s = Sb[r];
+        double w = fabs(smax * exp(-lambda * s * s / 2));
+        fS[r] = copysign(fmax(fabs(s) - w, 0.), s);
+    }
+    __syncthreads();
+
+    for (int e = threadIdx.x; e < BsBs*T; e += blockDim.x) {
+        int p = e % BsBs;
+        int k = e / BsBs;
+        double val = 0.;
+        for (int r = 0; r < rank; r++) {
+            val += Ub[p + r*BsBs] * fS[r] * Vb[k + r*T];
+        }
+        int y = positions[2*(it*T + k)] + p % Bs;
+        int x = positions[2*(it*T + k) + 1] + p / Bs;
+        atomicAdd(&uhat[y + static_cast<size_t>(x)*Nx + static_cast<size_t>(k)*Nx*Ny], val);
+    }
+}
+
+// Sum of (uhat * invweights - u)^2, reduced per thread block
+__global__ void ErrorKernel(const double *uhat,
+                            const double *invweights,
+                            const double *u,
+                            size_t n,
+                            double *result) {
+    __shared__ double partial[numThreads];
+
+    double sum = 0.;
+    for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x) {
+        double d = uhat[i] * invweights[i] - u[i];
+        sum += d * d;
+    }
+    partial[threadIdx.x] = sum;
+    __syncthreads();
+
+    for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (threadIdx.x < s) {
+            partial[threadIdx.x] += partial[threadIdx.x + s];
+        }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) {
+        atomicAdd(result, partial[0]);
+    }
+}
+
+// Include the weighting
+__global__ void WeightKernel(double *uhat,
+                             const double *invweights,
+                             size_t n) {
+    for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += gridDim.x * blockDim.x) {
+        uhat[i] *= invweights[i];
+    }
+}
+
+struct CudaSVT::Impl {
+    bool available = false;
+    cudaStream_t stream = nullptr;
+
+    int Nx = 0, Ny = 0, T = 0;
+    int numBlocks = 0, stride = 0, Bs = 0, K = 0;
+
+    // Resident window, weights and factors, and the reconstruction
+    double *u = nullptr, *invweights = nullptr, *uhat = nullptr;
+    double *factors = nullptr, *result = nullptr;
+    int *ranks = nullptr, *positions = nullptr;
+    size_t uCap = 0, invCap = 0, uhatCap = 0, factorsCap = 0, resultCap = 0;
+    size_t ranksCap = 0, positionsCap = 0;
+
+    size_t WindowSize() const {
+        return static_cast<size_t>(Nx) * Ny * T;
+    }
+
+    int GridSize() const {
+        size_t blocks = (WindowSize() + numThreads - 1) / numThreads;
+        return static_cast<int>(std::min(blocks, static_cast<size_t>(1024)));
+    }
+
+    // Rebuild Uhat (unweighted) for a given lambda
+    void Build(double lambda) {
+        Check(cudaMemsetAsync(uhat, 0, WindowSize() * sizeof(double), stream));
+        ReconstructKernel<<<numBlocks, numThreads, K * sizeof(double), stream>>>(
+            factors, ranks, positions, stride, Bs, K, Nx, Ny, T, lambda, uhat);
+        Check(cudaGetLastError());
+    }
+};
+
+CudaSVT::CudaSVT() {
+    impl = new Impl;
+    int count = 0;
+    if (cudaGetDeviceCount(&count) == cudaSuccess && count > 0) {
+        impl->available = (cudaStreamCreate(&impl->stream) == cudaSuccess);
+    }
+}
+
+CudaSVT::~CudaSVT() {
+    if (impl->available) {
+        cudaFree(impl->u);
+        cudaFree(impl->invweights);
+        cudaFree(impl->uhat);
+        cudaFree(impl->factors);
+        cudaFree(impl->result);
+        cudaFree(impl->ranks);
+        cudaFree(impl->positions);
+        cudaStreamDestroy(impl->stream);
+    }
+    delete impl;
+}
+
+bool CudaSVT::Available() const {
+    return impl->available;
+}
+
+void CudaSVT::UploadWindow(const double *u,
+                           const double *invweights,
+                           int Nx,
+                           int Ny,
+                           int T) {
+    impl->Nx = Nx;
+    impl->Ny = Ny;
+    impl->T = T;
+    size_t n = impl->WindowSize();
+
+    Reserve(impl->u, impl->uCap, n);
+    Reserve(impl->invweights, impl->invCap, n);
+    Reserve(impl->uhat, impl->uhatCap, n);
+    Reserve(impl->result, impl->resultCap, 1);
+    Check(cudaMemcpyAsync(impl->u, u, n * sizeof(double),
+                          cudaMemcpyHostToDevice, impl->stream));
+    Check(cudaMemcpyAsync(impl->invweights, invweights, n * sizeof(double),
+                          cudaMemcpyHostToDevice, impl->stream));
+    Check(cudaStreamSynchronize(impl->stream));
+}
+
+void CudaSVT::UploadFactors(const double *factors,
+                            const int *ranks,
+                            const int *positions,
+                            int numblocks,
+                            int stride,
+                            int blocksize,
+                            int maxrank) {
+    impl->numBlocks = numblocks;
+    impl->stride = stride;
+    impl->Bs = blocksize;
+    impl->K = maxrank;
+
+    size_t nf = static_cast<size_t>(numblocks) * stride;
+    size_t np = static_cast<size_t>(numblocks) * impl->T * 2;
+    Reserve(impl->factors, impl->factorsCap, nf);
+    Reserve(impl->ranks, impl->ranksCap, static_cast<size_t>(numblocks));
+    Reserve(impl->positions, impl->positionsCap, np);
+    Check(cudaMemcpyAsync(impl->factors, factors, nf * sizeof(double),
+                          cudaMemcpyHostToDevice, impl->stream));
+    Check(cudaMemcpyAsync(impl->ranks, ranks, numblocks * sizeof(int),
+                          cudaMemcpyHostToDevice, impl->stream));
+    Check(cudaMemcpyAsync(impl->positions, positions, np * sizeof(int),
+                          cudaMemcpyHostToDevice, impl->stream));
+    Check(cudaStreamSynchronize(impl->stream));
+}
+
+double CudaSVT::Error(double lambda) {
+    impl->Build(lambda);
+
+    // Only the scalar comes back to the host
+    double error = 0.;
+    Check(cudaMemsetAsync(impl->result, 0, sizeof(double), impl->stream));
+    ErrorKernel<<<impl->GridSize(), numThreads, 0, impl->stream>>>(
+        impl->uhat, impl->invweights, impl->u, impl->WindowSize(), impl->result);
+    Check(cudaGetLastError());
+    Check(cudaMemcpyAsync(&error, impl->result, sizeof(double),
+                          cudaMemcpyDeviceToHost, impl->stream));
+    Check(cudaStreamSynchronize(impl->stream));
+    return error;
+}
+
+void CudaSVT::Reconstruct(double lambda, double *v) {
+    impl->Build(lambda);
+    WeightKernel<<<impl->GridSize(), numThreads, 0, impl->stream>>>(
+        impl->uhat, impl->invweights, impl->WindowSize());
+    Check(cudaGetLastError());
+    Check(cudaMemcpyAsync(v, impl->uhat, impl->WindowSize() * sizeof(double),
+                          cudaMemcpyDeviceToHost, impl->stream));
+    Check(cudaStreamSynchronize(impl->stream));
+}
@@ -0,0 +1,70 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    GPU evaluation of the SVT reconstruction and PGURE data term.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef CUDASVT_H
+#define CUDASVT_H
+
+// Only plain types cross this interface, so it can be
+// compiled by both nvcc (cudasvt.cu) and the host compiler.
+// The block SVDs are computed on the host, then the window,
+// inverse weights and factors are uploaded once and stay
+// resident for every lambda the optimizer evaluates
+class CudaSVT {
+ public:
+        CudaSVT();
+        ~CudaSVT();
+
+        // Whether a CUDA device could be initialized
+        bool Available() const;
+
+        // Upload the noisy window u and the inverse overlap weights,
+        // both Nx x Ny x T in column-major order
+        void UploadWindow(const double *u,
+                          const double *invweights,
+                          int Nx,
+                          int Ny,
+                          int T);
+
+        // Upload the block factors in the SVT slab layout, with the
+        // rank of each block and the (row, col) corner of each block
+        // in each frame, stored as positions[2*(it*T + k) + 0/1]
+        void UploadFactors(const double *factors,
+                           const int *ranks,
+                           const int *positions,
+                           int numblocks,
+                           int stride,
+                           int blocksize,
+                           int maxrank);
+
+        // |Uhat(lambda) - U|^2, summed over the window
+        double Error(double lambda);
+
+        // Copy Uhat(lambda) back into v (Nx x Ny x T)
+        void Reconstruct(double lambda, double *v);
+
+ private:
+        struct Impl;
+        Impl *impl;
+};
+
+#endif
@@ -0,0 +1,306 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Splitting long sequences over MPI ranks.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+// C++ headers
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Armadillo library
+#include <armadillo>
+
+// MPI library
+#if defined(PGURE_USE_MPI)
+  #include <mpi.h>
+#endif
+
+// Each rank denoises a contiguous range of frames, made of whole runs
+// of windows (see window_reuse), so every window is decomposed, slid
+// and optimized exactly as it would be on one node. Its windows reach
+// up to framewindow frames beyond the range (the halo), which the rank
+// reads, median filters and motion estimates itself, as that costs less
+// than waiting for the neighbouring rank to get to them. Cleaned frames
+// are sent to rank 0 as they are done, which writes them in order.
+// Built without MPI (or run on one rank), this is a single rank that
+// holds the whole sequence, so the drivers use it either way
+class Distributed {
+ public:
+        Distributed() {}
+        ~Distributed() {
+            Finalize();
+        }
+
+        // Join the MPI job, before the arguments are read
+        void Initialize(int *argc,
+                        char ***argv) {
+            #if defined(PGURE_USE_MPI)
+              int provided;
+              MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &provided);
+              MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+              MPI_Comm_size(MPI_COMM_WORLD, &size);
+              threadsafe = (provided >= MPI_THREAD_MULTIPLE);
+              initialized = true;
+            #endif
+            return;
+        }
+
+        void Finalize() {
+            #if defined(PGURE_USE_MPI)
+              if (initialized) {
+                  for (auto &request : requests) {
+                      MPI_Wait(&request, MPI_STATUS_IGNORE);
+                  }
+                  requests.clear();
+                  for (auto &frame : outgoing) {
+                      MPI_Wait(&frame.second, MPI_STATUS_IGNORE);
+                  }
+                  outgoing.clear();
+                  MPI_Finalize();
+                  initialized = false;
+              }
+            #endif
+            return;
+        }
+
+        int Rank() const {
+            return rank;
+        }
+
+        int Size() const {
+            return size;
+        }
+
+        // Share the frames out over the first ranks ranks (all of them
+        // if <= 0, the rest get none), with T the window length. Only
+        // frames [jobfirst, joblast) of the sequence are denoised (all
+        // of them if joblast < 0), in runs counted from jobfirst, and
+        // the frames around them are only read. Must be called with
+        // the same arguments on every rank
+        void Partition(int frames,
+                       int T,
+                       int reuse,
+                       int ranks,
+                       int jobfirst = 0,
+                       int joblast = -1) {
+            N = frames;
+            jobFirst = std::max(0, std::min(jobfirst, N));
+            jobLast = (joblast < 0) ? N : std::max(jobFirst, std::min(joblast, N));
+            windowsize = T;
+            runlength = std::max(1, reuse);
+            active = (ranks > 0) ? std::min(ranks, size) : size;
+            Range(rank, first, last);
+            if (first < last) {
+                readfirst = WindowStart(first);
+                readlast = WindowStart(last-1) + windowsize;
+            } else {
+                readfirst = readlast = first;
+            }
+            return;
+        }
+
+        // Frames [First(), Last()) are denoised by this rank,
+        // and frames [ReadFirst(), ReadLast()) are read by it
+        int First() const {
+            return first;
+        }
+        int Last() const {
+            return last;
+        }
+        int ReadFirst() const {
+            return readfirst;
+        }
+        int ReadLast() const {
+            return readlast;
+        }
+
+        // First frame of the window of frame t
+        int WindowStart(int t) const {
+            int framewindow = windowsize / 2;
+            return (t < framewindow) ? 0
+                   : (t >= N - framewindow) ? N - windowsize
+                   : t - framewindow;
+        }
+
+        // Smallest and largest of value over the ranks
+        double Min(double value) const {
+            #if defined(PGURE_USE_MPI)
+              if (initialized) {
+                  double result;
+                  MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+                  return result;
+              }
+            #endif
+            return value;
+        }
+        double Max(double value) const {
+            #if defined(PGURE_USE_MPI)
+              if (initialized) {
+                  double result;
+                  MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+                  return result;
+              }
+            #endif
+            return value;
+        }
+
+        // Lambda warm starts across rank boundaries. Each rank sends the
+        // optimum lambda of its first window to the rank before, whose
+        // last run starts from it. That rank gets to its last run well
+        // after its neighbour has done its first window, so waiting for
+        // it costs little, and the result doesn't depend on the timing.
+        // Ranks with a single run don't wait, so the ranks never wait on
+        // each other in a chain. Needs MPI_THREAD_MULTIPLE, as the
+        // lambdas are exchanged from the threads running the windows.
+        // Returns whether the exchange is on
+        bool EnableLambdaExchange(bool enable) {
+            exchange = enable && (active > 1) && threadsafe;
+            return exchange;
+        }
+
+        // Whether window t is the first of the last run of this rank
+        // and starts from the neighbour's lambda
+        bool ReceivesLambda(int t) const {
+            return exchange && Receives(rank) && (t == LastRunStart(rank));
+        }
+
+        // Call with the optimum lambda of the first window of this rank
+        void SendLambda(double lambda) {
+            #if defined(PGURE_USE_MPI)
+              if (exchange && rank > 0 && Receives(rank-1)) {
+                  std::lock_guard<std::mutex> guard(lock);
+                  sent = lambda;
+                  requests.emplace_back();
+                  MPI_Isend(&sent, 1, MPI_DOUBLE, rank-1, lambdaTag, MPI_COMM_WORLD, &requests.back());
+              }
+            #endif
+            return;
+        }
+
+        // The optimum lambda of the first window of the next rank
+        double ReceiveLambda() const {
+            double lambda = -1.;
+            #if defined(PGURE_USE_MPI)
+              MPI_Recv(&lambda, 1, MPI_DOUBLE, rank+1, lambdaTag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            #endif
+            return lambda;
+        }
+
+        // Send the next cleaned frame of this rank (> 0) to rank 0, as
+        // soon as it is done, in order. The send doesn't wait for rank 0,
+        // and each frame is let go of as soon as its send completes
+        void SendFrame(arma::Mat<unsigned short> frame) {
+            #if defined(PGURE_USE_MPI)
+              std::lock_guard<std::mutex> guard(lock);
+              outgoing.emplace_back(std::move(frame), MPI_REQUEST_NULL);
+              auto &sending = outgoing.back();
+              MPI_Isend(sending.first.memptr(), static_cast<int>(sending.first.n_elem),
+                        MPI_UNSIGNED_SHORT, 0, frameTag, MPI_COMM_WORLD, &sending.second);
+              while (!outgoing.empty()) {
+                  int done = 0;
+                  MPI_Test(&outgoing.front().second, &done, MPI_STATUS_IGNORE);
+                  if (!done) {
+                      break;
+                  }
+                  outgoing.pop_front();
+              }
+            #endif
+            return;
+        }
+
+        // On rank 0, once its own frames are written, pass the frames
+        // of the other ranks to write(k, frame) in order as they are
+        // received. write() can block (e.g. on a full writer queue), so
+        // rank 0 only holds the frames waiting to be written
+        void ReceiveFrames(int rows,
+                           int cols,
+                           std::function<void(int, arma::Mat<unsigned short>)> write) const {
+            #if defined(PGURE_USE_MPI)
+              if (rank == 0) {
+                  for (int r = 1; r < active; r++) {
+                      int rfirst, rlast;
+                      Range(r, rfirst, rlast);
+                      for (int k = rfirst; k < rlast; k++) {
+                          arma::Mat<unsigned short> frame(rows, cols);
+                          MPI_Recv(frame.memptr(), rows*cols, MPI_UNSIGNED_SHORT,
+                                   r, frameTag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                          write(k, std::move(frame));
+                      }
+                  }
+              }
+            #endif
+            return;
+        }
+
+ private:
+        int rank = 0, size = 1, active = 1;
+        int N = 0, windowsize = 1, runlength = 1, jobFirst = 0, jobLast = 0;
+        int first = 0, last = 0, readfirst = 0, readlast = 0;
+        bool exchange = false;
+
+        #if defined(PGURE_USE_MPI)
+          bool initialized = false, threadsafe = false;
+          std::mutex lock;
+          std::vector<MPI_Request> requests;
+          std::deque<std::pair<arma::Mat<unsigned short>, MPI_Request>> outgoing;
+          double sent = -1.;
+          static const int lambdaTag = 1, frameTag = 2;
+        #else
+          bool threadsafe = false;
+        #endif
+
+        // Frames [rfirst, rlast) of rank r
+        void Range(int r,
+                   int &rfirst,
+                   int &rlast) const {
+            int numruns = (jobLast - jobFirst + runlength - 1) / runlength;
+            int r0 = (r < active) ? static_cast<int>(static_cast<long>(numruns) * r / active) : numruns;
+            int r1 = (r < active) ? static_cast<int>(static_cast<long>(numruns) * (r+1) / active) : numruns;
+            rfirst = std::min(jobLast, jobFirst + r0 * runlength);
+            rlast = std::min(jobLast, jobFirst + r1 * runlength);
+            return;
+        }
+
+        // First frame of the last run of rank r
+        int LastRunStart(int r) const {
+            int rfirst, rlast;
+            Range(r, rfirst, rlast);
+            return rfirst + ((rlast - rfirst - 1) / runlength) * runlength;
+        }
+
+        // Whether rank r waits for the lambda of rank r+1
+        bool Receives(int r) const {
+            int rfirst, rlast;
+            Range(r, rfirst, rlast);
+            int nfirst, nlast;
+            Range(r+1, nfirst, nlast);
+            return (r+1 < active) && (rlast - rfirst > runlength) && (nlast > nfirst);
+        }
+};
+
+#endif
@@ -39,18 +39,21 @@
 ***************************************************************************/
 
 // C++ headers
+#include <algorithm>
 #include <chrono>
 #include <ctime>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <stdarg.h>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 // OpenMP library
@@ -59,11 +62,6 @@
 // Armadillo library
 #include <armadillo>
 
-// LibTIFF
-namespace libtiff {
-    #include "tiffio.h"
-}
-
 // Constant-time median filter
 extern "C" {
     #include "medfilter.h"
@@ -71,18 +69,59 @@ extern "C" {
 
 // Own headers
 #include "arps.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
 #include "hotpixel.hpp"
+#include "motioncache.hpp"
 #include "params.hpp"
 #include "noise.hpp"
+#include "noisecache.hpp"
 #include "pgure.hpp"
 #include "parallel.hpp"
+#include "pipeline.hpp"
+#include "telemetry.hpp"
+#include "tiffstack.hpp"
+#include "window.hpp"
 
 // Little function to convert string "0"/"1" to boolean
 bool strToBool(std::string const& s) {return s != "0";};
 
+// Output for each denoised frame, as a row of the table
+// and optionally a line of the telemetry file
+struct TelemetryOutput {
+    std::mutex lock;
+    std::ofstream file;
+};
+void PrintTelemetry(const FrameTelemetry *record, void *user) {
+    TelemetryOutput *output = static_cast<TelemetryOutput *>(user);
+    int ww = 10;
+    std::ostringstream row;
+    row<<std::fixed<<std::setw(5)<<(record->frame+1)<<std::setw(ww)<<std::setprecision(3)<<record->alpha<<std::setw(ww)<<std::setprecision(3)<<record->mu<<std::setw(ww)<<std::setprecision(3)<<record->sigma<<std::setw(ww)<<std::setprecision(3)<<record->lambda<<std::setw(ww)<<std::setprecision(3)<<(record->end - record->start)<<std::endl;
+
+    std::lock_guard<std::mutex> guard(output->lock);
+    std::cout<<row.str()<<std::flush;
+    if(output->file.is_open()) {
+        output->file<<record->frame+1<<","<<record->windowstart+1<<","<<record->slid<<","
+                    <<record->start<<","<<record->end<<","
+                    <<record->median<<","<<record->hotpixel<<","<<record->noise<<","<<record->motion<<","
+                    <<record->decompose<<","<<record->optimize<<","<<record->reconstruct<<","
+                    <<record->evaluations<<","<<record->lambda<<","
+                    <<record->alpha<<","<<record->mu<<","<<record->sigma<<","
+                    <<record->peakmemory<<std::endl;
+    }
+}
+
 // Main program
 int main(int argc, char** argv) {
 
+    // Join the MPI job, if built with BUILD_MPI,
+    // with only rank 0 reporting progress
+    Distributed dist;
+    dist.Initialize(&argc, &argv);
+    if(dist.Rank() > 0) {
+        std::cout.setstate(std::ios::failbit);
+    }
+
     // Overall program timer
     auto overallstart = std::chrono::steady_clock::now();
 
@@ -144,7 +183,7 @@ int main(int argc, char** argv) {
 
     // SVT thresholds and noise parameters initialized at -1 unless user-defined
     bool pgureOpt = (programOptions.count("pgure") == 1) ? strToBool(programOptions.at("pgure")) : true;
-    double lambda;
+    double lambda = 0.;
     if(!pgureOpt) {
         if(programOptions.count("lambda") == 1) {
             lambda = std::stod(programOptions.at("lambda"));
@@ -173,6 +212,80 @@ int main(int argc, char** argv) {
     // Block overlap
     int Bo = (programOptions.count("patch_overlap") == 1) ? std::stoi(programOptions.at("patch_overlap")) : 1;
 
+    // Number of consecutive windows sharing one decomposition
+    int WindowReuse = (programOptions.count("window_reuse") == 1) ? std::stoi(programOptions.at("window_reuse")) : 1;
+
+    // Number of points in the projected PGURE sweep used to
+    // start the lambda optimization
+    int LambdaSweep = (programOptions.count("lambda_sweep") == 1) ? std::stoi(programOptions.at("lambda_sweep")) : 0;
+
+    // Backend for the block SVDs (see SVDMethod in svt.hpp)
+    int SVDMethod = (programOptions.count("svd_method") == 1) ? std::stoi(programOptions.at("svd_method")) : 0;
+
+    // Element type of the block decompositions (see Precision in pgure.hpp)
+    int Precision = (programOptions.count("precision") == 1) ? std::stoi(programOptions.at("precision")) : 0;
+
+    // Search for the optimum lambda (see LambdaMethod in pgure.hpp),
+    // and the most PGURE evaluations it can take
+    int LambdaMethod = (programOptions.count("lambda_method") == 1) ? std::stoi(programOptions.at("lambda_method")) : 0;
+    int LambdaEvals = (programOptions.count("lambda_evals") == 1) ? std::stoi(programOptions.at("lambda_evals")) : 1000;
+
+    // Adaptive tiling threshold (see PGURE::Initialize, 0 for the whole
+    // block overlap grid), and whether searches without a warm start
+    // begin from the optimum of the window binned 2x2
+    double BlockAdaptive = (programOptions.count("block_adaptive") == 1) ? std::stod(programOptions.at("block_adaptive")) : 0.;
+    bool LambdaPyramid = (programOptions.count("lambda_pyramid") == 1) ? strToBool(programOptions.at("lambda_pyramid")) : false;
+
+    // Seed of the PGURE perturbations (see PGURE::Initialize)
+    unsigned Seed = (programOptions.count("seed") == 1) ? std::stoul(programOptions.at("seed")) : 0;
+
+    // Run the reconstructions and PGURE evaluations on the GPU
+    bool UseGPU = (programOptions.count("use_gpu") == 1) ? strToBool(programOptions.at("use_gpu")) : false;
+    #if !defined(PGURE_USE_CUDA)
+      if(UseGPU) {
+          std::cout<<"**WARNING** Built without USE_CUDA, running on the CPU"<<std::endl;
+      }
+    #endif
+
+    // Read frames as their windows need them and write each
+    // cleaned frame as soon as it is done, so memory use
+    // depends on the trajectory length, not the sequence length
+    bool streaming = (programOptions.count("streaming") == 1) ? strToBool(programOptions.at("streaming")) : false;
+
+    // Per-frame stage timings and estimates, as CSV
+    // (one file per rank, suffixed with the rank, if distributed)
+    std::string telemetryfile = (programOptions.count("telemetry_file") == 1) ? programOptions.at("telemetry_file") : "";
+
+    // Split the sequence over the MPI ranks (see distributed.hpp),
+    // rather than denoising it all on rank 0, and warm start the
+    // last run of each rank from the next rank's first window
+    bool distributed = (programOptions.count("distributed") == 1) ? strToBool(programOptions.at("distributed")) : false;
+    bool lambdaexchange = (programOptions.count("lambda_exchange") == 1) ? strToBool(programOptions.at("lambda_exchange")) : false;
+    if(dist.Size() > 1 && !telemetryfile.empty()) {
+        telemetryfile += "." + std::to_string(dist.Rank());
+    }
+
+    // Frames to denoise in this job (all of them by default), as image
+    // numbers like start_image and end_image. The frames around them
+    // are only read, so a long sequence can be split over several jobs
+    int jobstart = (programOptions.count("job_start") == 1) ? std::stoi(programOptions.at("job_start")) : startimg;
+    int jobend = (programOptions.count("job_end") == 1) ? std::stoi(programOptions.at("job_end")) : endimg;
+    if(jobstart < startimg || jobend > endimg || jobstart > jobend) {
+        std::cout<<"**WARNING** job_start and job_end must be within start_image and end_image"<<std::endl;
+        return -1;
+    }
+    int jobfirst = jobstart - startimg;
+    int jobcount = jobend - jobstart + 1;
+    bool jobrange = (jobcount < num_images);
+
+    // Cleaned frames are saved here as they are done, and a job
+    // restarted with the same parameters resumes from them
+    // (one file per rank, suffixed with the rank, if distributed)
+    std::string checkpointfile = (programOptions.count("checkpoint_file") == 1) ? programOptions.at("checkpoint_file") : "";
+    if(dist.Size() > 1 && !checkpointfile.empty()) {
+        checkpointfile += "." + std::to_string(dist.Rank());
+    }
+
     // Noise method
     // TODO:tjof2 document this option
     int NoiseMethod = (programOptions.count("noise_method") == 1) ? std::stoi(programOptions.at("noise_method")) : 4;
@@ -180,12 +293,17 @@ int main(int argc, char** argv) {
     // Hot pixel threshold
     double hotpixelthreshold = (programOptions.count("hot_pixel") == 1) ? std::stoi(programOptions.at("hot_pixel")) : 10;
 
-    // Set up OMP
+    // Set up the thread pool, which runs both the frame-level and the
+    // block-level loops. OpenMP is only used for SIMD loops, so any
+    // OpenMP teams (e.g. inside Armadillo) are kept to one thread, and
+    // BLAS is kept single-threaded as the calls are all on small blocks
+    int num_threads = (programOptions.count("num_threads") == 1) ? std::max(1, std::stoi(programOptions.at("num_threads"))) : 4;
     #if defined(_OPENMP)
-      int num_threads = (programOptions.count("num_threads") == 1) ? std::stoi(programOptions.at("num_threads")) : 4;
       omp_set_dynamic(0);
-      omp_set_num_threads(num_threads);
+      omp_set_num_threads(1);
     #endif
+    parallel_set_num_threads(num_threads);
+    parallel_set_blas_threads(1);
 
     // Check file exists
     std::string infilename = filestem + ".tif";
@@ -194,13 +312,15 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    // Load TIFF stack
-    int tiffWidth, tiffHeight;
-    unsigned short tiffDepth;
-    libtiff::TIFF *MultiPageTiff = libtiff::TIFFOpen(infilename.c_str(), "r");
-    libtiff::TIFFGetField(MultiPageTiff, TIFFTAG_IMAGEWIDTH, &tiffWidth);
-    libtiff::TIFFGetField(MultiPageTiff, TIFFTAG_IMAGELENGTH, &tiffHeight);
-    libtiff::TIFFGetField(MultiPageTiff, TIFFTAG_BITSPERSAMPLE, &tiffDepth);
+    // Load TIFF stack, scanning the offsets of every frame
+    TiffStack stack;
+    if(!stack.Open(infilename)) {
+        std::cout<<"**WARNING** File "<<infilename<<" is not a TIFF stack of equally sized frames"<<std::endl;
+        return -1;
+    }
+    int tiffWidth = stack.Width();
+    int tiffHeight = stack.Height();
+    int tiffDepth = stack.Depth();
 
     // Only work with square images
     if(tiffWidth != tiffHeight) {
@@ -213,59 +333,101 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    // Import the image sequence
-    arma::cube inputsequence(tiffHeight,tiffWidth,0);
-    arma::cube filteredsequence(tiffHeight,tiffWidth,0);
-    if(MultiPageTiff) {
-        int dircount = 0;
-        int imgcount = 0;
-        do {
-            if(dircount >= (startimg-1) && dircount <= (endimg-1)) {
-                inputsequence.resize(tiffHeight, tiffWidth, imgcount+1);
-                filteredsequence.resize(tiffHeight, tiffWidth, imgcount+1);
-
-                unsigned short *Buffer = new unsigned short[tiffWidth*tiffHeight];
-                unsigned short *FilteredBuffer = new unsigned short[tiffWidth*tiffHeight];
-
-                for(int tiffRow = 0; tiffRow < tiffHeight; tiffRow++) {
-                       libtiff::TIFFReadScanline(MultiPageTiff, &Buffer[tiffRow*tiffWidth], tiffRow, 0);
-                }
+    // Get dimensions
+    int Nx = tiffHeight;
+    int Ny = tiffWidth;
 
-                arma::Mat<unsigned short> TiffSlice( Buffer, tiffHeight, tiffWidth);
-                inplace_trans(TiffSlice);
-                inputsequence.slice(imgcount) = arma::conv_to<arma::mat>::from(TiffSlice);
-
-                // Apply median filter (constant-time) to the 8-bit image
-                int memsize = 512 * 1024;    // L2 cache size
-                int filtsize = MedianSize;    // Median filter size in pixels
-                ConstantTimeMedianFilter(Buffer, FilteredBuffer, tiffWidth, tiffHeight, tiffWidth, tiffWidth, filtsize, 1, memsize);
-                arma::Mat<unsigned short> FilteredTiffSlice( FilteredBuffer, tiffHeight, tiffWidth);
-                inplace_trans(FilteredTiffSlice);
-                filteredsequence.slice(imgcount) = arma::conv_to<arma::mat>::from(FilteredTiffSlice);
-                   imgcount++;
-               }
-            dircount++;
-        } while(libtiff::TIFFReadDirectory(MultiPageTiff));
-        libtiff::TIFFClose(MultiPageTiff);
-    }
     // Is number of frames compatible?
-    if(num_images > (int)inputsequence.n_slices) {
-        std::cout<<"**WARNING** Sequence only has "<<inputsequence.n_slices<<" frames"<<std::endl;
+    if(endimg > stack.Frames()) {
+        std::cout<<"**WARNING** Sequence only has "<<stack.Frames()<<" frames"<<std::endl;
         return -1;
     }
 
-    // Copy image sequence and sizes
-    arma::cube noisysequence = inputsequence;
-    arma::cube cleansequence = inputsequence;
-    cleansequence.zeros();
+    // Frames denoised and read by this rank, which is all
+    // of them unless the sequence is distributed
+    dist.Partition(num_images, T, WindowReuse, distributed ? 0 : 1, jobfirst, jobfirst + jobcount);
+    int readfirst = dist.ReadFirst();
+    int readcount = dist.ReadLast() - dist.ReadFirst();
+    int ownfirst = dist.First();
+    int owncount = dist.Last() - dist.First();
+    if(distributed && dist.Size() > 1) {
+        std::cout<<"Distributed over "<<dist.Size()<<" ranks, rank 0 denoising frames "<<ownfirst+1<<" to "<<ownfirst+owncount<<std::endl;
+    }
+    if(lambdaexchange && !dist.EnableLambdaExchange(pgureOpt)) {
+        std::cout<<"**WARNING** lambda_exchange needs more than one rank, PGURE optimization"<<std::endl;
+        std::cout<<"            and an MPI library supporting MPI_THREAD_MULTIPLE"<<std::endl;
+    }
+    if(jobrange) {
+        std::cout<<"Denoising frames "<<jobstart<<" to "<<jobend<<std::endl;
+    }
 
-    // Get dimensions
-    int Nx = tiffHeight;
-    int Ny = tiffWidth;
+    // The checkpoint is only resumed from if it was written with
+    // every parameter the cleaned frames depend on the same
+    Checkpoint checkpoint;
+    if(!checkpointfile.empty()) {
+        std::ostringstream key;
+        key<<std::setprecision(17)<<filename<<" "<<startimg<<" "<<endimg<<" "<<jobstart<<" "<<jobend<<" "
+           <<Bs<<" "<<Bo<<" "<<T<<" "<<pgureOpt<<" "<<lambda<<" "<<alpha<<" "<<mu<<" "<<sigma<<" "
+           <<MotionP<<" "<<MedianSize<<" "<<hotpixelthreshold<<" "<<tol<<" "<<NoiseMethod<<" "
+           <<WindowReuse<<" "<<LambdaSweep<<" "<<SVDMethod<<" "<<Precision<<" "<<LambdaMethod<<" "
+           <<LambdaEvals<<" "<<BlockAdaptive<<" "<<LambdaPyramid<<" "<<Seed<<" "<<UseGPU<<" "<<streaming<<" "
+           <<distributed<<" "<<lambdaexchange<<" "<<dist.Size();
+        bool resumable = checkpoint.Open(checkpointfile, key.str(), Nx, Ny, (1+(Nx-Bs))*(1+(Ny-Bs)));
+        if(dist.Min(resumable ? 1. : 0.) == 0.) {
+            std::cout<<"**WARNING** Checkpoint "<<checkpointfile<<" could not be written"<<std::endl;
+            return -1;
+        }
+        int done = static_cast<int>(dist.Max(checkpoint.Frames().size()));
+        if(done > 0) {
+            std::cout<<"Resuming from checkpoint "<<checkpointfile<<" ("<<done<<" frames done)"<<std::endl;
+        }
+    }
 
-    // Initial outlier detection (for hot pixels)
-    // using median absolute deviation
-    HotPixelFilter(noisysequence, hotpixelthreshold);
+    // Import the image sequence, unless streaming
+    arma::cube filteredsequence;
+    arma::cube noisysequence, cleansequence;
+    std::vector<double> mediantimes, hotpixeltimes;
+    FrameRing ring;
+    if(streaming) {
+        auto&& readframe = [&]( int k, arma::mat &frame )
+        {
+            arma::Mat<unsigned short> TiffSlice;
+            stack.ReadFrame(startimg - 1 + k, TiffSlice);
+            frame = arma::conv_to<arma::mat>::from(TiffSlice);
+        };
+        ring.Initialize(Nx, Ny, num_images, T, readframe, MedianSize, hotpixelthreshold, num_threads);
+        ring.Seek(readfirst);
+    }
+    else {
+        // Initial outlier detection (for hot pixels)
+        // using median absolute deviation
+        std::cout << std::endl
+                  << "Applying hot-pixel detector with threshold: "
+                  << hotpixelthreshold
+                  << " * MAD"
+                  << std::endl;
+
+        // Frames are decoded, median filtered (constant-time) and
+        // cleaned of hot pixels in parallel, straight into their slices
+        noisysequence.set_size(Nx, Ny, readcount);
+        filteredsequence.set_size(Nx, Ny, readcount);
+        mediantimes.resize(readcount);
+        hotpixeltimes.resize(readcount);
+        stack.ReadFrames(startimg - 1 + readfirst, readcount, [&]( int k, const arma::Mat<unsigned short> &TiffSlice )
+        {
+            arma::mat noisy(noisysequence.slice_memptr(k), Nx, Ny, false, true);
+            noisy = arma::conv_to<arma::mat>::from(TiffSlice);
+            auto stage = std::chrono::steady_clock::now();
+            arma::mat filtered(filteredsequence.slice_memptr(k), Nx, Ny, false, true);
+            MedianFilterFrame(TiffSlice.memptr(), Nx, Ny, filtered, MedianSize);
+            mediantimes[k] = Lap(stage);
+            HotPixelFrame(noisy, hotpixelthreshold);
+            hotpixeltimes[k] = Lap(stage);
+        });
+        stack.Close();
+
+        cleansequence.zeros(Nx, Ny, owncount);
+    }
 
     // Print table headings
     int ww = 10;
@@ -274,6 +436,16 @@ int main(int argc, char** argv) {
     std::cout<<std::setw(5)<<"Frame"<<std::setw(ww)<<"Gain"<<std::setw(ww)<<"Offset"<<std::setw(ww)<<"Sigma"<<std::setw(ww)<<"Lambda"<<std::setw(ww)<<"Time (s)"<<std::endl;
     std::cout<<std::setw(5*ww+5)<<std::string(5*ww+5,'-')<<std::endl;
 
+    // Rows are printed as frames are done, which is out of
+    // order when windows are denoised in parallel
+    TelemetryOutput telemetry;
+    if(!telemetryfile.empty()) {
+        telemetry.file.open(telemetryfile);
+        telemetry.file<<"frame,windowstart,slid,start,end,median,hotpixel,noise,motion,"
+                      <<"decompose,optimize,reconstruct,evaluations,lambda,alpha,mu,sigma,peakmemory"<<std::endl;
+    }
+    Telemetry::instance().Enable(0, PrintTelemetry, &telemetry);
+
     // Loop over time windows
     int framewindow = std::floor(T/2);
     /*
@@ -332,8 +504,8 @@ int main(int argc, char** argv) {
                               Bs,
                               Bo,
                               alpha,
-                              sigma,
-                              mu);
+                              mu,
+                              sigma);
         // Determine optimum threshold value (max 1000 evaluations)
         if(pgureOpt) {
             lambda = (timeiter == 0) ? arma::accu(u)/(Nx*Ny*T) : lambda;
@@ -372,133 +544,301 @@ int main(int argc, char** argv) {
     }
     */
 
-    auto&& func = [&, lambda_=lambda]( int timeiter )
+    // Get the filename
+    std::string outfilename = filestem + "-CLEANED.tif";
+    if(jobrange) {
+        outfilename = filestem + "-CLEANED-" + std::to_string(jobstart) + "-" + std::to_string(jobend) + ".tif";
+    }
+
+    // Frames are encoded and written in the background, in order,
+    // by rank 0. Other ranks send each frame there as it is done,
+    // rather than holding them all, and rank 0 receives them into
+    // the writer's queue after its own
+    TiffWriter writer;
+    bool opened = (dist.Rank() > 0) || writer.Open(outfilename, tiffWidth, tiffHeight, jobcount);
+    if(dist.Min(opened ? 1. : 0.) == 0.) {
+        std::cout<<"**WARNING** File "<<outfilename<<" could not be written"<<std::endl;
+        return -1;
+    }
+    auto&& writepage = [&]( int tOut, arma::Mat<unsigned short> outSlice )
     {
-        auto lambda = lambda_;
-        // Extract the subset of the image sequence
-        arma::cube u(Nx, Ny, T), ufilter(Nx, Ny, T), v(Nx, Ny, T);
-        if(timeiter < framewindow) {
-            u = noisysequence.slices(0,2*framewindow);
-            ufilter = filteredsequence.slices(0,2*framewindow);
-        }
-        else if(timeiter >= (num_images - framewindow)) {
-            u = noisysequence.slices(num_images-2*framewindow-1,num_images-1);
-            ufilter = filteredsequence.slices(num_images-2*framewindow-1,num_images-1);
+        if(dist.Rank() > 0) {
+            dist.SendFrame(std::move(outSlice));
         }
         else {
-            u = noisysequence.slices(timeiter - framewindow, timeiter + framewindow);
-            ufilter = filteredsequence.slices(timeiter - framewindow, timeiter + framewindow);
+            writer.Write(tOut - jobfirst, std::move(outSlice));
         }
+    };
 
-        // Basic sequence normalization
-        double inputmax = u.max();
-        u /= inputmax;
-        ufilter /= ufilter.max();
+    // Streamed frames can't be stretched over the range of the
+    // whole cleaned sequence, and nor can the frames of a job range,
+    // so they keep the input scale, taken from the input bit depth
+    // to 16 bits
+    double outscale = 65535. / ((1 << tiffDepth) - 1);
+    auto&& writeframe = [&]( int tOut, const arma::mat &frame )
+    {
+        arma::mat scaled = arma::clamp(outscale*frame, 0., 65535.);
+        writepage(tOut, arma::conv_to<arma::Mat<unsigned short>>::from(scaled));
+    };
 
-        // Perform noise estimation
-        if(pgureOpt) {
-            NoiseEstimator *noise = new NoiseEstimator;
-            noise->Estimate(u,
-                            alpha,
-                            mu,
-                            sigma,
-                            8,
-                            NoiseMethod);
-            delete noise;
+    // Motion fields between neighbouring frames are shared by
+    // overlapping windows, so are estimated once for the sequence
+    // (on the normalized sequence, as the search is scale-invariant)
+    // Only the frames this rank reads are cached, and its windows
+    // only reach the end of them at the end of the sequence, so
+    // they are the same as on the whole sequence
+    MotionCache motioncache;
+    if(streaming) {
+        motioncache.Initialize(Nx, Ny, 0,
+                               [&ring](int k) { return ring.Filtered(k); },
+                               Bs, MotionP);
+    }
+    else {
+        filteredsequence /= dist.Max((readcount > 0) ? filteredsequence.max() : 0.);
+        motioncache.Initialize(Nx, Ny, 0,
+                               [&](int k) { return filteredsequence.slice_memptr(k - readfirst); },
+                               Bs, MotionP);
+    }
+    motioncache.Seek(readfirst);
+    motioncache.Extend(readfirst + readcount);
+
+    // Likewise the patch statistics of each frame used for
+    // noise estimation, leaving only the fit for each window
+    NoiseCache noisecache;
+    noisecache.Initialize(0, 8);
+    noisecache.Seek(readfirst);
+    noisecache.Extend(readfirst + readcount);
+
+    // Each thread takes a run of consecutive windows, and windows after
+    // the first in a run slide the previous decomposition forward by one
+    // frame instead of starting afresh (window_reuse <= 1 disables this)
+    int reuse = (WindowReuse > 1) ? WindowReuse : 1;
+    int numruns = (owncount + reuse - 1) / reuse;
+
+    // Runs are shared out dynamically over the pool, and the block-level
+    // loops inside each window are submitted to the same pool, so
+    // threads without a run of their own (e.g. when there are fewer
+    // windows than threads, or at the tail) help with the blocks of
+    // those still going. Streamed windows are denoised in order, so
+    // only use the block-level loops
+
+    // Runs whose frames are all in the checkpoint are restored rather
+    // than denoised, and the motion fields saved with the frames are
+    // reused by the windows left to do. Other runs are denoised in
+    // full, so the results are the same as without stopping
+    std::vector<char> restoredrun(numruns, 0);
+    std::map<int, FrameState> restoredstate;
+    if(checkpoint.IsOpen()) {
+        std::vector<char> needed(readcount, 0);
+        for(int runiter = 0; runiter < numruns; runiter++) {
+            int runfirst = ownfirst + runiter*reuse;
+            int runlast = std::min(ownfirst + owncount, runfirst + reuse);
+            restoredrun[runiter] = checkpoint.Has(runfirst, runlast) ? 1 : 0;
+            if(restoredrun[runiter]) {
+                for(int k = runfirst; k < runlast; k++) {
+                    restoredstate[k] = checkpoint.State(k);
+                }
+            }
+            else {
+                int last = std::min(readfirst + readcount, dist.WindowStart(runlast-1) + T);
+                for(int k = dist.WindowStart(runfirst); k < last; k++) {
+                    needed[k - readfirst] = 1;
+                }
+            }
+        }
+        arma::mat clean;
+        arma::Mat<short> forward, backward, predicted;
+        for(int k : checkpoint.Frames()) {
+            bool restore = !streaming && (restoredstate.count(k) == 1);
+            bool motion = (k >= readfirst) && (k < readfirst + readcount) && needed[k - readfirst];
+            if(restore || motion) {
+                checkpoint.Read(k, clean, forward, backward, predicted);
+            }
+            if(restore) {
+                cleansequence.slice(k - ownfirst) = clean;
+            }
+            if(motion) {
+                motioncache.Preload(k, forward, backward, predicted);
+            }
         }
+    }
 
-        // Perform motion estimation
-        MotionEstimator *motion = new MotionEstimator;
-        motion->Estimate(ufilter,
-                         timeiter,
-                         framewindow,
-                         num_images,
-                         Bs,
-                         MotionP);
-        arma::icube sequencePatches = motion->GetEstimate();
-        delete motion;
+    // Windows warm start the lambda search from the previous window
+    // in their run. Parallel runs start afresh rather than wait for
+    // their neighbour, so the result doesn't depend on the schedule,
+    // but streamed runs are in order, so carry it across runs too
+    double streamlambda = -1.;
+
+    // The optimizer type is picked by the precision option, and
+    // the windows are run with it through a generic lambda.
+    // Noise parameters, lambda and the PGURE perturbations are
+    // all per-window state, so results don't depend on how the
+    // runs are spread over the threads
+    auto&& runwindows = [&, lambda_=lambda, alpha_=alpha, mu_=mu, sigma_=sigma]( int runiter, auto *tag )
+    {
+        typedef typename std::remove_pointer<decltype(tag)>::type Optimizer;
+
+        WindowDenoiser<Optimizer> window;
+        window.Initialize(&motioncache, &noisecache,
+                          Bs, Bo, framewindow, reuse,
+                          pgureOpt, tol, NoiseMethod,
+                          SVDMethod, UseGPU, Seed, BlockAdaptive,
+                          LambdaMethod, LambdaEvals,
+                          LambdaSweep, LambdaPyramid);
+
+        // Optimum lambda of the previous window in the run
+        // (or of the previous run, when they run in order)
+        double warmlambda = streaming ? streamlambda : -1.;
+
+        int firstiter = ownfirst + runiter*reuse;
+        int lastiter = std::min(ownfirst + owncount, ownfirst + (runiter+1)*reuse);
+
+        // Restored runs still pass their lambdas on, as they would
+        // have if denoised, and streamed frames are written in order
+        if(restoredrun[runiter]) {
+            if(dist.ReceivesLambda(firstiter)) {
+                dist.ReceiveLambda();
+            }
+            for(int timeiter = firstiter; timeiter < lastiter; timeiter++) {
+                const FrameState &state = restoredstate.at(timeiter);
+                if(timeiter == ownfirst) {
+                    dist.SendLambda(state.lambda);
+                }
+                if(streaming) {
+                    arma::mat clean;
+                    arma::Mat<short> forward, backward, predicted;
+                    checkpoint.Read(timeiter, clean, forward, backward, predicted);
+                    writeframe(timeiter, clean);
+                }
+                warmlambda = pgureOpt ? state.lambda : warmlambda;
+            }
+            if(streaming) {
+                streamlambda = warmlambda;
+            }
+            return;
+        }
 
-        // Perform PGURE optimization
-        PGURE *optimizer = new PGURE;
-        optimizer->Initialize(u,
-                              sequencePatches,
-                              Bs,
-                              Bo,
-                              alpha,
-                              sigma,
-                              mu);
-        // Determine optimum threshold value (max 1000 evaluations)
-        if(pgureOpt) {
-            lambda = (timeiter == 0) ? arma::accu(u)/(Nx*Ny*T) : lambda;
-            lambda = optimizer->Optimize(tol, lambda, u.max(), 1E3);
-            v = optimizer->Reconstruct(lambda);
+        for(int timeiter = firstiter; timeiter < lastiter; timeiter++) {
+        // Estimated afresh for each window, unless given
+        double alpha = alpha_, mu = mu_, sigma = sigma_;
+        // The last run starts from the next rank's lambda,
+        // which is long done by the time it gets here
+        if(pgureOpt && dist.ReceivesLambda(timeiter)) {
+            warmlambda = dist.ReceiveLambda();
+        }
+        double lambda = pgureOpt ? warmlambda : lambda_;
+        // Stage timings, published when the frame is done
+        FrameTelemetry record = {};
+        record.start = Telemetry::instance().Now();
+        // Extract the subset of the image sequence
+        int start = (timeiter < framewindow) ? 0
+                    : (timeiter >= (num_images - framewindow)) ? num_images-2*framewindow-1
+                    : timeiter - framewindow;
+        arma::cube u(Nx, Ny, T);
+        if(streaming) {
+            ring.Require(start);
+            u = ring.Window(start);
         }
         else {
-            v = optimizer->Reconstruct(lambda);
+            u = noisysequence.slices(start-readfirst, start-readfirst+2*framewindow);
         }
-        delete optimizer;
+        // Stages are timed from here, so reading the window
+        // only counts towards the time of the frame as a whole
+        auto stage = std::chrono::steady_clock::now();
 
-        // Rescale back to original range
-        v *= inputmax;
+        arma::mat clean = window.Denoise(u, timeiter, start, num_images,
+                                         alpha, mu, sigma, lambda,
+                                         pgureOpt, record, stage);
+        if(pgureOpt) {
+            warmlambda = lambda;
+            if(timeiter == ownfirst) {
+                dist.SendLambda(lambda);
+            }
+        }
 
-        // Place frames back into sequence
-        if(timeiter < framewindow) {
-            cleansequence.slice(timeiter) = v.slice(timeiter);
+        // Save the frame, with the motion fields of the frame so far
+        if(checkpoint.IsOpen()) {
+            arma::Mat<short> forward, backward, predicted;
+            int fields = motioncache.Computed(timeiter, forward, backward, predicted);
+            checkpoint.Write(timeiter, {lambda, alpha, mu, sigma}, clean,
+                             fields, forward, backward, predicted);
         }
-        else if(timeiter >= (num_images - framewindow)) {
-            int endseqFrame = timeiter - (num_images - T);
-            cleansequence.slice(timeiter) = v.slice(endseqFrame);
+
+        // Place frames back into sequence, or write them out
+        // straight away when streaming, dropping motion fields
+        // and noise statistics that no later window can use
+        if(streaming) {
+            writeframe(timeiter, clean);
+            motioncache.Evict(start);
+            noisecache.Evict(start);
         }
         else {
-            cleansequence.slice(timeiter) = v.slice(framewindow);
+            cleansequence.slice(timeiter-ownfirst) = clean;
         }
 
+        if(streaming) {
+            ring.PrepareTimes(timeiter, record.median, record.hotpixel);
+        }
+        else {
+            record.median = mediantimes[timeiter-readfirst];
+            record.hotpixel = hotpixeltimes[timeiter-readfirst];
+        }
+        Telemetry::instance().Publish(record);
+
+        }
+        if(streaming) {
+            streamlambda = warmlambda;
+        }
     };
-    parallel( func, static_cast<unsigned long long>(num_images) );
+    auto&& func = [&]( int runiter )
+    {
+        switch(Precision) {
+            case PRECISION_FLOAT:
+                runwindows(runiter, static_cast<PGURE<float> *>(nullptr));
+                break;
+            case PRECISION_MIXED:
+                runwindows(runiter, static_cast<PGURE<float, double> *>(nullptr));
+                break;
+            default:
+                runwindows(runiter, static_cast<PGURE<double> *>(nullptr));
+                break;
+        }
+    };
+    if(streaming) {
+        for(int runiter = 0; runiter < numruns; runiter++) {
+            func(runiter);
+        }
+        stack.Close();
+    }
+    else {
+        parallel( func, static_cast<unsigned long long>(numruns) );
+    }
 
     // Finish the table off
+    Telemetry::instance().Disable();
     std::cout<<std::setw(5*ww+5)<<std::string(5*ww+5,'-')<<std::endl<<std::endl;
 
-    // Normalize to [0,65535] range
-    cleansequence = (cleansequence - cleansequence.min())/(cleansequence.max() - cleansequence.min());
-    arma::Cube<unsigned short> outTiff(tiffWidth,tiffHeight,num_images);
-    outTiff = arma::conv_to<arma::Cube<unsigned short>>::from(65535*cleansequence);
-
-    // Get the filename
-    std::string outfilename = filestem + "-CLEANED.tif";
-
-    // Set the output file headers
-    libtiff::TIFF *MultiPageTiffOut = libtiff::TIFFOpen(outfilename.c_str(), "w");
-    libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_IMAGEWIDTH, tiffWidth);
-    libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_IMAGELENGTH, tiffHeight);
-    libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_BITSPERSAMPLE, 16);
-
-    // Write the file
-    if(!MultiPageTiffOut) {
-        std::cout<<"**WARNING** File "<<outfilename<<" could not be written"<<std::endl;
-        return -1;
+    // Normalize to [0,65535] range (of the whole sequence). A job range
+    // only has its own frames, so is written at the fixed input scale
+    // instead, and the outputs of the jobs of a sequence match up
+    if(!streaming && jobrange) {
+        for(int tOut = ownfirst; tOut < ownfirst + owncount; tOut++) {
+            writeframe(tOut, cleansequence.slice(tOut-ownfirst));
+        }
     }
-
-    for(int tOut = 0; tOut < num_images; tOut++) {
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_IMAGEWIDTH, tiffWidth);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_IMAGELENGTH, tiffHeight);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_BITSPERSAMPLE, 16);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_SAMPLESPERPIXEL, 1);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
-        libtiff::TIFFSetField(MultiPageTiffOut, TIFFTAG_PAGENUMBER, tOut, num_images);
-        for(int tiffRow = 0; tiffRow < tiffHeight; tiffRow++) {
-            arma::Mat<unsigned short> outSlice = outTiff.slice(tOut);
-            inplace_trans(outSlice);
-            unsigned short *OutBuffer = outSlice.memptr();
-            libtiff::TIFFWriteScanline(MultiPageTiffOut, &OutBuffer[tiffRow*tiffWidth], tiffRow, 0);
-           }
-           libtiff::TIFFWriteDirectory(MultiPageTiffOut);
-      }
-      libtiff::TIFFClose(MultiPageTiffOut);
+    else if(!streaming) {
+        double cleanmin = dist.Min((owncount > 0) ? cleansequence.min() : arma::datum::inf);
+        double cleanmax = dist.Max((owncount > 0) ? cleansequence.max() : -arma::datum::inf);
+        cleansequence = (cleansequence - cleanmin)/(cleanmax - cleanmin);
+        for(int tOut = ownfirst; tOut < ownfirst + owncount; tOut++) {
+            writepage(tOut, arma::conv_to<arma::Mat<unsigned short>>::from(65535*cleansequence.slice(tOut-ownfirst)));
+        }
+    }
+    dist.ReceiveFrames(Nx, Ny, [&]( int tOut, arma::Mat<unsigned short> outSlice )
+    {
+        writer.Write(tOut - jobfirst, std::move(outSlice));
+    });
+    writer.Close();
 
     // Overall program timer
     auto overallend = std::chrono::steady_clock::now();
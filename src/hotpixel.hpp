@@ -23,7 +23,9 @@
 #define HOTPIXEL_H
 
 // C++ headers
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
@@ -31,52 +33,163 @@
 // Armadillo library
 #include <armadillo>
 
+// Own headers
+#include "parallel.hpp"
+
+// Median of values, which are reordered, averaging the two middle
+// values when there is an even number of them (as arma::median())
+inline double SelectMedian(std::vector<double> &values) {
+    size_t n = values.size();
+    auto mid = values.begin() + n / 2;
+    std::nth_element(values.begin(), mid, values.end());
+    double upper = *mid;
+    if (n % 2 == 1) {
+        return upper;
+    }
+    double lower = *std::max_element(values.begin(), mid);
+    return (lower + upper) / 2;
+}
+
+// Median of the integers counted in hist, of which there are n
+inline double HistogramMedian(const std::vector<uint32_t> &hist,
+                              size_t n) {
+    size_t lowrank = (n - 1) / 2, highrank = n / 2;
+    size_t count = 0, lower = 0, upper = 0;
+    bool foundlower = false;
+    for (size_t b = 0; b < hist.size(); b++) {
+        count += hist[b];
+        if (!foundlower && count > lowrank) {
+            lower = b;
+            foundlower = true;
+        }
+        if (count > highrank) {
+            upper = b;
+            break;
+        }
+    }
+    return (lower + upper) / 2.;
+}
+
+// Median and median absolute deviation of a frame. Large frames of
+// 16-bit values (as read from the detector) are counted into a
+// histogram in one pass, and the histogram of the deviations is
+// found from it without going back to the pixels. Other frames
+// use selection on a copy rather than sorting
+void FrameMedianMAD(const arma::mat &frame,
+                    double &median,
+                    double &mad) {
+    size_t n = frame.n_elem;
+    const double *p = frame.memptr();
+    if (n >= 65536) {
+        std::vector<uint32_t> hist(65536, 0);
+        bool integral = true;
+        for (size_t i = 0; i < n && integral; i++) {
+            double v = p[i];
+            integral = (v >= 0. && v <= 65535.);
+            unsigned int b = integral ? static_cast<unsigned int>(v) : 0;
+            integral = integral && (b == v);
+            hist[b] += integral ? 1 : 0;
+        }
+        if (integral) {
+            median = HistogramMedian(hist, n);
+
+            // |v - median| is a multiple of 1/2, so 2|v - median| is counted
+            long twicemedian = std::lround(2 * median);
+            std::vector<uint32_t> dev(2 * 65536, 0);
+            for (long v = 0; v < 65536; v++) {
+                dev[std::labs(2 * v - twicemedian)] += hist[v];
+            }
+            mad = HistogramMedian(dev, n) / 2;
+            return;
+        }
+    }
+    std::vector<double> values(p, p + n);
+    median = SelectMedian(values);
+    for (auto &v : values) {
+        v = std::abs(v - median);
+    }
+    mad = SelectMedian(values);
+    return;
+}
+
+// Median of the 8 neighbours of a pixel, as the mean of the 4th
+// and 5th smallest, using Batcher's odd-even merge sorting network
+// (19 compare-exchanges of min/max, with no branches)
+inline double NeighbourMedian(double w[8]) {
+    static const int network[19][2] = {{0, 1}, {2, 3}, {4, 5}, {6, 7},
+                                       {0, 2}, {1, 3}, {4, 6}, {5, 7},
+                                       {1, 2}, {5, 6},
+                                       {0, 4}, {1, 5}, {2, 6}, {3, 7},
+                                       {2, 4}, {3, 5},
+                                       {1, 2}, {3, 4}, {5, 6}};
+    for (int c = 0; c < 19; c++) {
+        double a = w[network[c][0]], b = w[network[c][1]];
+        w[network[c][0]] = std::min(a, b);
+        w[network[c][1]] = std::max(a, b);
+    }
+    return (w[3] + w[4]) / 2;
+}
+
+// Replace outliers in one frame, optionally returning the
+// (column-major) indices of the pixels that were replaced
+void HotPixelFrame(arma::mat &frame,
+                   double threshold,
+                   arma::uvec *replaced = nullptr) {
+    int Nx = frame.n_rows;
+    int Ny = frame.n_cols;
+
+    double median, mad;
+    FrameMedianMAD(frame, median, mad);
+    double medianAbsDev = mad / 0.6745;
+    double limit = threshold * medianAbsDev;
+
+    // All outliers are found before any are replaced
+    std::vector<arma::uword> outliers;
+    const double *p = frame.memptr();
+    for (size_t i = 0; i < frame.n_elem; i++) {
+        if (std::abs(p[i] - median) > limit) {
+            outliers.push_back(i);
+        }
+    }
+    for (size_t j = 0; j < outliers.size(); j++) {
+        int r = outliers[j] % Nx;
+        int c = outliers[j] / Nx;
+        if (r > 0 && r < Nx-1 && c > 0 && c < Ny-1) {
+            double medianwindow[8] = {frame(r-1, c-1), frame(r-1, c), frame(r-1, c+1),
+                                      frame(r, c-1), frame(r, c+1),
+                                      frame(r+1, c-1), frame(r+1, c), frame(r+1, c+1)};
+            frame(r, c) = NeighbourMedian(medianwindow);
+        } else {
+            // Edge pixels are replaced by the median
+            // of the frame (as they are not *usually*
+            // very important! CAREFUL THOUGH)
+            frame(r, c) = median;
+        }
+    }
+    if (replaced != nullptr) {
+        *replaced = arma::conv_to<arma::uvec>::from(outliers);
+    }
+    return;
+}
+
 void HotPixelFilter(arma::cube &sequence,
                     double threshold) {
-    int Nx = sequence.n_rows;
-    int Ny = sequence.n_cols;
     int T = sequence.n_slices;
-    
+
     std::cout << std::endl
               << "Applying hot-pixel detector with threshold: "
               << threshold
               << " * MAD"
               << std::endl;
-              
-    for (int i = 0; i < T; i++) {
-        double median = arma::median(arma::vectorise(sequence.slice(i)));
-        double medianAbsDev = arma::median(
-                                    arma::vectorise(
-                                      arma::abs(
-                                        sequence.slice(i) - median))) / 0.6745;
-        arma::uvec outliers = arma::find(arma::abs(sequence.slice(i)-median) > threshold*medianAbsDev);
-        for (size_t j = 0; j < outliers.n_elem; j++) {
-            arma::uvec sub = arma::ind2sub(arma::size(Nx,Ny), outliers(j));
-            arma::vec medianwindow(8);
-            if ((int)sub(0) > 0 
-                && (int)sub(0) < Nx-1 
-                && (int)sub(1) > 0 
-                && (int)sub(1) < Ny-1) {
-                medianwindow(0) = sequence(sub(0)-1, sub(1)-1, i);
-                medianwindow(1) = sequence(sub(0)-1, sub(1), i);
-                medianwindow(2) = sequence(sub(0)-1, sub(1)+1, i);
-                medianwindow(3) = sequence(sub(0), sub(1)-1, i);
-                medianwindow(4) = sequence(sub(0), sub(1)+1, i);
-                medianwindow(5) = sequence(sub(0)+1, sub(1)-1, i);
-                medianwindow(6) = sequence(sub(0)+1, sub(1), i);
-                medianwindow(7) = sequence(sub(0)+1, sub(1)+1, i);
-                
-                medianwindow = arma::sort(medianwindow);
-                sequence(sub(0), sub(1), i) = (medianwindow(3) + medianwindow(4))/2;
-            } else {
-                // Edge pixels are replaced by the median
-                // of the frame (as they are not *usually*
-                // very important! CAREFUL THOUGH)
-                sequence(sub(0), sub(1), i) = median; 
-            }         
-            
-        }
-    }
+
+    // Frames are independent, so are filtered in parallel
+    auto&& hfunc = [&]( int i )
+    {
+        // Filter the slice in place
+        arma::mat frame(sequence.slice_memptr(i), sequence.n_rows, sequence.n_cols, false, true);
+        HotPixelFrame(frame, threshold);
+    };
+    parallel( hfunc, static_cast<unsigned long long>(T) );
     return;
 }
 
@@ -0,0 +1,217 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Batched one-sided Jacobi SVD for many small blocks [1].
+
+    References:
+    [1]     "Jacobi's method is more accurate than QR", (1992),
+            Demmel, J and Veselic, K
+            http://dx.doi.org/10.1137/0613074
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef JACOBI_H
+#define JACOBI_H
+
+// C++ headers
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+// Armadillo library
+#include <armadillo>
+
+// Factorizes Lanes blocks of the same size at once. The blocks are
+// interleaved element by element, so every rotation is a stride-1
+// loop over the lanes that the compiler can vectorize, and there is
+// no per-block LAPACK call or workspace query
+template <typename eT>
+class JacobiSVD {
+ public:
+        // One 64-byte vector of lanes
+        static const int Lanes = 64 / sizeof(eT);
+
+        JacobiSVD() {}
+        ~JacobiSVD() {}
+
+        // Set the block size. Tall blocks are factorized directly,
+        // wide ones through their transpose, so columns are never
+        // more than rows and the rank is n = min(rows, cols)
+        void Initialize(int rows, int cols) {
+            transposed = (cols > rows);
+            m = transposed ? cols : rows;
+            n = transposed ? rows : cols;
+            A.resize(m*n*Lanes);
+            V.resize(n*n*Lanes);
+            return;
+        }
+
+        // Rank of the factorization of each block
+        int Rank() const {
+            return n;
+        }
+
+        // Zero all lanes, so unused lanes never rotate
+        void Clear() {
+            std::fill(A.begin(), A.end(), eT(0));
+            return;
+        }
+
+        // Copy a block into a lane
+        void Load(int lane, const arma::Mat<eT> &block) {
+            for (int j = 0; j < n; j++) {
+                for (int i = 0; i < m; i++) {
+                    A[(j*m + i)*Lanes + lane] = transposed ? block(j, i) : block(i, j);
+                }
+            }
+            return;
+        }
+
+        // Orthogonalize the columns of every lane by plane rotations,
+        // sweeping over all column pairs until no lane rotates
+        void Factorize(int maxSweeps = 30) {
+            // Right singular vectors start from the identity
+            std::fill(V.begin(), V.end(), eT(0));
+            for (int j = 0; j < n; j++) {
+                for (int l = 0; l < Lanes; l++) {
+                    V[(j*n + j)*Lanes + l] = 1;
+                }
+            }
+
+            const eT tol = m * arma::Datum<eT>::eps;
+            eT alpha[Lanes], beta[Lanes], gamma[Lanes];
+            eT c[Lanes], s[Lanes];
+
+            for (int sweep = 0; sweep < maxSweeps; sweep++) {
+                int rotated = 0;
+                for (int p = 0; p < n-1; p++) {
+                    for (int q = p+1; q < n; q++) {
+                        eT *ap = &A[p*m*Lanes];
+                        eT *aq = &A[q*m*Lanes];
+
+                        // Gram matrix entries of the column pair
+                        for (int l = 0; l < Lanes; l++) {
+                            alpha[l] = beta[l] = gamma[l] = 0.;
+                        }
+                        for (int i = 0; i < m; i++) {
+                            #pragma omp simd
+                            for (int l = 0; l < Lanes; l++) {
+                                eT x = ap[i*Lanes + l];
+                                eT y = aq[i*Lanes + l];
+                                alpha[l] += x * x;
+                                beta[l] += y * y;
+                                gamma[l] += x * y;
+                            }
+                        }
+
+                        // Rotation that zeroes the off-diagonal entry,
+                        // or the identity for lanes already orthogonal
+                        int any = 0;
+                        #pragma omp simd reduction(|:any)
+                        for (int l = 0; l < Lanes; l++) {
+                            eT off = std::abs(gamma[l]);
+                            int rot = (off > 0) && (off > tol * std::sqrt(alpha[l] * beta[l]));
+                            eT zeta = (beta[l] - alpha[l]) / (2 * (rot ? gamma[l] : eT(1)));
+                            eT t = std::copysign(eT(1), zeta)
+                                   / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+                            c[l] = rot ? 1 / std::sqrt(1 + t * t) : eT(1);
+                            s[l] = rot ? c[l] * t : eT(0);
+                            any |= rot;
+                        }
+                        if (!any) {
+                            continue;
+                        }
+                        rotated = 1;
+                        Rotate(ap, aq, m, c, s);
+                        Rotate(&V[p*n*Lanes], &V[q*n*Lanes], n, c, s);
+                    }
+                }
+                if (!rotated) {
+                    break;
+                }
+            }
+            return;
+        }
+
+        // Economical SVD of the block in a lane, with the singular
+        // values in descending order as from arma::svd_econ()
+        void Extract(int lane, arma::Mat<eT> &Ublock, arma::Col<eT> &Sblock, arma::Mat<eT> &Vblock) const {
+            // Singular values are the orthogonalized column norms
+            arma::Col<eT> norms(n);
+            for (int j = 0; j < n; j++) {
+                eT sum = 0;
+                for (int i = 0; i < m; i++) {
+                    eT x = A[(j*m + i)*Lanes + lane];
+                    sum += x * x;
+                }
+                norms(j) = std::sqrt(sum);
+            }
+            std::vector<int> order(n);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(),
+                      [&](int a, int b) { return norms(a) > norms(b); });
+
+            // Left vectors are the normalized columns, discarding
+            // numerically null directions, and right vectors the
+            // accumulated rotations. Swap them back for wide blocks
+            arma::Mat<eT> &Ucols = transposed ? Vblock : Ublock;
+            arma::Mat<eT> &Vcols = transposed ? Ublock : Vblock;
+            Ucols.set_size(m, n);
+            Vcols.set_size(n, n);
+            Sblock.set_size(n);
+            eT Stol = norms(order[0]) * n * arma::Datum<eT>::eps;
+            for (int k = 0; k < n; k++) {
+                int j = order[k];
+                eT scale = (norms(j) > Stol) ? 1 / norms(j) : eT(0);
+                Sblock(k) = norms(j);
+                for (int i = 0; i < m; i++) {
+                    Ucols(i, k) = A[(j*m + i)*Lanes + lane] * scale;
+                }
+                for (int i = 0; i < n; i++) {
+                    Vcols(i, k) = V[(j*n + i)*Lanes + lane];
+                }
+            }
+            return;
+        }
+
+ private:
+        int m, n;
+        bool transposed;
+
+        // Interleaved columns, element (i, j) of lane l at (j*rows + i)*Lanes + l
+        std::vector<eT> A, V;
+
+        // Apply per-lane plane rotations to a pair of interleaved columns
+        static void Rotate(eT *xp, eT *yp, int rows,
+                           const eT *c, const eT *s) {
+            for (int i = 0; i < rows; i++) {
+                #pragma omp simd
+                for (int l = 0; l < Lanes; l++) {
+                    eT x = xp[i*Lanes + l];
+                    eT y = yp[i*Lanes + l];
+                    xp[i*Lanes + l] = c[l] * x - s[l] * y;
+                    yp[i*Lanes + l] = s[l] * x + c[l] * y;
+                }
+            }
+            return;
+        }
+};
+
+#endif
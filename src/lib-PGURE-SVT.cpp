@@ -39,6 +39,7 @@
 ***************************************************************************/
 
 // C++ headers
+#include <algorithm>
 #include <chrono>
 #include <ctime>
 #include <fstream>
@@ -51,6 +52,7 @@
 #include <stdexcept>
 #include <stdlib.h>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 // OpenMP library
@@ -67,16 +69,22 @@ extern "C" {
 // Own headers
 #include "arps.hpp"
 #include "hotpixel.hpp"
+#include "motioncache.hpp"
 #include "params.hpp"
 #include "noise.hpp"
+#include "noisecache.hpp"
 #include "pgure.hpp"
 #include "parallel.hpp"
+#include "pipeline.hpp"
+#include "session.hpp"
+#include "telemetry.hpp"
+#include "window.hpp"
 
 // Little function to convert string "0"/"1" to boolean
 bool strToBool(std::string const& s) {return s != "0";};
 
 // Main program
-extern "C" int PGURESVT(double *X,
+extern "C" int PGURESVT(void *X,
                         double *Y,
                         int *dims,
                         int Bs,
@@ -91,7 +99,19 @@ extern "C" int PGURESVT(double *X,
                         double tol,
                         int MedianSize,
                         double hotpixelthreshold,
-                        int numthreads) {
+                        int numthreads,
+                        int WindowReuse,
+                        int LambdaSweep,
+                        int SVDMethod,
+                        bool UseGPU,
+                        bool Streaming,
+                        int InputType,
+                        int Precision,
+                        int LambdaMethod,
+                        int LambdaEvals,
+                        double BlockAdaptive,
+                        bool LambdaPyramid,
+                        unsigned Seed) {
 
 	// Overall program timer
 	auto overallstart = std::chrono::steady_clock::now();
@@ -103,177 +123,371 @@ extern "C" int PGURESVT(double *X,
 	std::cout<<"Email:  tjof2@cam.ac.uk"<<std::endl<<std::endl;
 	std::cout<<"Version 0.3.2 - May 2016"<<std::endl<<std::endl;
 
-	// Set up OMP
+	// Set up the thread pool, which runs both the frame-level and the
+	// block-level loops. OpenMP is only used for SIMD loops, so any
+	// OpenMP teams (e.g. inside Armadillo) are kept to one thread, and
+	// BLAS is kept single-threaded as the calls are all on small blocks
 	#if defined(_OPENMP)
 		omp_set_dynamic(0);
-		omp_set_num_threads(numthreads);
+		omp_set_num_threads(1);
+	#endif
+	numthreads = std::max(1, numthreads);
+	parallel_set_num_threads(numthreads);
+	parallel_set_blas_threads(1);
+
+	// The GPU backend is optional at build time
+	#if !defined(PGURE_USE_CUDA)
+		if(UseGPU) {
+			std::cout<<"**WARNING** Built without USE_CUDA, running on the CPU"<<std::endl;
+		}
 	#endif
 
   int NoiseMethod = 4;
-  double lambda = (userLambda >= 0.) ? userLambda : 0.;
 
   int Nx = dims[0];
   int Ny = dims[1];
   int num_images = dims[2];
 
-  // Copy the image sequence into the a cube
-  arma::cube noisysequence(X, Nx, Ny, num_images);
-
-  // Generate the clean and filtered sequences
-  arma::cube cleansequence(Nx, Ny, num_images);
-  arma::cube filteredsequence(Nx, Ny, num_images);
-
-  cleansequence.zeros();
-  filteredsequence.zeros();
-
-  // Parameters for median filter
-  int memsize = 512 * 1024;	// L2 cache size
-  int filtsize = MedianSize;	// Median filter size in pixels
-
-  // Perform the initial median filtering
-  auto&& mfunc = [&]( int i )
-  {
-    unsigned short *Buffer = new unsigned short[Nx*Ny];
-    unsigned short *FilteredBuffer = new unsigned short[Nx*Ny];
-    arma::Mat<unsigned short> curslice = arma::conv_to<arma::Mat<unsigned short>>::from(noisysequence.slice(i).eval());
-    inplace_trans(curslice);
-    Buffer = curslice.memptr();
-    ConstantTimeMedianFilter(Buffer,
-                             FilteredBuffer,
-                             Nx, Ny, Nx, Ny,
-                             filtsize, 1, memsize);
-		arma::Mat<unsigned short> filslice(FilteredBuffer, Nx, Ny);
-		inplace_trans(filslice);
-		filteredsequence.slice(i) = arma::conv_to<arma::mat>::from(filslice);
-    delete[] Buffer;
-    delete[] FilteredBuffer;
-  };
-  parallel( mfunc, static_cast<unsigned long long>(num_images) );
-
-  /*
-  for (int i = 0; i < num_images; i++) {
-    arma::Mat<unsigned short> curslice = arma::conv_to<arma::Mat<unsigned short>>::from(noisysequence.slice(i).eval());
-    inplace_trans(curslice);
-    Buffer = curslice.memptr();
-    ConstantTimeMedianFilter(Buffer,
-                             FilteredBuffer,
-                             Nx, Ny, Nx, Ny,
-                             filtsize, 1, memsize);
-		arma::Mat<unsigned short> filslice(FilteredBuffer, Nx, Ny);
-		inplace_trans(filslice);
-		filteredsequence.slice(i) = arma::conv_to<arma::mat>::from(filslice);
+  // Median filter size in pixels
+  int filtsize = MedianSize;
+
+  // X (of InputType, see pipeline.hpp) is only read, a window at a
+  // time, and the output is written straight into Y. In streaming
+  // mode, frames are only read while their windows are denoised,
+  // rather than holding the filtered sequence too
+  arma::cube cleansequence(Y, Nx, Ny, num_images, false, true);
+  arma::cube filteredsequence;
+  std::vector<arma::uvec> hotpixels;
+  std::vector<arma::vec> hotvalues;
+  std::vector<double> mediantimes, hotpixeltimes;
+  FrameRing ring;
+  if(Streaming) {
+    ring.Initialize(Nx, Ny, num_images, T,
+                    [&](int k, arma::mat &frame) {
+                      ReadFrame(X, InputType, k, frame);
+                    },
+                    filtsize,
+                    hotpixelthreshold,
+                    numthreads);
+  }
+  else {
+    filteredsequence.set_size(Nx, Ny, num_images);
+    hotpixels.resize(num_images);
+    hotvalues.resize(num_images);
+    mediantimes.resize(num_images);
+    hotpixeltimes.resize(num_images);
+
+    // Initial outlier detection (for hot pixels)
+    // using median absolute deviation
+    std::cout << std::endl
+              << "Applying hot-pixel detector with threshold: "
+              << hotpixelthreshold
+              << " * MAD"
+              << std::endl;
+
+    // Perform the initial median filtering (16-bit and float input is
+    // filtered where it lies), and find the hot pixels, which are kept as
+    // corrections to apply when windows are read, as X can't be changed
+    auto&& mfunc = [&]( int i )
+    {
+      auto stage = std::chrono::steady_clock::now();
+      arma::mat frame(Nx, Ny);
+      ReadFrame(X, InputType, i, frame);
+      arma::mat filslice(filteredsequence.slice_memptr(i), Nx, Ny, false, true);
+      if(InputType == INPUT_UINT16) {
+        MedianFilterFrame(static_cast<const unsigned short *>(X) + static_cast<size_t>(i)*Nx*Ny,
+                          Nx, Ny, filslice, filtsize);
+      }
+      else if(InputType == INPUT_FLOAT32) {
+        MedianFilterFrame(static_cast<const float *>(X) + static_cast<size_t>(i)*Nx*Ny,
+                          Nx, Ny, filslice, filtsize);
+      }
+      else {
+        MedianFilterFrame(frame, filslice, filtsize);
+      }
+      mediantimes[i] = Lap(stage);
+      // frame is only a copy, so is cleaned in place
+      HotPixelFrame(frame, hotpixelthreshold, &hotpixels[i]);
+      hotvalues[i] = frame.elem(hotpixels[i]);
+      hotpixeltimes[i] = Lap(stage);
+    };
+    parallel( mfunc, static_cast<unsigned long long>(num_images) );
   }
-  */
-
-
-  // Initial outlier detection (for hot pixels)
-  // using median absolute deviation
-  HotPixelFilter(noisysequence, hotpixelthreshold);
-
-	// Print table headings
-	int ww = 10;
-	std::cout<<std::endl;
-	std::cout<<std::right<<std::setw(5*ww+5)<<std::string(5*ww+5,'-')<<std::endl;
-	std::cout<<std::setw(5)<<"Frame"<<std::setw(ww)<<"Gain"<<std::setw(ww)<<"Offset"<<std::setw(ww)<<"Sigma"<<std::setw(ww)<<"Lambda"<<std::setw(ww)<<"Time (s)"<<std::endl;
-	std::cout<<std::setw(5*ww+5)<<std::string(5*ww+5,'-')<<std::endl;
 
 	// Loop over time windows
 	int framewindow = std::floor(T/2);
+
+	// Motion fields between neighbouring frames are shared by
+	// overlapping windows, so are estimated once for the sequence
+	// (on the normalized sequence, as the search is scale-invariant)
+	MotionCache motioncache;
+	if(Streaming) {
+		motioncache.Initialize(Nx, Ny, num_images,
+		                       [&ring](int k) { return ring.Filtered(k); },
+		                       Bs, MotionP);
+	}
+	else {
+		filteredsequence /= filteredsequence.max();
+		motioncache.Initialize(filteredsequence, Bs, MotionP);
+	}
+
+	// Likewise the patch statistics of each frame used for
+	// noise estimation, leaving only the fit for each window
+	NoiseCache noisecache;
+	noisecache.Initialize(num_images, 4);
+
+	// Each thread takes a run of consecutive windows, and windows after
+	// the first in a run slide the previous decomposition forward by one
+	// frame instead of starting afresh (WindowReuse <= 1 disables this)
+	int reuse = (WindowReuse > 1) ? WindowReuse : 1;
+	int numruns = (num_images + reuse - 1) / reuse;
+
+	// Runs are shared out dynamically over the pool, and the block-level
+	// loops inside each window are submitted to the same pool, so
+	// threads without a run of their own (e.g. when there are fewer
+	// windows than threads, or at the tail) help with the blocks of
+	// those still going. Streamed windows are denoised in order, so
+	// only use the block-level loops
 	//for(int timeiter = 0; timeiter < num_images; timeiter++) {
-    auto&& func = [&, lambda_=lambda]( int timeiter )
+	// Windows warm start the lambda search from the previous window
+	// in their run. Parallel runs start afresh rather than wait for
+	// their neighbour, so the result doesn't depend on the schedule,
+	// but streamed runs are in order, so carry it across runs too
+	double streamlambda = -1.;
+
+	// The optimizer type is picked by the precision option, and
+	// the windows are run with it through a generic lambda.
+	// Noise parameters, lambda and the PGURE perturbations are
+	// all per-window state, so results don't depend on how the
+	// runs are spread over the threads
+    auto&& runwindows = [&, alpha_=alpha, mu_=mu, sigma_=sigma]( int runiter, auto *tag )
     {
+		typedef typename std::remove_pointer<decltype(tag)>::type Optimizer;
+
+		WindowDenoiser<Optimizer> window;
+		window.Initialize(&motioncache, &noisecache,
+		                  Bs, Bo, framewindow, reuse,
+		                  pgureOpt, tol, NoiseMethod,
+		                  SVDMethod, UseGPU, Seed, BlockAdaptive,
+		                  LambdaMethod, LambdaEvals,
+		                  LambdaSweep, LambdaPyramid);
+
+		// Optimum lambda of the previous window in the run
+		// (or of the previous run, when they run in order)
+		double warmlambda = Streaming ? streamlambda : -1.;
+
+		int lastiter = std::min(num_images, (runiter+1)*reuse);
+		for(int timeiter = runiter*reuse; timeiter < lastiter; timeiter++) {
+
+		// Estimated afresh for each window, unless given
+		double alpha = alpha_, mu = mu_, sigma = sigma_;
+		double lambda = pgureOpt ? warmlambda : userLambda;
+
+		// Stage timings, published when the frame is done
+		FrameTelemetry record = {};
+		record.start = Telemetry::instance().Now();
+
 		// Extract the subset of the image sequence
-		arma::cube u(Nx, Ny, T), ufilter(Nx, Ny, T), v(Nx, Ny, T);
-		if(timeiter < framewindow) {
-			u = noisysequence.slices(0,2*framewindow);
-			ufilter = filteredsequence.slices(0,2*framewindow);
-		}
-		else if(timeiter >= (num_images - framewindow)) {
-			u = noisysequence.slices(num_images-2*framewindow-1,num_images-1);
-			ufilter = filteredsequence.slices(num_images-2*framewindow-1,num_images-1);
+		int start = (timeiter < framewindow) ? 0
+		            : (timeiter >= (num_images - framewindow)) ? num_images-2*framewindow-1
+		            : timeiter - framewindow;
+		arma::cube u(Nx, Ny, T);
+		if(Streaming) {
+			ring.Require(start);
+			u = ring.Window(start);
 		}
 		else {
-			u = noisysequence.slices(timeiter - framewindow, timeiter + framewindow);
-			ufilter = filteredsequence.slices(timeiter - framewindow, timeiter + framewindow);
+			for(int k = 0; k < T; k++) {
+				arma::mat frame(u.slice_memptr(k), Nx, Ny, false, true);
+				ReadFrame(X, InputType, start+k, frame);
+				frame.elem(hotpixels[start+k]) = hotvalues[start+k];
+			}
 		}
-
-		// Basic sequence normalization
-		double inputmax = u.max();
-		u /= inputmax;
-		ufilter /= ufilter.max();
-
-		// Perform noise estimation
-		if(pgureOpt) {
-		  NoiseEstimator *noise = new NoiseEstimator;
-		  noise->Estimate(u,
-		                  alpha,
-		                  mu,
-		                  sigma,
-		                  4,
-		                  NoiseMethod);
-		  delete noise;
+		// Stages are timed from here, so reading the window
+		// only counts towards the time of the frame as a whole
+		auto stage = std::chrono::steady_clock::now();
+
+		// Place frames back into sequence (that is, into Y),
+		// dropping motion fields and noise statistics that no
+		// later window can use when streaming
+		cleansequence.slice(timeiter) = window.Denoise(u, timeiter, start, num_images,
+		                                               alpha, mu, sigma, lambda,
+		                                               pgureOpt, record, stage);
+		warmlambda = pgureOpt ? lambda : warmlambda;
+		if(Streaming) {
+			motioncache.Evict(start);
+			noisecache.Evict(start);
 		}
 
-		// Perform motion estimation
-		MotionEstimator *motion = new MotionEstimator;
-		motion->Estimate(ufilter,
-		                 timeiter,
-		                 framewindow,
-		                 num_images,
-		                 Bs,
-		                 MotionP);
-		arma::icube sequencePatches = motion->GetEstimate();
-		delete motion;
-
-		// Perform PGURE optimization
-		PGURE *optimizer = new PGURE;
-		optimizer->Initialize(u,
-		                      sequencePatches,
-		                      Bs,
-		                      Bo,
-		                      alpha,
-		                      sigma,
-		                      mu);
-		// Determine optimum threshold value (max 1000 evaluations)
-		if(pgureOpt) {
-            auto lambda = lambda_;
-			lambda = (timeiter == 0) ? arma::accu(u)/(Nx*Ny*T) : lambda;
-			lambda = optimizer->Optimize(tol, lambda, u.max(), 1E3);
-			v = optimizer->Reconstruct(lambda);
+		if(Streaming) {
+			ring.PrepareTimes(timeiter, record.median, record.hotpixel);
 		}
 		else {
-			v = optimizer->Reconstruct(userLambda);
+			record.median = mediantimes[timeiter];
+			record.hotpixel = hotpixeltimes[timeiter];
 		}
-		delete optimizer;
-
-		// Rescale back to original range
-		v *= inputmax;
+		Telemetry::instance().Publish(record);
 
-		// Place frames back into sequence
-		if(timeiter < framewindow) {
-			cleansequence.slice(timeiter) = v.slice(timeiter);
 		}
-		else if(timeiter >= (num_images - framewindow)) {
-			int endseqFrame = timeiter - (num_images - T);
-			cleansequence.slice(timeiter) = v.slice(endseqFrame);
+		if(Streaming) {
+			streamlambda = warmlambda;
 		}
-		else {
-			cleansequence.slice(timeiter) = v.slice(framewindow);
+	};
+    auto&& func = [&]( int runiter )
+    {
+		switch(Precision) {
+			case PRECISION_FLOAT:
+				runwindows(runiter, static_cast<PGURE<float> *>(nullptr));
+				break;
+			case PRECISION_MIXED:
+				runwindows(runiter, static_cast<PGURE<float, double> *>(nullptr));
+				break;
+			default:
+				runwindows(runiter, static_cast<PGURE<double> *>(nullptr));
+				break;
 		}
-
 	};
-    parallel( func, static_cast<unsigned long long>(num_images) );
-
-	// Finish the table off
-	std::cout<<std::setw(5*ww+5)<<std::string(5*ww+5,'-')<<std::endl<<std::endl;
+    if(Streaming) {
+		for(int runiter = 0; runiter < numruns; runiter++) {
+			func(runiter);
+		}
+    }
+    else {
+		parallel( func, static_cast<unsigned long long>(numruns) );
+    }
 
 	// Overall program timer
 	auto overallend = std::chrono::steady_clock::now();
 	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(overallend - overallstart);
 	std::cout<<"Total time: "<<std::setprecision(5)<<(elapsed.count()/1E6)<<" seconds"<<std::endl<<std::endl;
 
-  // Copy back to Python
-  memcpy(Y, cleansequence.memptr(), cleansequence.n_elem*sizeof(double));
-
 	return 0;
 }
+
+// Online denoising, for frames arriving one at a time (e.g. from
+// a detector). Parameters are as for PGURESVT(), with deadline the
+// per-frame latency target in seconds (<= 0 for none), and InputType
+// the type of the pushed frames
+extern "C" void *PGURESVTCreate(int *dims,
+                                int Bs,
+                                int Bo,
+                                int T,
+                                bool pgureOpt,
+                                double userLambda,
+                                double alpha,
+                                double mu,
+                                double sigma,
+                                int MotionP,
+                                double tol,
+                                int MedianSize,
+                                double hotpixelthreshold,
+                                int numthreads,
+                                int WindowReuse,
+                                int LambdaSweep,
+                                int SVDMethod,
+                                bool UseGPU,
+                                double deadline,
+                                int InputType,
+                                int Precision,
+                                int LambdaMethod,
+                                int LambdaEvals,
+                                double BlockAdaptive,
+                                bool LambdaPyramid,
+                                unsigned Seed) {
+
+	// Frames are denoised in order, so the pool
+	// only runs the block-level loops
+	#if defined(_OPENMP)
+		omp_set_dynamic(0);
+		omp_set_num_threads(1);
+	#endif
+	parallel_set_num_threads(std::max(1, numthreads));
+	parallel_set_blas_threads(1);
+
+	DenoisingSession *session = new DenoisingSession;
+	session->Initialize(dims[0], dims[1],
+	                    Bs, Bo, T,
+	                    pgureOpt, userLambda,
+	                    alpha, mu, sigma,
+	                    MotionP, tol,
+	                    MedianSize, hotpixelthreshold,
+	                    WindowReuse, LambdaSweep,
+	                    SVDMethod, UseGPU,
+	                    deadline,
+	                    InputType, Precision,
+	                    LambdaMethod, LambdaEvals,
+	                    BlockAdaptive, LambdaPyramid,
+	                    Seed,
+	                    std::max(1, numthreads));
+	return session;
+}
+
+// Push the next frame (dims[0] x dims[1], column-major, of the
+// session's input type). Returns the number of denoised frames
+// ready to pop
+extern "C" int PGURESVTPush(void *session,
+                            const void *frame) {
+	return static_cast<DenoisingSession *>(session)->Push(frame);
+}
+
+// Denoise the frames left at the end of the sequence
+extern "C" int PGURESVTFinish(void *session) {
+	return static_cast<DenoisingSession *>(session)->Finish();
+}
+
+// Copy the oldest denoised frame into frame and its index into
+// index. Returns 1 if a frame was ready, 0 otherwise
+extern "C" int PGURESVTPop(void *session,
+                           double *frame,
+                           int *index) {
+	return static_cast<DenoisingSession *>(session)->Pop(frame, *index) ? 1 : 0;
+}
+
+// Number of frames that must follow a frame before it is denoised
+extern "C" int PGURESVTLatency(void *session) {
+	return static_cast<DenoisingSession *>(session)->Latency();
+}
+
+// Frames denoised, deadline misses and latencies (in seconds) so far
+extern "C" void PGURESVTStats(void *session,
+                              int *emitted,
+                              int *misses,
+                              double *maxlatency,
+                              double *meanlatency) {
+	SessionStats stats = static_cast<DenoisingSession *>(session)->Stats();
+	*emitted = stats.emitted;
+	*misses = stats.misses;
+	*maxlatency = stats.maxLatency;
+	*meanlatency = stats.meanLatency;
+}
+
+extern "C" void PGURESVTDestroy(void *session) {
+	delete static_cast<DenoisingSession *>(session);
+}
+
+// Per-frame telemetry (see telemetry.hpp) for PGURESVT() and the
+// sessions, which is off unless enabled here. Keeps up to capacity
+// records to read back with PGURESVTTelemetryRead(), and/or calls
+// callback with each record from the thread that denoised the frame.
+// A capacity of 0 and a null callback turn it off again
+extern "C" void PGURESVTTelemetry(int capacity,
+                                  TelemetryCallback callback,
+                                  void *user) {
+	if(capacity <= 0 && callback == nullptr) {
+		Telemetry::instance().Disable();
+	}
+	else {
+		Telemetry::instance().Enable(capacity, callback, user);
+	}
+}
+
+// Move up to max of the oldest kept records into records, returning
+// how many, with the number dropped as the queue was full in dropped
+extern "C" int PGURESVTTelemetryRead(FrameTelemetry *records,
+                                     int max,
+                                     long *dropped) {
+	if(dropped != nullptr) {
+		*dropped = Telemetry::instance().Dropped();
+	}
+	return Telemetry::instance().Read(records, max);
+}
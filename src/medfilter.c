@@ -57,6 +57,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Own header */
+#include "medfilter.h"
+
 /* Type declarations */
 #ifdef _MSC_VER
 #include <basetsd.h>
@@ -70,7 +73,9 @@ typedef UINT32 uint32_t;
 
 /* Intrinsic declarations */
 #if defined(__SSE2__) || defined(__MMX__)
-#if defined(__SSE2__)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
 #include <emmintrin.h>
 #elif defined(__MMX__)
 #include <mmintrin.h>
@@ -84,6 +89,13 @@ typedef UINT32 uint32_t;
 #include <altivec.h>
 #endif
 
+/* Cache size queries */
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(__unix__)
+#include <unistd.h>
+#endif
+
 
 /* Compiler peculiarities */
 #if defined(__GNUC__)
@@ -112,11 +124,11 @@ typedef UINT32 uint32_t;
  * is 16 bit wide. Pixels inserted in the fine level also get inserted into the
  * coarse bucket designated by the MSBs of the fine bucket value.
  *
- * The structure is aligned on 16 bytes, which is a prerequisite for SIMD
+ * The structure is aligned on 32 bytes, which is a prerequisite for SIMD
  * instructions. Each bucket is 16 bit wide, which means that extra care must be
  * taken to prevent overflow.
  */
-typedef struct align(16)
+typedef struct align(32)
 {
     uint16_t coarse[SQRT_BUCKET_SIZE];
     uint16_t fine[SQRT_BUCKET_SIZE][SQRT_BUCKET_SIZE];
@@ -141,7 +153,13 @@ typedef struct align(16)
  * SSE2, MMX or Altivec, if available.
  */
 
-#if defined(__SSE2__)
+#if defined(__AVX2__)
+static inline void histogram_add( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y[SQRT_BUCKET_SIZE] )
+{
+    int i;
+    for (i=0;i<SQRT_BUCKET_SIZE;i+=16) _mm256_storeu_si256( (__m256i*) &y[i], _mm256_add_epi16( _mm256_loadu_si256( (const __m256i*) &y[i] ), _mm256_loadu_si256( (const __m256i*) &x[i] ) ) );
+}
+#elif defined(__SSE2__)
 static inline void histogram_add( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y[SQRT_BUCKET_SIZE] )
 {   
     int i;
@@ -173,7 +191,13 @@ static inline void histogram_add( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y
  * Subtracts histogram \a x from \a y and stores the result in \a y. Makes use
  * of SSE2, MMX or Altivec, if available.
  */
-#if defined(__SSE2__)
+#if defined(__AVX2__)
+static inline void histogram_sub( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y[SQRT_BUCKET_SIZE] )
+{
+    int i;
+    for (i=0;i<SQRT_BUCKET_SIZE;i+=16) _mm256_storeu_si256( (__m256i*) &y[i], _mm256_sub_epi16( _mm256_loadu_si256( (const __m256i*) &y[i] ), _mm256_loadu_si256( (const __m256i*) &x[i] ) ) );
+}
+#elif defined(__SSE2__)
 static inline void histogram_sub( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y[SQRT_BUCKET_SIZE] )
 {
     int i;
@@ -200,6 +224,28 @@ static inline void histogram_sub( const uint16_t x[SQRT_BUCKET_SIZE], uint16_t y
     }
 }
 #endif
+
+/**
+ * Adds \a a times histogram \a x to \a y. Makes use of AVX2 or SSE2, if
+ * available.
+ */
+#if defined(__AVX2__)
+static inline void histogram_muladd( const uint16_t a, const uint16_t x[SQRT_BUCKET_SIZE],
+        uint16_t y[SQRT_BUCKET_SIZE] )
+{
+    int i;
+    const __m256i av = _mm256_set1_epi16( (short) a );
+    for (i=0;i<SQRT_BUCKET_SIZE;i+=16) _mm256_storeu_si256( (__m256i*) &y[i], _mm256_add_epi16( _mm256_loadu_si256( (const __m256i*) &y[i] ), _mm256_mullo_epi16( av, _mm256_loadu_si256( (const __m256i*) &x[i] ) ) ) );
+}
+#elif defined(__SSE2__)
+static inline void histogram_muladd( const uint16_t a, const uint16_t x[SQRT_BUCKET_SIZE],
+        uint16_t y[SQRT_BUCKET_SIZE] )
+{
+    int i;
+    const __m128i av = _mm_set1_epi16( (short) a );
+    for (i=0;i<SQRT_BUCKET_SIZE;i+=8) *(__m128i*) &y[i] = _mm_add_epi16( *(__m128i*) &y[i], _mm_mullo_epi16( av, *(__m128i*) &x[i] ) );
+}
+#else
 static inline void histogram_muladd( const uint16_t a, const uint16_t x[SQRT_BUCKET_SIZE],
         uint16_t y[SQRT_BUCKET_SIZE] )
 {
@@ -208,8 +254,92 @@ static inline void histogram_muladd( const uint16_t a, const uint16_t x[SQRT_BUC
         y[i] += a * x[i];
     }
 }
+#endif
+
+/**
+ * Buffers for the column histograms (and for quantizing floating-point
+ * input), which are kept between calls and grown as needed, so that
+ * filtering a sequence of frames does not allocate for every frame.
+ */
+struct MedianFilterContext
+{
+    uint16_t *h_coarse, *h_fine;
+    size_t columns;
+    uint16_t *scratch;
+    size_t scratch_size;
+};
+
+static void *aligned_calloc( size_t size )
+{
+#if defined(__SSE2__) || defined(__MMX__)
+    void *p = _mm_malloc( size, 32 );
+    if ( p ) {
+        memset( p, 0, size );
+    }
+    return p;
+#else
+    return calloc( size, 1 );
+#endif
+}
+
+static void aligned_free( void *p )
+{
+#if defined(__SSE2__) || defined(__MMX__)
+    _mm_free( p );
+#else
+    free( p );
+#endif
+}
+
+MedianFilterContext *MedianFilterCreate( void )
+{
+    MedianFilterContext *ctx = (MedianFilterContext*) calloc( 1, sizeof(MedianFilterContext) );
+    return ctx;
+}
+
+void MedianFilterDestroy( MedianFilterContext *ctx )
+{
+    if ( !ctx ) {
+        return;
+    }
+    aligned_free( ctx->h_coarse );
+    aligned_free( ctx->h_fine );
+    free( ctx->scratch );
+    free( ctx );
+}
+
+/* Make room for the histograms of n columns (times channels) */
+static void context_reserve( MedianFilterContext *ctx, size_t n )
+{
+    if ( ctx->columns >= n ) {
+        return;
+    }
+    aligned_free( ctx->h_coarse );
+    aligned_free( ctx->h_fine );
+    ctx->h_coarse = (uint16_t*) aligned_calloc(  1 * SQRT_BUCKET_SIZE * n * sizeof(uint16_t) );
+    ctx->h_fine   = (uint16_t*) aligned_calloc( SQRT_BUCKET_SIZE * SQRT_BUCKET_SIZE * n * sizeof(uint16_t) );
+    ctx->columns = n;
+}
+
+unsigned long MedianFilterCacheSize( void )
+{
+#if defined(__APPLE__)
+    uint64_t size = 0;
+    size_t length = sizeof(size);
+    if ( sysctlbyname( "hw.l2cachesize", &size, &length, NULL, 0 ) == 0 && size > 0 ) {
+        return (unsigned long) size;
+    }
+#elif defined(_SC_LEVEL2_CACHE_SIZE)
+    long size = sysconf( _SC_LEVEL2_CACHE_SIZE );
+    if ( size > 0 ) {
+        return (unsigned long) size;
+    }
+#endif
+    return 512 * 1024;
+}
 
 static void ctmf_helper(
+        MedianFilterContext* const ctx,
         const uint16_t* const src, uint16_t* const dst,
         const int width, const int height,
         const int src_step, const int dst_step,
@@ -223,6 +353,7 @@ static void ctmf_helper(
 
     Histogram H[4];
     uint16_t *h_coarse, *h_fine, luc[4][SQRT_BUCKET_SIZE];
+    uint8_t touched[4][SQRT_BUCKET_SIZE];
     assert( src );
     assert( dst );
     assert( r >= 0 );
@@ -231,16 +362,12 @@ static void ctmf_helper(
     assert( src_step != 0 );
     assert( dst_step != 0 );
 
-    /* SSE2 and MMX need aligned memory, provided by _mm_malloc(). */
-#if defined(__SSE2__) || defined(__MMX__)
-    h_coarse = (uint16_t*) _mm_malloc(  1 * SQRT_BUCKET_SIZE * n * cn * sizeof(uint16_t), 16 );
-    h_fine   = (uint16_t*) _mm_malloc( SQRT_BUCKET_SIZE * SQRT_BUCKET_SIZE * n * cn * sizeof(uint16_t), 16 );
+    /* The histograms are kept in the context, and cleared for each stripe */
+    context_reserve( ctx, (size_t) n * cn );
+    h_coarse = ctx->h_coarse;
+    h_fine   = ctx->h_fine;
     memset( h_coarse, 0,  1 * SQRT_BUCKET_SIZE * n * cn * sizeof(uint16_t) );
     memset( h_fine,   0, SQRT_BUCKET_SIZE * SQRT_BUCKET_SIZE * n * cn * sizeof(uint16_t) );
-#else
-    h_coarse = (uint16_t*) calloc(  1 * SQRT_BUCKET_SIZE * n * cn, sizeof(uint16_t) );
-    h_fine   = (uint16_t*) calloc( SQRT_BUCKET_SIZE * SQRT_BUCKET_SIZE * n * cn, sizeof(uint16_t) );
-#endif
 
     /* First row initialization */
     for ( j = 0; j < n; ++j ) {
@@ -275,9 +402,14 @@ static void ctmf_helper(
             }
         }
 
-        /* First column initialization */
-        memset( H, 0, cn*sizeof(H[0]) );
+        /* First column initialization. Only the coarse level is set up
+         * here: each fine segment is set up when it is first used in the
+         * row, rather than all 256 of them for every row */
+        for ( c = 0; c < cn; ++c ) {
+            memset( H[c].coarse, 0, sizeof(H[c].coarse) );
+        }
         memset( luc, 0, cn*sizeof(luc[0]) );
+        memset( touched, 0, cn*sizeof(touched[0]) );
         if ( pad_left ) {
             for ( c = 0; c < cn; ++c ) {
                 histogram_muladd( r, &h_coarse[SQRT_BUCKET_SIZE*n*c], H[c].coarse );
@@ -288,11 +420,6 @@ static void ctmf_helper(
                 histogram_add( &h_coarse[SQRT_BUCKET_SIZE*(n*c+j)], H[c].coarse );
             }
         }
-        for ( c = 0; c < cn; ++c ) {
-            for ( k = 0; k < SQRT_BUCKET_SIZE; ++k ) {
-                histogram_muladd( 2*r+1, &h_fine[SQRT_BUCKET_SIZE*n*(SQRT_BUCKET_SIZE*c+k)], &H[c].fine[k][0] );
-            }
-        }
 
         for ( j = pad_left ? 0 : r; j < (pad_right ? n : n-r); ++j ) {
             for ( c = 0; c < cn; ++c ) {
@@ -324,12 +451,18 @@ static void ctmf_helper(
                     }
                 }
                 else {
+                    if ( !touched[c][k] ) {
+                        memset( &H[c].fine[k], 0, SQRT_BUCKET_SIZE * sizeof(uint16_t) );
+                        histogram_muladd( 2*r+1, &h_fine[SQRT_BUCKET_SIZE*n*(SQRT_BUCKET_SIZE*c+k)], &H[c].fine[k][0] );
+                    }
                     for ( ; luc[c][k] < j+r+1; ++luc[c][k] ) {
                         histogram_sub( &h_fine[SQRT_BUCKET_SIZE*(n*(SQRT_BUCKET_SIZE*c+k)+MAX(luc[c][k]-2*r-1,0))], H[c].fine[k] );
                         histogram_add( &h_fine[SQRT_BUCKET_SIZE*(n*(SQRT_BUCKET_SIZE*c+k)+MIN(luc[c][k],n-1))], H[c].fine[k] );
                     }
                 }
 
+                touched[c][k] = 1;
+
                 histogram_sub( &h_coarse[SQRT_BUCKET_SIZE*(n*c+MAX(j-r,0))], H[c].coarse );
 
                 /* Find median in segment */
@@ -346,13 +479,8 @@ static void ctmf_helper(
         }
     }
 
-#if defined(__SSE2__) || defined(__MMX__)
+#if defined(__MMX__) && !defined(__SSE2__)
     _mm_empty();
-    _mm_free(h_coarse);
-   _mm_free(h_fine);
-#else
-    free(h_coarse);
-    free(h_fine);
 #endif
 }
 
@@ -394,6 +522,56 @@ static void ctmf_helper(
  *                      memsize=512*1024 initially.
  */
 
+/*
+ * The column histograms of a stripe take 2*256 bytes each at the coarse level,
+ * which is what is walked for every row, and 2*65536 bytes at the fine level.
+ * Stripes are made as wide as fit the coarse level in memsize bytes, but kept
+ * within MEDFILTER_STRIPE_BYTES of fine histograms so that memory does not grow
+ * with the frame width, and kept wide compared with the 2*r overlap between
+ * neighbouring stripes.
+ */
+#define MEDFILTER_STRIPE_BYTES (32UL * 1024 * 1024)
+
+static int stripe_columns( const int r, const int cn, const unsigned long memsize )
+{
+    long columns = (long) (memsize / (SQRT_BUCKET_SIZE * sizeof(uint16_t) * cn));
+    columns = MIN( columns, (long) (MEDFILTER_STRIPE_BYTES / (sizeof(Histogram) * cn)) );
+    columns = MAX( columns, 4 * (2*r+1) );
+    return (int) columns;
+}
+
+/*
+ * Calls ctmf_helper() on the stripes that cover pixels [first, last) of each
+ * row, each with r pixels of overlap on either side within the image. Stripes
+ * are at least 2*r+1 wide, so a stripe that reaches the image edge only writes
+ * its own pixels. \a src holds the image from pixel \a origin of each row on.
+ */
+static void filter_range(
+        MedianFilterContext* const ctx,
+        const uint16_t* const src, const int origin, uint16_t* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn,
+        const int first, const int last,
+        const unsigned long memsize
+        )
+{
+    const int columns = stripe_columns( r, cn, memsize );
+    int i, end;
+
+    for ( i = first; i < last; i = end ) {
+        int lo, hi;
+        end = MIN( i + columns, last );
+        if ( last - end < 2*r+1 ) {
+            end = last;
+        }
+        lo = MAX( i - r, 0 );
+        hi = MIN( end + r, width );
+        ctmf_helper( ctx, src + cn*(lo - origin), dst + cn*lo, hi - lo, height, src_step, dst_step, r, cn,
+                lo == 0, hi == width );
+    }
+}
+
 void ConstantTimeMedianFilter(
         const unsigned short* const src, unsigned short* const dst,
         const int width, const int height,
@@ -401,55 +579,72 @@ void ConstantTimeMedianFilter(
         const int r, const int cn, const long unsigned int memsize
         )
 {
-    /*
-     * Processing the image in vertical stripes is an optimization made
-     * necessary by the limited size of the CPU cache. Each histogram is 544
-     * bytes big and therefore I can fit a limited number of them in the cache.
-     * That number may sometimes be smaller than the image width, which would be
-     * the number of histograms I would need without stripes.
-     *
-     * I need to keep histograms in the cache so that they are available
-     * quickly when processing a new row. Each row needs access to the previous
-     * row's histograms. If there are too many histograms to fit in the cache,
-     * thrashing to RAM happens.
-     *
-     * To solve this problem, I figure out the maximum number of histograms
-     * that can fit in cache. From this is determined the number of stripes in
-     * an image. The formulas below make the stripes all the same size and use
-     * as few stripes as possible.
-     *
-     * Note that each stripe causes an overlap on the neighboring stripes, as
-     * when mowing the lawn. That overlap is proportional to r. When the overlap
-     * is a significant size in comparison with the stripe size, then we are not
-     * O(1) anymore, but O(r). In fact, we have been O(r) all along, but the
-     * initialization term was neglected, as it has been (and rightly so) in B.
-     * Weiss, "Fast Median and Bilateral Filtering", SIGGRAPH, 2006. Processing
-     * by stripes only makes that initialization term bigger.
-     *
-     * Also, note that the leftmost and rightmost stripes don't need overlap.
-     * A flag is passed to ctmf_helper() so that it treats these cases as if the
-     * image was zero-padded.
-     */
-    int stripes = (int) ceil( (double) (width - 2*r) / (memsize / sizeof(Histogram) - 2*r) );
-    int stripe_size = (int) ceil( (double) ( width + stripes*2*r - 2*r ) / stripes );
-
-    int i;
-
-    for ( i = 0; i < width; i += stripe_size - 2*r ) {
-        int stripe = stripe_size;
-    /* Make sure that the filter kernel fits into one stripe. */
-
-    if ( i + stripe_size - 2*r >= width || width - (i + stripe_size - 2*r) < 2*r+1 ) {
-            stripe = width - i;
-        }
+    MedianFilterContext *ctx = MedianFilterCreate();
+    filter_range( ctx, src, 0, dst, width, height, src_step, dst_step, r, cn, 0, width, memsize );
+    MedianFilterDestroy( ctx );
+}
 
-        ctmf_helper( src + cn*i, dst + cn*i, stripe, height, src_step, dst_step, r, cn,
-                i == 0, stripe == width - i );
+/**
+ * \brief Reentrant constant-time median filtering of part of an image
+ *
+ * As ConstantTimeMedianFilter(), but only pixels [first, last) of each row
+ * are written to \a dst, and the histograms are kept in \a ctx between calls.
+ * Different parts of the same image can be filtered at the same time on
+ * different threads, each with its own context, as long as each part is at
+ * least 2*r+1 pixels wide.
+ */
+void MedianFilterRange(
+        MedianFilterContext *ctx,
+        const unsigned short* const src, unsigned short* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const int cn,
+        const int first, const int last,
+        const long unsigned int memsize
+        )
+{
+    filter_range( ctx, src, 0, dst, width, height, src_step, dst_step, r, cn, first, last, memsize );
+}
 
-        if ( stripe == width - i ) {
-            break;
+/**
+ * \brief Reentrant constant-time median filtering of a floating-point image
+ *
+ * As MedianFilterRange() for a single-channel image of floats. Each value is
+ * multiplied by \a scale and truncated to a 16-bit bin (negative values and
+ * NaNs to 0, large values to 65535), as the 16-bit histograms need, so the
+ * output is the median of the bins.
+ */
+void MedianFilterRangeFloat(
+        MedianFilterContext *ctx,
+        const float* const src, unsigned short* const dst,
+        const int width, const int height,
+        const int src_step, const int dst_step,
+        const int r, const float scale,
+        const int first, const int last,
+        const long unsigned int memsize
+        )
+{
+    /* Only the pixels the stripes read are quantized */
+    const int lo = MAX( first - r, 0 ), hi = MIN( last + r, width );
+    const int n = hi - lo;
+    size_t size = (size_t) n * height;
+    int i, j;
+
+    if ( ctx->scratch_size < size ) {
+        free( ctx->scratch );
+        ctx->scratch = (uint16_t*) malloc( size * sizeof(uint16_t) );
+        ctx->scratch_size = size;
+    }
+    for ( i = 0; i < height; ++i ) {
+        const float *p = src + (size_t) src_step * i + lo;
+        uint16_t *q = ctx->scratch + (size_t) n * i;
+        for ( j = 0; j < n; ++j ) {
+            float v = p[j] * scale;
+            q[j] = (v > 0.f) ? ((v < 65535.f) ? (uint16_t) v : 65535) : 0;
         }
-
     }
-}
 
+    /* The scratch image holds pixels [lo, hi) of each row */
+    filter_range( ctx, ctx->scratch, lo, dst, width, height, n, dst_step, r, 1,
+            first, last, memsize );
+}
@@ -38,6 +38,48 @@ void ConstantTimeMedianFilter(const unsigned short* const src,
                               int channels,
                               unsigned long memsize);
 
+// Histogram buffers kept between calls to the reentrant filters.
+// A context must only be used by one thread at a time
+typedef struct MedianFilterContext MedianFilterContext;
+
+MedianFilterContext *MedianFilterCreate(void);
+
+void MedianFilterDestroy(MedianFilterContext *ctx);
+
+// Size of the L2 cache (in bytes) for memsize, found at runtime
+// where the platform allows, or 512 kB otherwise
+unsigned long MedianFilterCacheSize(void);
+
+// Filter pixels [first, last) of each row into dst, so parts of
+// the image at least 2*r+1 wide can be filtered on different threads
+void MedianFilterRange(MedianFilterContext *ctx,
+                       const unsigned short* const src,
+                       unsigned short* const dst,
+                       int width,
+                       int height,
+                       int src_step_row,
+                       int dst_step_row,
+                       int r,
+                       int channels,
+                       int first,
+                       int last,
+                       unsigned long memsize);
+
+// As MedianFilterRange() for single-channel float input, which is
+// multiplied by scale and truncated to 16-bit bins
+void MedianFilterRangeFloat(MedianFilterContext *ctx,
+                            const float* const src,
+                            unsigned short* const dst,
+                            int width,
+                            int height,
+                            int src_step_row,
+                            int dst_step_row,
+                            int r,
+                            float scale,
+                            int first,
+                            int last,
+                            unsigned long memsize);
+
 #ifdef __cplusplus
     };
 #endif
@@ -0,0 +1,304 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Per-sequence cache of ARPS motion fields between consecutive frames.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef MOTIONCACHE_H
+#define MOTIONCACHE_H
+
+// C++ headers
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Armadillo library
+#include <armadillo>
+
+// Own header
+#include "arps.hpp"
+
+// MotionEstimator::Estimate() matches the grid blocks of each frame
+// of a window into its neighbour, working outwards from the frame
+// being denoised (the anchor). Every search only depends on the two
+// frames involved, except the first backward search, which is
+// predicted by the anchor's forward motion. So each window is made
+// of three kinds of field, indexed by absolute frame k:
+//   Forward(k)   grid of frame k matched into frame k+1
+//   Backward(k)  grid of frame k matched into frame k-1
+//   Predicted(k) as Backward(k), predicted by Forward(k)
+// These are computed once, on first use, and shared by all windows.
+// Calls from different threads are safe
+class MotionCache {
+ public:
+        MotionCache() {}
+        ~MotionCache() {}
+
+        // Returns frame k (rows x cols, column-major)
+        typedef std::function<const double *(int)> FrameSource;
+
+        // The sequence (which should be normalized to [0, 1]) must stay
+        // alive and unchanged while the cache is in use
+        void Initialize(const arma::cube &sequence,
+                        int blocksize,
+                        int MotionP) {
+            Initialize(sequence.n_rows,
+                       sequence.n_cols,
+                       sequence.n_slices,
+                       [&sequence](int k) { return sequence.slice_memptr(k); },
+                       blocksize,
+                       MotionP);
+            return;
+        }
+
+        // As above, with frames fetched on demand, e.g. from a ring
+        // buffer when streaming. Frames are only requested within the
+        // window passed to Window() or Slide(), and never before the
+        // last frame passed to Evict()
+        void Initialize(int rows,
+                        int cols,
+                        int frames,
+                        FrameSource source,
+                        int blocksize,
+                        int MotionP) {
+            frame = source;
+            Nx = rows;
+            Ny = cols;
+            N = frames;
+            Bs = blocksize;
+            vecSize = (1+(Nx-Bs))*(1+(Ny-Bs));
+            matcher.Configure(Nx, Ny, Bs, MotionP);
+
+            // Reference frame coordinates, as in MotionEstimator,
+            // and the block origins that motions are measured from
+            grid.set_size(2, vecSize);
+            origins.set_size(2, vecSize);
+            for (int i = 0; i < vecSize; i++) {
+                grid(0, i) = i % (1+(Ny-Bs));
+                grid(1, i) = i / (1+(Nx-Bs));
+                origins(0, i) = i % (1+(Nx-Bs));
+                origins(1, i) = i / (1+(Ny-Bs));
+            }
+
+            fields.clear();
+            first = 0;
+            for (int k = 0; k < N; k++) {
+                fields.emplace_back();
+            }
+            return;
+        }
+
+        // Start the cache at the given frame rather than the first,
+        // for part of a sequence, then Extend() it to the last frame
+        // needed. Must be called before the cache is used
+        void Seek(int frame) {
+            fields.clear();
+            first = frame;
+            N = frame;
+            return;
+        }
+
+        // Grow the sequence to the given number of frames, for
+        // frames arriving live. Must not be called while other
+        // threads are using the cache
+        void Extend(int frames) {
+            for (; N < frames; N++) {
+                fields.emplace_back();
+            }
+            return;
+        }
+
+        arma::imat Forward(int k) {
+            return Positions(ForwardMotion(k));
+        }
+
+        arma::imat Backward(int k) {
+            Fields &f = At(k);
+            std::call_once(f.backwardOnce, [&]() {
+                f.backward = MatchGrid(k, k-1, nullptr);
+                f.done |= BACKWARD;
+            });
+            return Positions(f.backward);
+        }
+
+        arma::imat Predicted(int k) {
+            Fields &f = At(k);
+            std::call_once(f.predictedOnce, [&]() {
+                f.predicted = MatchGrid(k, k-1, &ForwardMotion(k));
+                f.done |= PREDICTED;
+            });
+            return Positions(f.predicted);
+        }
+
+        // Fields of a frame, as bits
+        static const int FORWARD = 1, BACKWARD = 2, PREDICTED = 4;
+
+        // Which fields of frame k are computed so far
+        // (FORWARD | BACKWARD | PREDICTED), copying them out,
+        // e.g. for saving to a checkpoint
+        int Computed(int k,
+                     arma::Mat<short> &forward,
+                     arma::Mat<short> &backward,
+                     arma::Mat<short> &predicted) {
+            Fields &f = At(k);
+            int done = f.done.load();
+            if (done & FORWARD) {
+                forward = f.forward;
+            }
+            if (done & BACKWARD) {
+                backward = f.backward;
+            }
+            if (done & PREDICTED) {
+                predicted = f.predicted;
+            }
+            return done;
+        }
+
+        // Fields of frame k saved by an earlier run, used instead of
+        // computing them. Ignores fields that are empty or already set
+        void Preload(int k,
+                     const arma::Mat<short> &forward,
+                     const arma::Mat<short> &backward,
+                     const arma::Mat<short> &predicted) {
+            Fields &f = At(k);
+            auto load = [this, &f](std::once_flag &flag,
+                                   arma::Mat<short> &field,
+                                   const arma::Mat<short> &saved,
+                                   int bit) {
+                if (saved.n_rows == 2 && static_cast<int>(saved.n_cols) == vecSize) {
+                    std::call_once(flag, [&]() {
+                        field = saved;
+                        f.done |= bit;
+                    });
+                }
+            };
+            load(f.forwardOnce, f.forward, forward, FORWARD);
+            load(f.backwardOnce, f.backward, backward, BACKWARD);
+            load(f.predictedOnce, f.predicted, predicted, PREDICTED);
+            return;
+        }
+
+        // Trajectories for the window of T = 2*timewindow+1 frames
+        // around frame iter, identical to MotionEstimator::Estimate()
+        arma::icube Window(int iter,
+                           int timewindow) {
+            int T = 2*timewindow+1;
+            int start = (iter < timewindow) ? 0
+                        : (iter >= N - timewindow) ? N - T
+                        : iter - timewindow;
+            int anchor = iter - start;
+
+            arma::icube patches(2, vecSize, T);
+            patches.slice(anchor) = grid;
+            for (int k = anchor+1; k < T; k++) {
+                patches.slice(k) = Forward(start+k-1);
+            }
+            for (int k = anchor-1; k >= 0; k--) {
+                patches.slice(k) = (k == anchor-1 && iter < N-1)
+                                   ? Predicted(start+k+1)
+                                   : Backward(start+k+1);
+            }
+            return patches;
+        }
+
+        // Carry the trajectories of the window around iter-1 forward
+        // to the window around iter (away from the sequence ends), so
+        // the shared frames keep their trajectories
+        void Slide(arma::icube &patches,
+                   int iter,
+                   int timewindow) {
+            int T = patches.n_slices;
+            for (int k = 0; k < T-1; k++) {
+                patches.slice(k) = patches.slice(k+1);
+            }
+            patches.slice(T-1) = Forward(iter+timewindow-1);
+            return;
+        }
+
+        // Release the fields of frames before the given one, for
+        // streaming. They can't be recomputed afterwards. Must not
+        // be called while other threads are using the cache
+        void Evict(int before) {
+            while (first < std::min(before, N)) {
+                fields.pop_front();
+                first++;
+            }
+            return;
+        }
+
+ private:
+        FrameSource frame;
+        int Nx, Ny, N, Bs, vecSize;
+        MotionEstimator<double> matcher;
+        arma::imat grid, origins;
+
+        // Motion vectors are bounded by the search window,
+        // so they are kept as 16-bit integers. Growing or evicting
+        // at the ends of a deque leaves the other entries in place
+        struct Fields {
+            arma::Mat<short> forward, backward, predicted;
+            std::once_flag forwardOnce, backwardOnce, predictedOnce;
+            std::atomic<int> done{0};
+        };
+        std::deque<Fields> fields;
+        int first = 0;
+
+        // Fields of frame k, which must not have been evicted
+        Fields &At(int k) {
+            return fields[k - first];
+        }
+
+        const arma::Mat<short> &ForwardMotion(int k) {
+            Fields &f = At(k);
+            std::call_once(f.forwardOnce, [&]() {
+                f.forward = MatchGrid(k, k+1, nullptr);
+                f.done |= FORWARD;
+            });
+            return f.forward;
+        }
+
+        arma::imat Positions(const arma::Mat<short> &motion) const {
+            return origins + arma::conv_to<arma::imat>::from(motion);
+        }
+
+        // Match the blocks of frame from into frame to, returning
+        // the motion vectors (2 x vecSize)
+        arma::Mat<short> MatchGrid(int from,
+                                   int to,
+                                   const arma::Mat<short> *prediction) {
+            arma::imat positions(2, vecSize);
+            arma::imat motion = (prediction != nullptr)
+                                ? arma::conv_to<arma::imat>::from(*prediction)
+                                : arma::zeros<arma::imat>(2, vecSize);
+            matcher.Match(frame(from),
+                          frame(to),
+                          (to > from) ? 1 : -1,
+                          grid.memptr(),
+                          motion.memptr(),
+                          positions.memptr(),
+                          motion.memptr());
+            return arma::conv_to<arma::Mat<short>>::from(motion);
+        }
+};
+
+#endif
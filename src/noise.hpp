@@ -35,6 +35,8 @@
 #define NOISE_H
 
 #include <cstdlib>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <vector>
 
@@ -45,7 +47,7 @@ class NoiseEstimator {
  public:
         NoiseEstimator() {
             // Set Laplacian kernel to 3x3
-            laplacian = 1/8 * arma::ones<arma::mat>(3,3);
+            laplacian = arma::ones<arma::mat>(3,3) / 8;
             laplacian(1,1) = -1;
             treeDelete.resize(2);
         };
@@ -58,79 +60,98 @@ class NoiseEstimator {
                             double &sigmaIn,
                             int sizeIn,
                             int method) {
-            // Read from parameters
-            alpha = alphaIn;
-            mu = muIn;
-            sigma = sigmaIn;
-            size = sizeIn;
-
-            // Set some parameters
-            dSi = 0.;
-            Nx = input.n_cols;
-            Ny = input.n_rows;
-            T = input.n_slices;
-            wtype = 0; // 0 - "Huber", 1 - "BiSquare"
-
             // Perform quadtree decomposition of frames
             // to generate patches for noise estimation
-            int maxVsize = Nx*Ny;
-            arma::vec means = -1 * arma::ones<arma::vec>(T*maxVsize);
-            arma::vec vars = -1 * arma::ones<arma::vec>(T*maxVsize);
-            arma::vec minslice(T);
+            arma::vec means, vars;
+            for (size_t i = 0; i < input.n_slices; i++) {
+                arma::vec framemeans, framevars;
+                FrameStatistics(input.slice(i), sizeIn, framemeans, framevars);
+                means = arma::join_vert(means, framemeans);
+                vars = arma::join_vert(vars, framevars);
+            }
+            Fit(means, vars, input.n_rows, input.n_cols,
+                alphaIn, muIn, sigmaIn, method);
+            return;
+        };
 
-            // Perform quadtree decomposition of frames
-            // to generate patches for noise estimation
-            for (int i=0; i<T; i++) {
-                treeDelete[0] = arma::zeros<arma::umat>(3, 1);
-                treeDelete[0](2, 0) = Nx;
-                treeDelete[1] = arma::zeros<arma::umat>(0, 0);
+        // Robust mean and variance of each patch of the quadtree
+        // decomposition of one frame (which must be square)
+        void FrameStatistics(const arma::mat &frame,
+                             int sizeIn,
+                             arma::vec &means,
+                             arma::vec &vars) {
+            size = sizeIn;
+            Nx = frame.n_cols;
+            Ny = frame.n_rows;
+            wtype = 0; // 0 - "Huber", 1 - "BiSquare"
 
-                QuadTree(input.slice(i).eval(), 0);
+            treeDelete[0] = arma::zeros<arma::umat>(3, 1);
+            treeDelete[0](2, 0) = Nx;
+            treeDelete[1] = arma::zeros<arma::umat>(0, 0);
 
-                arma::umat tree = treeDelete[0];
-                arma::umat dele = arma::unique(arma::sort(treeDelete[1]));
+            QuadTree(frame, 0);
 
-                // Shed parents from quadtree
-                for (size_t k=dele.n_elem-1; k>0; k--) {
-                    tree.shed_col(dele(0, k));
-                }
+            arma::umat tree = treeDelete[0];
+            arma::umat dele = arma::unique(arma::sort(treeDelete[1]));
 
-                // Extract patches for robust estimation
-                for (size_t n=0; n<tree.n_cols; n++) {
-                    int x = tree(0, n);
-                    int y = tree(1, n);
-                    int s = tree(2, n);
-
-                    // Extract cube from input and reshape to column vector
-                    arma::cube tmpmm = input.subcube(
-                                            arma::span(x, x+s-1),
-                                            arma::span(y, y+s-1),
-                                            arma::span(i, i)
-                                       );
-                    tmpmm.reshape(s*s, 1, 1);
-                    arma::vec col = tmpmm.tube(0, 0, arma::size(s*s, 1));
-
-                    // Add robust patch mean and variance to array
-                    // Get robust mean estimate
-                    double meanEst = RobustMeanEstimate(col);
-
-                    // Convolve with Laplacian operator
-                    arma::mat patch(s*s, 1);
-                    patch.col(0) = col;
-                    patch.reshape(s, s);
-                    patch = ConvolveFIR(patch);
-                    patch.reshape(s*s, 1);
-                    col = patch.col(0);
-
-                    // Set robust mean estimate
-                    means(i*maxVsize + n) = meanEst;
-
-                    // Set robust variance estimate
-                    vars(i*maxVsize + n) = RobustVarEstimate(col);
-                }
+            // Shed parents from quadtree
+            for (size_t k=dele.n_elem-1; k>0; k--) {
+                tree.shed_col(dele(0, k));
             }
 
-            // Delete empty values (stored as -1)
+            // Laplacian residual of the whole frame, from
+            // which the patch noise variances are taken
+            arma::mat residual = ConvolveFIR(frame);
+
+            // Extract patches for robust estimation
+            means.set_size(tree.n_cols);
+            vars.set_size(tree.n_cols);
+            for (size_t n=0; n<tree.n_cols; n++) {
+                int x = tree(0, n);
+                int y = tree(1, n);
+                int s = tree(2, n);
+
+                // Extract patch from frame as a column vector
+                arma::vec col = arma::vectorise(frame.submat(
+                                                    arma::span(x, x+s-1),
+                                                    arma::span(y, y+s-1)));
+
+                // Add robust patch mean and variance to array
+                // Get robust mean estimate
+                means(n) = RobustMeanEstimate(col);
+
+                // Set robust variance estimate of the residual
+                col = arma::vectorise(residual.submat(
+                                          arma::span(x, x+s-1),
+                                          arma::span(y, y+s-1)));
+                vars(n) = RobustVarEstimate(col);
+            }
+            return;
+        };
+
+        // Fit the noise parameters to the patch statistics of a set
+        // of rows x cols frames, without overriding those that are
+        // already set (>= 0)
+        void Fit(arma::vec means,
+                 arma::vec vars,
+                 int rows,
+                 int cols,
+                 double &alphaIn,
+                 double &muIn,
+                 double &sigmaIn,
+                 int method) {
+            // Read from parameters
+            alpha = alphaIn;
+            mu = muIn;
+            sigma = sigmaIn;
+
+            // Set some parameters
+            dSi = 0.;
+            Nx = cols;
+            Ny = rows;
+            wtype = 0; // 0 - "Huber", 1 - "BiSquare"
+
+            // Delete empty values (negative)
             means = means.elem( find(means >= 0.) );
             vars = vars.elem( find(vars >= 0.) );
 
@@ -209,6 +230,56 @@ class NoiseEstimator {
         };
 
  private:
+        // The regression test (test/noise_laplacian.cpp)
+        // checks these helpers directly
+        friend struct NoiseEstimatorTest;
+
+        // Residual -laplacian*in of a whole frame, with the edges
+        // wrapped as before (index -1 -> N-2, N -> 1). The kernel is a
+        // 3x3 box sum plus a centre term, so is applied as sums of 3 down
+        // each column and then across columns, both contiguous loops
+        arma::mat ConvolveFIR(const arma::mat &in) const {
+            const int R = in.n_rows;
+            const int C = in.n_cols;
+            const double off = -laplacian(0, 0);
+            const double centre = -laplacian(1, 1) - off;
+
+            arma::mat colsum(R, C), out(R, C);
+            for (int x = 0; x < C; x++) {
+                const double *c = in.colptr(x);
+                double *sum = colsum.colptr(x);
+                sum[0] = c[R-2] + c[0] + c[1];
+                #pragma omp simd
+                for (int y = 1; y < R-1; y++) {
+                    sum[y] = c[y-1] + c[y] + c[y+1];
+                }
+                sum[R-1] = c[R-2] + c[R-1] + c[1];
+            }
+            for (int x = 0; x < C; x++) {
+                const double *left = colsum.colptr((x == 0) ? C-2 : x-1);
+                const double *mid = colsum.colptr(x);
+                const double *right = colsum.colptr((x == C-1) ? 1 : x+1);
+                const double *c = in.colptr(x);
+                double *o = out.colptr(x);
+                #pragma omp simd
+                for (int y = 0; y < R; y++) {
+                    o[y] = off * (left[y] + mid[y] + right[y]) + centre * c[y];
+                }
+            }
+            return out;
+        };
+
+        // Robust (MAD) variance of A, for roughly Gaussian samples
+        double RobustVarEstimate(const arma::vec &A) {
+            scratch.assign(A.begin(), A.end());
+            double med = Median(scratch);
+            for (auto &x : scratch) {
+                x = std::abs(x - med);
+            }
+            double sig = 1.4826 * Median(scratch);
+            return sig*sig;
+        };
+
         int Nx, Ny, T, wtype, size;
 
         std::vector<arma::umat> treeDelete;
@@ -241,6 +312,22 @@ class NoiseEstimator {
         // Discrete Laplacian operator
         arma::mat laplacian;
 
+        // Scratch for the order statistics, reused across patches
+        std::vector<double> scratch;
+
+        // Median of v, partially reordering it. For even sizes this is
+        // the midpoint of the middle two, as arma::median()
+        static double Median(std::vector<double> &v) {
+            size_t mid = v.size() / 2;
+            std::nth_element(v.begin(), v.begin() + mid, v.end());
+            double hi = v[mid];
+            if (v.size() % 2 == 1) {
+                return hi;
+            }
+            double lo = *std::max_element(v.begin(), v.begin() + mid);
+            return lo + (hi - lo) / 2;
+        };
+
         // Test to see if a node should be split
         bool SplitBlockQ(const arma::mat &A) {
 
@@ -289,19 +376,20 @@ class NoiseEstimator {
             }
         };
 
+        // Distance between the order statistics m-1 and N-m-1,
+        // found by selection rather than a full sort
         double InterqDist(const arma::vec &A) {
-            arma::vec sorted = sort(A);
-            int N = sorted.n_elem;
+            int N = A.n_elem;
             int m = std::floor((std::floor((N+1)/2) + 1)/2);
-            double diq = sorted(N-m-1) - sorted(m-1);
+            scratch.assign(A.begin(), A.end());
+            auto upper = scratch.begin() + (N-m-1);
+            std::nth_element(scratch.begin(), upper, scratch.end());
+            double hi = *upper;
+            std::nth_element(scratch.begin(), scratch.begin() + (m-1), upper + 1);
+            double diq = hi - scratch[m-1];
             return diq;
         };
 
-        double RobustVarEstimate(const arma::vec &A) {
-            double sig = 1.4826 * arma::median(arma::abs(A - arma::median(A)));
-            return sig*sig;
-        };
-
         double RobustMeanEstimate(const arma::vec &A) {
             int I = 1E4;
             int N = A.n_elem;
@@ -315,14 +403,28 @@ class NoiseEstimator {
 
             arma::vec w(N), r(N);
             w.ones();
+            const double *a = A.memptr();
+            double *wptr = w.memptr();
+            double *rptr = r.memptr();
 
             for (int i = 0; i < I; i++) {
-                r = w % A;
-                m = arma::accu(r);
-                aux = arma::accu(w);
+                // Weighted mean and mean absolute residual,
+                // each in one pass without temporaries
+                m = 0.;
+                aux = 0.;
+                #pragma omp simd reduction(+:m,aux)
+                for (int j = 0; j < N; j++) {
+                    m += wptr[j] * a[j];
+                    aux += wptr[j];
+                }
                 m = (std::abs(aux) < eps) ? m0 : m / aux;
-                r = A - m;
-                e = arma::mean(arma::abs(r));
+                e = 0.;
+                #pragma omp simd reduction(+:e)
+                for (int j = 0; j < N; j++) {
+                    rptr[j] = a[j] - m;
+                    e += std::abs(rptr[j]);
+                }
+                e /= N;
                 if (std::abs(m0 - m) < tol || e < tol) {
                     break;
                 }
@@ -334,26 +436,33 @@ class NoiseEstimator {
             return m;
         };
 
+        // Most frequent value of A quantized to N levels, taking the
+        // earliest of equally frequent values. Equal values are grouped
+        // by a stable sort, so each group starts at its first occurrence
         double ComputeMode(const arma::vec &A) {
-            int maxCount = 0;
-            int count;
-            double maxValue = 0.;
             double M = A.max();
             int N = A.n_elem;
+            if (M == 0.) {
+                return 0.;
+            }
             double dyn = 1. * N;
             arma::vec a = arma::round(A * dyn/M);
+            arma::uvec order = arma::stable_sort_index(a);
 
-            for (int i = 0; i < N; i++) {
-                count = 0;
-                for (int j = 0; j < N; j++) {
-                    if (a(j) == a(i)) {
-                        count++;
-                    }
+            int maxCount = 0;
+            arma::uword maxFirst = N;
+            double maxValue = 0.;
+            for (int i = 0; i < N; ) {
+                int j = i;
+                while (j < N && a(order(j)) == a(order(i))) {
+                    j++;
                 }
-                if (count > maxCount) {
-                    maxCount = count;
-                    maxValue = a(i);
+                if (j - i > maxCount || (j - i == maxCount && order(i) < maxFirst)) {
+                    maxCount = j - i;
+                    maxFirst = order(i);
+                    maxValue = a(order(i));
                 }
+                i = j;
             }
             maxValue *= M/dyn;
             return maxValue;
@@ -447,30 +556,6 @@ class NoiseEstimator {
             return b;
         };
 
-        arma::mat ConvolveFIR(const arma::mat &in) {
-            int N = in.n_cols;
-            arma::mat out(N,N);
-            out.zeros();
-            arma::mat neigh(3,3);
-            for (int x=0; x<N; x++) {
-                for (int y=0; y<N; y++) {
-                    int xp = ((x+1) == N) ? 1 : (x+1);
-                    int xm = ((x-1) < 0) ? (N-2) : (x-1);
-                    int yp = ((y+1) == N) ? 1 : (y+1);
-                    int ym = ((y-1) < 0) ? (N-2) : (y-1);
-                    neigh << in(xm,ym) << in(x,ym) << in(xp,ym)
-                          << arma::endr
-                          << in(xm,y)  << in(x,y)  << in(xp,y)
-                          << arma::endr
-                          << in(xm,yp) << in(x,yp) << in(xp,yp)
-                          << arma::endr;
-
-                    out(y, x) = arma::accu(neigh % (-1*laplacian));
-                }
-            }
-            return out;
-        };
-
         // Recursive quadtree function
         void QuadTree(const arma::mat &A,
                       int part) {
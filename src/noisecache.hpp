@@ -0,0 +1,145 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Per-sequence cache of the patch statistics used for noise estimation.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef NOISECACHE_H
+#define NOISECACHE_H
+
+// C++ headers
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+// Armadillo library
+#include <armadillo>
+
+// Own header
+#include "noise.hpp"
+
+// NoiseEstimator::Estimate() analyses every frame of a window on its
+// own (quadtree, robust patch means and variances) before fitting the
+// noise parameters to all the patches together. Overlapping windows
+// share all but one of their frames, so the per-frame statistics are
+// computed once, on first use, and only the fit is repeated for each
+// window. Windows are normalized by their maximum, which scales the
+// patch means and variances, so each frame is analysed after dividing
+// by its own maximum and rescaled to the normalization of the window.
+// Calls from different threads are safe
+class NoiseCache {
+ public:
+        NoiseCache() {}
+        ~NoiseCache() {}
+
+        void Initialize(int frames,
+                        int sizeIn) {
+            N = frames;
+            size = sizeIn;
+            stats.clear();
+            first = 0;
+            for (int k = 0; k < N; k++) {
+                stats.emplace_back();
+            }
+            return;
+        }
+
+        // Start the cache at the given frame rather than the first,
+        // for part of a sequence, then Extend() it to the last frame
+        // needed. Must be called before the cache is used
+        void Seek(int frame) {
+            stats.clear();
+            first = frame;
+            N = frame;
+            return;
+        }
+
+        // Grow the sequence to the given number of frames, for
+        // frames arriving live. Must not be called while other
+        // threads are using the cache
+        void Extend(int frames) {
+            for (; N < frames; N++) {
+                stats.emplace_back();
+            }
+            return;
+        }
+
+        // As NoiseEstimator::Estimate() on the window u, which holds
+        // frames start..start+T-1 divided by inputmax
+        void Estimate(const arma::cube &u,
+                      int start,
+                      double inputmax,
+                      double &alpha,
+                      double &mu,
+                      double &sigma,
+                      int method) {
+            arma::vec means, vars;
+            for (size_t k = 0; k < u.n_slices; k++) {
+                const Stats &s = Frame(start + k, u.slice(k), inputmax);
+                double ratio = s.scale / inputmax;
+                means = arma::join_vert(means, ratio * s.means);
+                vars = arma::join_vert(vars, (ratio * ratio) * s.vars);
+            }
+            NoiseEstimator fit;
+            fit.Fit(means, vars, u.n_rows, u.n_cols, alpha, mu, sigma, method);
+            return;
+        }
+
+        // Release the statistics of frames before the given one,
+        // for streaming. Must not be called while other threads
+        // are using the cache
+        void Evict(int before) {
+            while (first < std::min(before, N)) {
+                stats.pop_front();
+                first++;
+            }
+            return;
+        }
+
+ private:
+        int N, size;
+
+        // Patch statistics of frame k divided by scale
+        struct Stats {
+            arma::vec means, vars;
+            double scale = 1.;
+            std::once_flag once;
+        };
+        std::deque<Stats> stats;
+        int first = 0;
+
+        // Statistics of frame k, computed from frame (which is
+        // frame k divided by inputmax) if this is its first use
+        const Stats &Frame(int k,
+                           const arma::mat &frame,
+                           double inputmax) {
+            Stats &s = stats[k - first];
+            std::call_once(s.once, [&]() {
+                double framemax = frame.max();
+                double rescale = (framemax > 0.) ? 1. / framemax : 1.;
+                NoiseEstimator estimator;
+                estimator.FrameStatistics(frame * rescale, size, s.means, s.vars);
+                s.scale = inputmax / rescale;
+            });
+            return s;
+        }
+};
+
+#endif
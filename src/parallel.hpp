@@ -1,11 +1,190 @@
 #ifndef PARALLEL_HPP_DEFINED_ALREADY
 #define PARALLEL_HPP_DEFINED_ALREADY
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 constexpr unsigned long parallel_mode = 1;
 
+// OpenBLAS, if it is the BLAS linked in, so its own threads
+// can be kept from oversubscribing the pool
+#if defined(__GNUC__)
+extern "C" void openblas_set_num_threads( int ) __attribute__((weak));
+#endif
+
+// Persistent pool of workers, each with its own task deque. Workers
+// take from the back of their own deque and steal from the front of
+// the others. The caller of parallel() works through the items itself
+// as well, so never waits on a task that hasn't started, and calls
+// can nest without deadlocking
+class thread_pool
+{
+public:
+    static thread_pool& instance()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    ~thread_pool()
+    {
+        stop_workers();
+    }
+
+    // Total number of threads, counting the calling thread
+    unsigned size() const
+    {
+        return static_cast<unsigned>( workers.size() ) + 1;
+    }
+
+    // Must not be called while parallel() is running
+    void resize( unsigned threads )
+    {
+        threads = std::max( 1U, threads );
+        if ( threads == size() && !queues.empty() )
+            return;
+        stop_workers();
+
+        // queue 0 takes tasks submitted from outside the pool
+        queues.clear();
+        for ( unsigned index = 0; index != threads; ++index )
+            queues.emplace_back( new task_queue );
+        stopping = false;
+        for ( unsigned index = 1; index != threads; ++index )
+            workers.emplace_back( [this, index](){ worker_loop( index ); } );
+    }
+
+    void submit( std::function<void()> task )
+    {
+        unsigned index = ( worker_index < queues.size() ) ? worker_index : 0;
+        {
+            std::lock_guard<std::mutex> lock( queues[index]->mutex );
+            queues[index]->tasks.push_back( std::move(task) );
+        }
+        pending.fetch_add( 1 );
+        {
+            std::lock_guard<std::mutex> lock( sleep_mutex );
+        }
+        wake.notify_one();
+    }
+
+    // Run one queued task, if there is one
+    bool run_one()
+    {
+        std::function<void()> task;
+        if ( !take( task ) )
+            return false;
+        task();
+        return true;
+    }
+
+private:
+    struct task_queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<bool> stopping{false};
+    std::atomic<long> pending{0};
+
+    static inline thread_local unsigned worker_index = 0;
+
+    thread_pool()
+    {
+        resize( std::thread::hardware_concurrency() );
+    }
+
+    bool take( std::function<void()>& task )
+    {
+        if ( queues.empty() )
+            return false;
+        unsigned const count = static_cast<unsigned>( queues.size() );
+        unsigned const own = ( worker_index < count ) ? worker_index : 0;
+
+        // newest task first from our own deque
+        {
+            std::lock_guard<std::mutex> lock( queues[own]->mutex );
+            if ( !queues[own]->tasks.empty() )
+            {
+                task = std::move( queues[own]->tasks.back() );
+                queues[own]->tasks.pop_back();
+                pending.fetch_sub( 1 );
+                return true;
+            }
+        }
+
+        // otherwise steal the oldest task from another deque
+        for ( unsigned offset = 1; offset != count; ++offset )
+        {
+            task_queue& victim = *queues[( own + offset ) % count];
+            std::lock_guard<std::mutex> lock( victim.mutex );
+            if ( !victim.tasks.empty() )
+            {
+                task = std::move( victim.tasks.front() );
+                victim.tasks.pop_front();
+                pending.fetch_sub( 1 );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop( unsigned index )
+    {
+        worker_index = index;
+        for ( ;; )
+        {
+            if ( run_one() )
+                continue;
+            std::unique_lock<std::mutex> lock( sleep_mutex );
+            wake.wait( lock, [this](){ return stopping.load() || pending.load() > 0; } );
+            if ( stopping.load() )
+                return;
+        }
+    }
+
+    void stop_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock( sleep_mutex );
+            stopping = true;
+        }
+        wake.notify_all();
+        for ( auto& th : workers )
+            th.join();
+        workers.clear();
+    }
+};
+
+// Number of threads parallel() runs on, counting the caller
+inline void parallel_set_num_threads( unsigned threads )
+{
+    thread_pool::instance().resize( threads );
+}
+
+// Number of threads used inside BLAS calls (OpenBLAS only)
+inline void parallel_set_blas_threads( int threads )
+{
+#if defined(__GNUC__)
+    if ( openblas_set_num_threads )
+        openblas_set_num_threads( threads );
+#endif
+}
+
 // originally from https://github.com/fengwang/matrix/blob/master/matrix.hpp#L222
 template< typename Function, typename Integer_Type >
 void parallel( Function const& func, Integer_Type dim_first, Integer_Type dim_last, unsigned long threshold = 1 ) // 1d parallel
@@ -18,7 +197,8 @@ void parallel( Function const& func, Integer_Type dim_first, Integer_Type dim_la
     }
     else // <- this is constexpr-if, `else` is a must
     {
-        unsigned int const total_cores = std::thread::hardware_concurrency();
+        thread_pool& pool = thread_pool::instance();
+        unsigned const total_cores = pool.size();
 
         // case of non-parallel or small jobs
         if ( (total_cores <= 1) || ((dim_last - dim_first) <= threshold) )
@@ -29,42 +209,57 @@ void parallel( Function const& func, Integer_Type dim_first, Integer_Type dim_la
             return;
         }
 
-        // case of small job numbers
-        std::vector<std::thread> threads;
-        if ( dim_last - dim_first <= total_cores )
+        // Items are handed out in small chunks as threads become free,
+        // so uneven items (e.g. frames at the sequence edges) balance
+        std::uint_least64_t const jobs = dim_last - dim_first;
+        std::uint_least64_t const chunk = std::max<std::uint_least64_t>( 1, jobs / (4 * total_cores) );
+        auto const& job_slice = [&]( std::atomic<std::uint_least64_t>& next )
         {
-            for ( auto index = dim_first; index != dim_last; ++index )
-                threads.emplace_back( std::thread{[&func, index](){ func( index ); }} );
-            for ( auto& th : threads )
-                th.join();
-            return;
-        }
+            for ( ;; )
+            {
+                std::uint_least64_t a = next.fetch_add( chunk );
+                if ( a >= jobs ) return;
+                std::uint_least64_t b = std::min( a + chunk, jobs );
+                for ( ; a != b; ++a )
+                    func( static_cast<Integer_Type>( dim_first + a ) );
+            }
+        };
 
-        // case of more jobs than CPU cores
-        auto const& job_slice = [&func]( Integer_Type a, Integer_Type b )
+        // Helpers still queued when the items have all been taken are
+        // left to find the call finished, so the state they check is
+        // shared rather than on this stack
+        struct call_state
         {
-            if ( a >= b ) return;
-            while ( a != b )
-                func(a++);
+            std::atomic<std::uint_least64_t> next{0};
+            std::mutex mutex;
+            std::condition_variable done;
+            unsigned running = 0;
+            bool finished = false;
         };
+        auto state = std::make_shared<call_state>();
 
-        threads.reserve( total_cores-1 );
-        std::uint_least64_t tasks_per_thread = ( dim_last - dim_first + total_cores - 1 ) / total_cores;
+        unsigned const helpers = static_cast<unsigned>( std::min<std::uint_least64_t>( total_cores - 1, jobs - 1 ) );
+        for ( unsigned index = 0; index != helpers; ++index )
+            pool.submit( [state, &job_slice]()
+            {
+                {
+                    std::lock_guard<std::mutex> lock( state->mutex );
+                    if ( state->finished ) return;
+                    ++state->running;
+                }
+                job_slice( state->next );
+                std::lock_guard<std::mutex> lock( state->mutex );
+                if ( --state->running == 0 )
+                    state->done.notify_all();
+            } );
 
-        //for ( auto index : range( total_cores-1 ) )
-        for ( auto index = 0UL; index != total_cores-1; ++index )
-        {
-            Integer_Type first = tasks_per_thread * index + dim_first;
-            first = std::min( first, dim_last );
-            Integer_Type last =  first + tasks_per_thread;
-            last = std::min( last, dim_last );
-            threads.emplace_back( std::thread{ job_slice, first, last } );
-        }
+        job_slice( state->next );
 
-        job_slice( tasks_per_thread*(total_cores-1), dim_last );
-
-        for ( auto& th : threads )
-            th.join();
+        // every item has been taken, so sleep until the helpers
+        // working on the last ones are done
+        std::unique_lock<std::mutex> lock( state->mutex );
+        state->finished = true;
+        state->done.wait( lock, [&](){ return state->running == 0; } );
     }
 }
 
@@ -74,5 +269,122 @@ void parallel( Function const& func, Integer_Type dim_last )
     parallel( func, Integer_Type{0}, dim_last );
 }
 
-#endif//PARALLEL_HPP_DEFINED_ALREADY
+// Number of chunks parallel_chunks() splits [dim_first, dim_last) into
+template< typename Integer_Type >
+Integer_Type parallel_chunk_count( Integer_Type dim_first, Integer_Type dim_last, Integer_Type grain )
+{
+    return ( dim_last > dim_first ) ? ( dim_last - dim_first + grain - 1 ) / grain : 0;
+}
+
+// parallel() over consecutive chunks of at most grain items, calling
+// func( first, last ) for each, so per-item scratch can be set up once
+// per chunk, and a reduction can keep one partial per chunk and sum
+// them in order afterwards (see parallel_chunk_count())
+template< typename Function, typename Integer_Type >
+void parallel_chunks( Function const& func, Integer_Type dim_first, Integer_Type dim_last, Integer_Type grain )
+{
+    Integer_Type const count = parallel_chunk_count( dim_first, dim_last, grain );
+    parallel( [&]( Integer_Type chunk )
+    {
+        Integer_Type const first = dim_first + chunk * grain;
+        func( first, std::min<Integer_Type>( first + grain, dim_last ) );
+    }, Integer_Type{0}, count );
+}
+
+// One function run in the background on the pool, as std::async would
+// on a thread of its own. wait() runs it on the calling thread if no
+// pool thread has started it yet, so never waits on a queued task, and
+// rethrows anything it threw. With a pool of one thread it just runs
+// in wait()
+class parallel_task
+{
+public:
+    parallel_task() {}
+
+    template< typename Function >
+    explicit parallel_task( Function func ) : state( std::make_shared<task_state>() )
+    {
+        state->func = std::move( func );
+        thread_pool& pool = thread_pool::instance();
+        if ( pool.size() <= 1 )
+            return;
+        auto shared = state;
+        pool.submit( [shared](){ run( *shared ); } );
+    }
+
+    parallel_task( parallel_task&& ) = default;
+    parallel_task& operator=( parallel_task&& other )
+    {
+        wait();
+        state = std::move( other.state );
+        return *this;
+    }
+
+    ~parallel_task()
+    {
+        if ( state )
+        {
+            run( *state );
+            finish();
+        }
+    }
+
+    bool valid() const
+    {
+        return state != nullptr;
+    }
 
+    void wait()
+    {
+        if ( !state )
+            return;
+        run( *state );
+        std::exception_ptr error = finish();
+        if ( error )
+            std::rethrow_exception( error );
+    }
+
+private:
+    struct task_state
+    {
+        std::function<void()> func;
+        std::atomic<bool> started{false};
+        std::mutex mutex;
+        std::condition_variable done;
+        bool finished = false;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<task_state> state;
+
+    static void run( task_state& task )
+    {
+        if ( task.started.exchange( true ) )
+            return;
+        std::exception_ptr error;
+        try
+        {
+            task.func();
+        }
+        catch ( ... )
+        {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock( task.mutex );
+        task.error = error;
+        task.finished = true;
+        task.done.notify_all();
+    }
+
+    // Wait for the task to finish and let go of it
+    std::exception_ptr finish()
+    {
+        std::unique_lock<std::mutex> lock( state->mutex );
+        state->done.wait( lock, [this](){ return state->finished; } );
+        std::exception_ptr error = state->error;
+        lock.unlock();
+        state.reset();
+        return error;
+    }
+};
+
+#endif//PARALLEL_HPP_DEFINED_ALREADY
@@ -31,10 +31,13 @@
 #define PGURE_H
 
 // C++ headers
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <iomanip>
-#include <random>
+#include <cstdint>
+#include <type_traits>
 #include <vector>
 
 // Armadillo library
@@ -43,22 +46,52 @@
 // NLopt library
 #include <nlopt.hpp>
 
-// Own header
+// Own headers
+#include "parallel.hpp"
+#include "philox.hpp"
 #include "svt.hpp"
 
+// Optional GPU backend
+#if defined(PGURE_USE_CUDA)
+  #include "cudasvt.hpp"
+#endif
+
+// Element types the decompositions can be computed in
+enum Precision {
+    PRECISION_DOUBLE = 0,   // Everything in double
+    PRECISION_FLOAT = 1,    // Everything in float
+    PRECISION_MIXED = 2     // Float decompositions, double PGURE sums
+};
+
+// Searches for the PGURE-optimal lambda
+enum LambdaMethod {
+    LAMBDA_BOBYQA = 0,      // NLopt BOBYQA from the starting point
+    LAMBDA_BRENT = 1        // Log-spaced bracket, then Brent's method
+};
+
+// The window and the block factors are held in eT, while the
+// PGURE coefficients, projections and error sums are accumulated
+// in accT. Input and output cubes stay in double
+template <typename eT, typename accT = eT>
 class PGURE {
  public:
         PGURE() {
-            svt0 = new SVT;
-            svt1 = new SVT;
-            svt2p = new SVT;
-            svt2m = new SVT;
+            svt0 = new SVT<eT>;
+            svt1 = new SVT<eT>;
+            svt2p = new SVT<eT>;
+            svt2m = new SVT<eT>;
+            #if defined(PGURE_USE_CUDA)
+              gpu = nullptr;
+            #endif
         }
         ~PGURE() {
             delete svt0;
             delete svt1;
             delete svt2p;
             delete svt2m;
+            #if defined(PGURE_USE_CUDA)
+              delete gpu;
+            #endif
         }
 
         void Initialize(const arma::cube &u,
@@ -67,8 +100,14 @@ class PGURE {
                         int blockoverlap,
                         double alphaIn,
                         double muIn,
-                        double sigmaIn) {
-            U = u;
+                        double sigmaIn,
+                        int svdmethod,
+                        double lambdabound,
+                        bool usegpu,
+                        int firstframe = 0,
+                        unsigned seed = 0,
+                        double adaptive = 0.) {
+            U = arma::conv_to<arma::Cube<eT>>::from(u);
 
             Nx = u.n_rows;
             Ny = u.n_cols;
@@ -80,6 +119,10 @@ class PGURE {
             mu = muIn;
             sigma = sigmaIn;
 
+            svdMethod = svdmethod;
+            lambdaBound = lambdabound;
+            adaptiveThreshold = adaptive;
+
             Uhat.set_size(Nx, Ny, T);
             U1.set_size(Nx, Ny, T);
             U2p.set_size(Nx, Ny, T);
@@ -89,7 +132,11 @@ class PGURE {
             eps1 = U.max() * 1E-4;
             eps2 = U.max() * 1E-2;
 
-            // Generate random samples for stochastic evaluation
+            // Generate random samples for stochastic evaluation,
+            // drawn per frame of the sequence, so they don't depend
+            // on which window, thread or run draws them
+            firstFrame = firstframe;
+            sequenceSeed = seed;
             delta1.set_size(Nx, Ny, T);
             delta2.set_size(Nx, Ny, T);
             GenerateRandomPerturbations();
@@ -98,10 +145,27 @@ class PGURE {
             U2m = U - (delta2 * eps2);
 
             // Initialize the block SVDs
-            svt0->Initialize(patches, Nx, Ny, T, Bs, Bo);
-            svt1->Initialize(patches, Nx, Ny, T, Bs, Bo);
-            svt2p->Initialize(patches, Nx, Ny, T, Bs, Bo);
-            svt2m->Initialize(patches, Nx, Ny, T, Bs, Bo);
+            svt0->Initialize(patches, Nx, Ny, T, Bs, Bo, svdmethod, lambdabound);
+            svt1->Initialize(patches, Nx, Ny, T, Bs, Bo, svdmethod, lambdabound);
+            svt2p->Initialize(patches, Nx, Ny, T, Bs, Bo, svdmethod, lambdabound);
+            svt2m->Initialize(patches, Nx, Ny, T, Bs, Bo, svdmethod, lambdabound);
+
+            // Adaptive tiling (if adaptive > 0): away from the grid of
+            // stride about Bs/2, keep the blocks whose average along the
+            // trajectory varies more than adaptive times the noise would
+            // leave in it. The blocks are picked once, from U, as the
+            // perturbed decompositions must use the same ones
+            if (adaptive > 0.) {
+                int stride = Bo * std::max(1, (Bs/2) / Bo);
+                double gain = alpha, offset = mu, variance = sigma*sigma, frames = T;
+                svt0->SelectBlocks(U, stride, [=](double mean, double detail) {
+                    double noise = std::max(gain*(mean - offset) + variance, 0.) / frames;
+                    return detail > adaptive * noise;
+                });
+                svt1->SetBlocks(svt0->SelectedBlocks());
+                svt2p->SetBlocks(svt0->SelectedBlocks());
+                svt2m->SetBlocks(svt0->SelectedBlocks());
+            }
 
             // Initialize the block SVDs
             svt0->Decompose(U);
@@ -109,34 +173,100 @@ class PGURE {
             svt2p->Decompose(U2p);
             svt2m->Decompose(U2m);
 
+            PrecomputeCoefficients();
+
+            // Keep the window and svt0 resident on the GPU, falling
+            // back to the CPU if there is no device
+            #if defined(PGURE_USE_CUDA)
+              if (usegpu && gpu == nullptr) {
+                  gpu = new CudaSVT;
+                  if (!gpu->Available()) {
+                      delete gpu;
+                      gpu = nullptr;
+                  }
+              }
+              UploadToDevice();
+            #endif
+            return;
+        }
+
+        // Check the carried trajectories still cover the frame
+        // to be reconstructed before sliding the window
+        bool Covers(const arma::icube &patches, int frame) {
+            return svt0->Covers(patches, frame);
+        }
+
+        // Slide the window forward by one frame, reusing the block SVDs
+        // of the previous window. The input must share its first T-1
+        // frames (and normalization) with the previous window's last T-1
+        void Slide(const arma::cube &u,
+                   const arma::icube patches,
+                   double alphaIn,
+                   double muIn,
+                   double sigmaIn,
+                   double lambdabound) {
+            U = arma::conv_to<arma::Cube<eT>>::from(u);
+
+            alpha = alphaIn;
+            mu = muIn;
+            sigma = sigmaIn;
+
+            // Shift the perturbations and draw them for the new frame only,
+            // so the perturbed copies also share their first T-1 frames
+            firstFrame++;
+            for (int k = 0; k < T-1; k++) {
+                delta1.slice(k) = delta1.slice(k+1);
+                delta2.slice(k) = delta2.slice(k+1);
+            }
+            GenerateRandomPerturbations(T-1);
+            U1 = U + (delta1 * eps1);
+            U2p = U + (delta2 * eps2);
+            U2m = U - (delta2 * eps2);
+
+            // Update the block SVDs
+            svt0->SetLambdaBound(lambdabound);
+            svt1->SetLambdaBound(lambdabound);
+            svt2p->SetLambdaBound(lambdabound);
+            svt2m->SetLambdaBound(lambdabound);
+            svt0->Slide(U, patches);
+            svt1->Slide(U1, patches);
+            svt2p->Slide(U2p, patches);
+            svt2m->Slide(U2m, patches);
+
+            PrecomputeCoefficients();
+            #if defined(PGURE_USE_CUDA)
+              UploadToDevice();
+            #endif
             return;
         }
 
         arma::cube Reconstruct(double user_lambda) {
-            return svt0->Reconstruct(user_lambda);
+            #if defined(PGURE_USE_CUDA)
+              if (gpu != nullptr) {
+                  arma::cube v(Nx, Ny, T);
+                  gpu->Reconstruct(user_lambda, v.memptr());
+                  return v;
+              }
+            #endif
+            if constexpr (std::is_same<eT, double>::value) {
+                return svt0->Reconstruct(user_lambda);
+            } else {
+                return arma::conv_to<arma::cube>::from(svt0->Reconstruct(user_lambda));
+            }
         }
 
         double CalculatePGURE(const std::vector<double> &x,
                               std::vector<double> &grad,
                               void *data) {
-            Uhat = svt0->Reconstruct(x[0]);
-            U1 = svt1->Reconstruct(x[0]);
-            U2p = svt2p->Reconstruct(x[0]);
-            U2m = svt2m->Reconstruct(x[0]);
-
-            // Modified from [1] to include mean/offset
+            // The perturbed reconstructions only enter PGURE linearly, so
+            // those terms come from the precomputed projections, and only
+            // Uhat is formed (for the quadratic data fidelity term)
             int NxNyT = Nx*Ny*T;
             double pgURE;
-            pgURE = arma::accu(arma::square(arma::abs(Uhat - U)))/NxNyT
-                - (alpha + mu) * arma::accu(U)/NxNyT
-                + 2/eps1 * arma::accu(delta1
-                            % (alpha * U - alpha*mu + sigma*sigma)
-                            % (U1 - Uhat))/NxNyT
-                - 2*sigma*sigma*alpha/(eps2*eps2)
-                            * arma::accu(delta2 % (U2p - 2*Uhat + U2m))/NxNyT
-                + 2 * mu * arma::accu(Uhat)/NxNyT
-                + mu/NxNyT
-                - sigma*sigma;
+            evaluations++;
+            pgURE = DataError(x[0])/NxNyT
+                + ProjectedLinearTerms(x[0])
+                + pgureConstant;
 
             // Set new lambda
             lambda = x[0];
@@ -144,24 +274,264 @@ class PGURE {
             return pgURE;
         }
 
+        // Data fidelity term |Uhat - U|^2
+        double DataError(double lambdaIn) {
+            #if defined(PGURE_USE_CUDA)
+              if (gpu != nullptr) {
+                  return gpu->Error(lambdaIn);
+              }
+            #endif
+            int numBlocks = svt0->NumBlocks();
+            int batchSize = svt0->BatchSize();
+            blocks.set_size(Bs*Bs, T, batchSize);
+
+            Uhat.zeros();
+            for (int first = 0; first < numBlocks; first += batchSize) {
+                int last = std::min(first + batchSize, numBlocks);
+
+                svt0->ReconstructBlocks(lambdaIn, first, last, blocks);
+                svt0->ScatterBlocks(blocks, first, last, Uhat);
+            }
+
+            // Weight and compare in one pass, accumulating in accT,
+            // per chunk and then in order
+            const accT *uhat = Uhat.memptr();
+            const accT *invw = invWeights.memptr();
+            const eT *uptr = U.memptr();
+            const arma::uword grain = 16384;
+            std::vector<accT> partial(parallel_chunk_count(arma::uword(0), Uhat.n_elem, grain), accT(0));
+            parallel_chunks([&](arma::uword first, arma::uword last) {
+                accT error = 0;
+                for (arma::uword i = first; i < last; i++) {
+                    accT d = uhat[i] * invw[i] - static_cast<accT>(uptr[i]);
+                    error += d * d;
+                }
+                partial[first / grain] = error;
+            }, arma::uword(0), Uhat.n_elem, grain);
+            accT error = 0;
+            for (accT sum : partial) {
+                error += sum;
+            }
+            return error;
+        }
+
+        // Approximate PGURE from the singular values alone, replacing the
+        // data fidelity term with overlap-weighted block errors. Costs
+        // O(blocks*T) per lambda, so it can be swept densely
+        double CalculateProjectedPGURE(double lambdaIn) {
+            int NxNyT = Nx*Ny*T;
+            return svt0->ProjectedError(lambdaIn, blockWeights)/NxNyT
+                   + ProjectedLinearTerms(lambdaIn)
+                   + pgureConstant;
+        }
+
+        // Sweep the projected PGURE over a log-spaced grid of lambda
+        // in [bound*1E-4, bound], returning the minimizer
+        double Sweep(double bound, int points) {
+            double bestLambda = bound;
+            double bestPGURE = arma::datum::inf;
+            for (int i = 0; i < points; i++) {
+                double l = bound * std::pow(10., -4. + 4. * i / std::max(1, points-1));
+                double p = CalculateProjectedPGURE(l);
+                if (p < bestPGURE) {
+                    bestPGURE = p;
+                    bestLambda = l;
+                }
+            }
+            return bestLambda;
+        }
+
         double Optimize(double tol,
                         double start,
                         double bound,
-                        int eval);
+                        int eval,
+                        int method = LAMBDA_BOBYQA);
+
+        // Coarse-to-fine starting point for Optimize(): the optimum
+        // lambda of the window binned 2x2, which follows the trajectories
+        // of the even grid blocks and has a quarter of the pixels and
+        // blocks. Binning keeps the noise Poisson-Gaussian, with a quarter
+        // of the gain and half the Gaussian deviation, and as lambda
+        // enters the threshold as lambda*S^2 with the noise singular values
+        // halved, lambdas are 4 times larger on the binned window. Returns start
+        // if the window is too small to bin
+        double PyramidStart(double tol,
+                            double start,
+                            double bound,
+                            int eval,
+                            int method = LAMBDA_BOBYQA) {
+            int Mx = Nx / 2, My = Ny / 2;
+            if (Mx < 2*Bs || My < 2*Bs) {
+                return start;
+            }
+
+            arma::cube binned(Mx, My, T);
+            for (int k = 0; k < T; k++) {
+                for (int j = 0; j < My; j++) {
+                    for (int i = 0; i < Mx; i++) {
+                        binned(i, j, k) = (static_cast<double>(U(2*i, 2*j, k))
+                                           + U(2*i+1, 2*j, k)
+                                           + U(2*i, 2*j+1, k)
+                                           + U(2*i+1, 2*j+1, k)) / 4;
+                    }
+                }
+            }
+
+            const arma::icube &patches = svt0->Patches();
+            int coarseSize = (1+(Mx-Bs))*(1+(My-Bs));
+            arma::icube coarsePatches(2, coarseSize, T);
+            for (int i = 0; i < coarseSize; i++) {
+                int row = i % (1+(My-Bs));
+                int col = i / (1+(Mx-Bs));
+                int p = 2*col*(1+(Ny-Bs)) + 2*row;
+                for (int k = 0; k < T; k++) {
+                    coarsePatches(0, i, k) = std::min(static_cast<int>(patches(0, p, k)) / 2, Mx-Bs);
+                    coarsePatches(1, i, k) = std::min(static_cast<int>(patches(1, p, k)) / 2, My-Bs);
+                }
+            }
+
+            PGURE<eT, accT> coarse;
+            coarse.Initialize(binned, coarsePatches, Bs, Bo,
+                              alpha/4, mu, sigma/2,
+                              svdMethod, 4*lambdaBound, false,
+                              firstFrame, sequenceSeed, adaptiveThreshold);
+            return coarse.Optimize(tol, 4*start, 4*bound, eval, method) / 4;
+        }
+
+        // PGURE evaluations in the last (or current) Optimize()
+        int Evaluations() const {
+            return evaluations;
+        }
+
+        double OptimizeBracketed(double tol,
+                                 double start,
+                                 double bound,
+                                 int eval);
 
  private:
         int Nx, Ny, T, Bs, Bo;
         double eps1, eps2;
         double lambda;
         double alpha, mu, sigma;
+        int evaluations = 0;
+
+        // Decomposition settings, for PyramidStart()
+        int svdMethod;
+        double lambdaBound, adaptiveThreshold;
+
+        SVT<eT> *svt0, *svt1, *svt2p, *svt2m;
+
+        arma::Cube<eT> U;
+        arma::Cube<eT> U1, U2p, U2m;
+        arma::Cube<eT> delta1, delta2;
+        arma::Cube<accT> Uhat;
+
+        // Rebuilt blocks of a batch, reused across evaluations
+        arma::Cube<eT> blocks;
+
+        // Lambda-independent parts of PGURE
+        arma::Cube<accT> invWeights;
+        arma::Mat<accT> projUhat, projU1, projU2p, projU2m;
+        arma::Col<accT> blockWeights;
+        double pgureConstant;
+
+        // A cube of eT in the accumulation type
+        static arma::Cube<accT> Widen(const arma::Cube<eT> &c) {
+            if constexpr (std::is_same<eT, accT>::value) {
+                return c;
+            } else {
+                return arma::conv_to<arma::Cube<accT>>::from(c);
+            }
+        }
 
-        SVT *svt0, *svt1, *svt2p, *svt2m;
+        // Absolute index of frame 0 of the window, and the key
+        // of the perturbations
+        int firstFrame = 0;
+        unsigned sequenceSeed = 0;
+
+        // PGURE from [1], modified to include mean/offset, is
+        //   |Uhat - U|^2/N - (alpha + mu) * sum(U)/N
+        //     + 2/eps1 * sum(delta1 % (alpha*U - alpha*mu + sigma^2)
+        //                    % (U1 - Uhat))/N
+        //     - 2*sigma^2*alpha/eps2^2 * sum(delta2 % (U2p - 2*Uhat + U2m))/N
+        //     + 2*mu * sum(Uhat)/N + mu/N - sigma^2
+        // Every reconstruction X is sum_blocks(X_b)/weights, so each
+        // linear term sum(c % X) is a sum over blocks of X_b against
+        // c/weights along the block trajectory, which is then projected
+        // onto the singular vectors of each block
+        void PrecomputeCoefficients() {
+            int NxNyT = Nx*Ny*T;
 
-        arma::cube U;
-        arma::cube Uhat, U1, U2p, U2m;
-        arma::cube delta1, delta2;
+            // The overlap weighting of svt0 serves all four, which
+            // share their trajectories, unless it is wanted wider
+            if constexpr (std::is_same<accT, eT>::value) {
+                invWeights = svt0->InverseWeights();
+            } else {
+                invWeights = 1 / Widen(svt0->Weights());
+                invWeights.elem(arma::find_nonfinite(invWeights)).zeros();
+            }
+
+            arma::Cube<accT> Uacc = Widen(U);
+            arma::Cube<accT> c1 = static_cast<accT>(2/eps1) * Widen(delta1)
+                                      % (static_cast<accT>(alpha) * Uacc
+                                         + static_cast<accT>(sigma*sigma - alpha*mu))
+                                      / static_cast<accT>(NxNyT);
+            arma::Cube<accT> c2 = static_cast<accT>(-2*sigma*sigma*alpha/(eps2*eps2*NxNyT))
+                                      * Widen(delta2);
+
+            arma::Cube<accT> coeffU1 = c1 % invWeights;
+            arma::Cube<accT> coeffU2 = c2 % invWeights;
+            arma::Cube<accT> coeffUhat = (static_cast<accT>(2*mu/NxNyT) - c1 - 2*c2) % invWeights;
+            projU1 = svt1->Project(coeffU1);
+            projU2p = svt2p->Project(coeffU2);
+            projU2m = svt2m->Project(coeffU2);
+            projUhat = svt0->Project(coeffUhat);
+            blockWeights = svt0->BlockMeans(invWeights);
+
+            pgureConstant = - (alpha + mu) * static_cast<double>(arma::accu(Uacc))/NxNyT
+                            + mu/NxNyT
+                            - sigma*sigma;
+            return;
+        }
 
-        std::mt19937 rand_engine;
+        #if defined(PGURE_USE_CUDA)
+          CudaSVT *gpu;
+
+          // Copy the window, inverse weights and svt0 factors to the GPU.
+          // The perturbed decompositions only enter through projU1,
+          // projU2p and projU2m, so they don't need to be resident
+          void UploadToDevice() {
+              if (gpu == nullptr) {
+                  return;
+              }
+              int numBlocks = svt0->NumBlocks();
+              std::vector<int> ranks(numBlocks), positions(2*numBlocks*T);
+              for (int it = 0; it < numBlocks; it++) {
+                  ranks[it] = svt0->BlockRank(it);
+                  for (int k = 0; k < T; k++) {
+                      positions[2*(it*T + k)] = svt0->BlockRow(it, k);
+                      positions[2*(it*T + k) + 1] = svt0->BlockCol(it, k);
+                  }
+              }
+              // The device works in double, whatever the host precision
+              arma::cube u = arma::conv_to<arma::cube>::from(U);
+              arma::cube invw = arma::conv_to<arma::cube>::from(invWeights);
+              size_t nf = static_cast<size_t>(numBlocks) * svt0->FactorStride();
+              std::vector<double> factors(svt0->FactorData(), svt0->FactorData() + nf);
+              gpu->UploadWindow(u.memptr(), invw.memptr(), Nx, Ny, T);
+              gpu->UploadFactors(factors.data(), ranks.data(), positions.data(),
+                                 numBlocks, svt0->FactorStride(), Bs, svt0->MaxRank());
+              return;
+          }
+        #endif
+
+        // Sum of the terms linear in Uhat, U1, U2p and U2m
+        double ProjectedLinearTerms(double lambdaIn) {
+            return svt0->ProjectedDot(lambdaIn, projUhat)
+                   + svt1->ProjectedDot(lambdaIn, projU1)
+                   + svt2p->ProjectedDot(lambdaIn, projU2p)
+                   + svt2m->ProjectedDot(lambdaIn, projU2m);
+        }
 
         // Reshape to n^2 x T Casorati matrix
         arma::mat CubeFlatten(arma::cube u) {
@@ -169,53 +539,64 @@ class PGURE {
             return u.slice(0);
         }
 
-        // Perturbations used in empirical calculation of d'f(y) and d''f(y)
-        void GenerateRandomPerturbations() {
-            std::bernoulli_distribution binary_dist1(0.5);
-            delta1.imbue([&]() {
-                bool bernRand = binary_dist1(rand_engine);
-                if (bernRand == true) {
-                    return -1;
-                } else {
-                    return 1;
-                }
-            });
-
+        // Perturbations used in empirical calculation of d'f(y) and d''f(y),
+        // drawn for frames first..T-1. Both come from one Philox call
+        // per pixel, counted by (pixel, absolute frame) and keyed by the
+        // sequence seed, so each frame always gets the same perturbations
+        void GenerateRandomPerturbations(int first = 0) {
             double kappa = 1.;
             double vP = (1/2)+(kappa/2)/std::sqrt(kappa*kappa+4);
             double vQ = 1 - vP;
-            std::bernoulli_distribution binary_dist2(vP);
-            delta2.imbue([&]() {
-                bool bernRand = binary_dist2(rand_engine);
-                if (bernRand == true) {
-                    return -1 * std::sqrt(vQ/vP);
-                } else {
-                    return std::sqrt(vP/vQ);
-                }
-            });
+            const eT lower = -1 * std::sqrt(vQ/vP);
+            const eT upper = std::sqrt(vP/vQ);
+            const uint32_t threshold = static_cast<uint32_t>(vP * 4294967296.);
+
+            const int NxNy = Nx*Ny;
+            for (int k = first; k < T; k++) {
+                const uint32_t frame = static_cast<uint32_t>(firstFrame + k);
+                eT *d1 = delta1.slice_memptr(k);
+                eT *d2 = delta2.slice_memptr(k);
+                parallel_chunks([&](int begin, int end) {
+                    #pragma omp simd
+                    for (int i = begin; i < end; i++) {
+                        uint32_t r[4];
+                        Philox4x32(static_cast<uint32_t>(i), frame, 0, 0,
+                                   sequenceSeed, 0x50475552, r);
+                        d1[i] = (r[0] >> 31) ? -1 : 1;
+                        d2[i] = (r[1] < threshold) ? lower : upper;
+                    }
+                }, 0, NxNy, 16384);
+            }
             return;
         }
 };
 
 // Wrapper for the PGURE optimization function
+template <typename PGUREType>
 double obj_wrapper(const std::vector<double> &x,
                    std::vector<double> &grad,
                    void *data) {
-  PGURE *obj = static_cast<PGURE *>(data);
+  PGUREType *obj = static_cast<PGUREType *>(data);
   return obj->CalculatePGURE(x, grad, data);
 }
 
 // Optimization function using NLopt and
 // BOBYQA gradient-free algorithm
-double PGURE::Optimize(double tol,
-                       double start,
-                       double bound,
-                       int eval) {
+template <typename eT, typename accT>
+double PGURE<eT, accT>::Optimize(double tol,
+                                 double start,
+                                 double bound,
+                                 int eval,
+                                 int method) {
+    evaluations = 0;
+    if (method == LAMBDA_BRENT) {
+        return OptimizeBracketed(tol, start, bound, eval);
+    }
     double startingStep = start / 2;
 
     // Optimize PGURE
     nlopt::opt opt(nlopt::LN_BOBYQA, 1);
-    opt.set_min_objective(obj_wrapper, this);
+    opt.set_min_objective(obj_wrapper<PGURE<eT, accT>>, this);
     opt.set_maxeval(eval);
     opt.set_lower_bounds(0.);
     opt.set_upper_bounds(bound);
@@ -238,4 +619,125 @@ double PGURE::Optimize(double tol,
     return lambda;
 }
 
+// One-dimensional search in log(lambda) over [bound*1E-6, bound].
+// From the starting point (e.g. the previous window's optimum),
+// steps growing by the golden ratio go downhill until the minimum
+// is bracketed, then Brent's method (parabolic steps, falling back
+// to golden sections) refines it to 0.1% in lambda. Stops early
+// once two evaluations in a row are within tol (relative) of the
+// best PGURE, or after eval evaluations, returning the best lambda
+template <typename eT, typename accT>
+double PGURE<eT, accT>::OptimizeBracketed(double tol,
+                                          double start,
+                                          double bound,
+                                          int eval) {
+    const double golden = 1.618033988749895;
+    const double cgolden = 0.381966011250105;
+    const double xtol = 1E-3;
+
+    // CalculatePGURE() counts the evaluations
+    evaluations = 0;
+    std::vector<double> grad;
+    auto f = [&](double x) {
+        std::vector<double> l(1, std::exp(x));
+        return CalculatePGURE(l, grad, this);
+    };
+
+    // Bracket the minimum
+    double lower = std::log(bound * 1E-6), upper = std::log(bound);
+    double step = std::log(1.5);
+    double b = std::min(std::max(std::log(start > 0. ? start : bound * 1E-2), lower), upper);
+    double a = std::max(b - step, lower), c = std::min(b + step, upper);
+    double fa = f(a), fb = f(b), fc = f(c);
+    while (evaluations < eval) {
+        if (fa < fb && a > lower) {
+            step *= golden;
+            c = b; fc = fb;
+            b = a; fb = fa;
+            a = std::max(b - step, lower);
+            fa = f(a);
+        } else if (fc < fb && c < upper) {
+            step *= golden;
+            a = b; fa = fb;
+            b = c; fb = fc;
+            c = std::min(b + step, upper);
+            fc = f(c);
+        } else {
+            break;
+        }
+    }
+
+    // The minimum may be on the boundary, so start from the best point
+    double x = b, fx = fb;
+    if (fa < fx) {
+        x = a;
+        fx = fa;
+    }
+    if (fc < fx) {
+        x = c;
+        fx = fc;
+    }
+
+    // Brent's method on [a, c]
+    double w = x, v = x, fw = fx, fv = fx;
+    double d = 0., e = 0.;
+    int plateau = 0;
+    while (evaluations < eval && plateau < 2) {
+        double xm = 0.5 * (a + c);
+        if (std::abs(x - xm) <= 2 * xtol - 0.5 * (c - a)) {
+            break;
+        }
+        bool parabolic = false;
+        if (std::abs(e) > xtol) {
+            double r = (x - w) * (fx - fv);
+            double q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r;
+            q = 2 * (q - r);
+            if (q > 0.) {
+                p = -p;
+            }
+            q = std::abs(q);
+            if (std::abs(p) < std::abs(0.5 * q * e) && p > q * (a - x) && p < q * (c - x)) {
+                e = d;
+                d = p / q;
+                parabolic = true;
+                if ((x + d) - a < 2 * xtol || c - (x + d) < 2 * xtol) {
+                    d = (xm >= x) ? xtol : -xtol;
+                }
+            }
+        }
+        if (!parabolic) {
+            e = (x >= xm) ? a - x : c - x;
+            d = cgolden * e;
+        }
+        double u = (std::abs(d) >= xtol) ? x + d : x + ((d >= 0.) ? xtol : -xtol);
+        double fu = f(u);
+        plateau = (std::abs(fx - fu) <= tol * std::abs(fx)) ? plateau + 1 : 0;
+        if (fu <= fx) {
+            if (u >= x) {
+                a = x;
+            } else {
+                c = x;
+            }
+            v = w; fv = fw;
+            w = x; fw = fx;
+            x = u; fx = fu;
+        } else {
+            if (u < x) {
+                a = u;
+            } else {
+                c = u;
+            }
+            if (fu <= fw || w == x) {
+                v = w; fv = fw;
+                w = u; fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u; fv = fu;
+            }
+        }
+    }
+    lambda = std::exp(x);
+    return lambda;
+}
+
 #endif
@@ -0,0 +1,365 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Bounded-memory frame buffer for streaming long sequences.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// C++ headers
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+// Armadillo library
+#include <armadillo>
+
+// Constant-time median filter
+#include "medfilter.h"
+
+// Own headers
+#include "hotpixel.hpp"
+#include "parallel.hpp"
+#include "telemetry.hpp"
+
+// Element types accepted for input sequences
+enum InputType {
+    INPUT_FLOAT64 = 0,
+    INPUT_UINT16 = 1,
+    INPUT_FLOAT32 = 2
+};
+
+// Copy frame k of a column-major rows x cols x frames sequence
+// of the given type into frame, which must be rows x cols
+void ReadFrame(const void *sequence,
+               int type,
+               int k,
+               arma::mat &frame) {
+    size_t n = frame.n_elem;
+    size_t offset = static_cast<size_t>(k) * n;
+    switch (type) {
+        case INPUT_UINT16: {
+            const unsigned short *p = static_cast<const unsigned short *>(sequence) + offset;
+            std::copy(p, p + n, frame.memptr());
+            break;
+        }
+        case INPUT_FLOAT32: {
+            const float *p = static_cast<const float *>(sequence) + offset;
+            std::copy(p, p + n, frame.memptr());
+            break;
+        }
+        default: {
+            const double *p = static_cast<const double *>(sequence) + offset;
+            std::copy(p, p + n, frame.memptr());
+            break;
+        }
+    }
+    return;
+}
+
+// Median filter buffers of the calling thread, which are
+// kept between frames rather than allocated for each one
+inline MedianFilterContext *ThreadMedianFilter() {
+    struct Holder {
+        MedianFilterContext *context = MedianFilterCreate();
+        ~Holder() {
+            MedianFilterDestroy(context);
+        }
+    };
+    thread_local Holder holder;
+    return holder.context;
+}
+
+// Median filter buffers for up to Size() stripes of a frame, which
+// are filtered as items of parallel(), so on the same pool as the
+// windows and counted in its threads. The buffers are kept between
+// frames rather than allocated for each one
+class MedianFilterStripeSet {
+ public:
+        MedianFilterStripeSet() {}
+        MedianFilterStripeSet(const MedianFilterStripeSet &) = delete;
+        MedianFilterStripeSet &operator=(const MedianFilterStripeSet &) = delete;
+        ~MedianFilterStripeSet() {
+            Resize(0);
+        }
+
+        void Resize(int stripes) {
+            for (auto *context : contexts) {
+                MedianFilterDestroy(context);
+            }
+            contexts.clear();
+            for (int s = 0; s < stripes; s++) {
+                contexts.push_back(MedianFilterCreate());
+            }
+            return;
+        }
+
+        int Size() const {
+            return static_cast<int>(contexts.size());
+        }
+
+        // Call filter(context, first, last) on each of up to Size() parts
+        // of a frame row of the given width, and no more parts than the
+        // pool has threads. Parts are kept wide compared with the kernel,
+        // as neighbouring parts overlap by filtsize pixels
+        template <typename F>
+        void Run(int width,
+                 int filtsize,
+                 F const &filter) {
+            int budget = std::min(Size(), static_cast<int>(thread_pool::instance().size()));
+            int stripes = std::max(1, std::min(budget, width / (4 * (2 * filtsize + 1))));
+            parallel([&](int s) {
+                filter((s < Size()) ? contexts[s] : ThreadMedianFilter(),
+                       static_cast<int>(static_cast<long>(width) * s / stripes),
+                       static_cast<int>(static_cast<long>(width) * (s + 1) / stripes));
+            }, 0, stripes);
+            return;
+        }
+
+ private:
+        std::vector<MedianFilterContext *> contexts;
+};
+
+// Call filter(context, first, last) on a frame row of the given
+// width, in the given stripes if any, or else in one part
+template <typename F>
+void MedianFilterStripes(int width,
+                         int filtsize,
+                         MedianFilterStripeSet *stripes,
+                         F const &filter) {
+    if (stripes != nullptr) {
+        stripes->Run(width, filtsize, filter);
+    } else {
+        filter(ThreadMedianFilter(), 0, width);
+    }
+    return;
+}
+
+// Median filter a rows x cols column-major 16-bit frame into
+// filtered, where column j starts at frame + j*stride (stride 0
+// for contiguous columns). The kernel is square, so each column
+// is filtered as an image row, without transposing. Large frames
+// can be split into the given stripes of rows
+void MedianFilterFrame(const unsigned short *frame,
+                       int rows,
+                       int cols,
+                       arma::mat &filtered,
+                       int filtsize,
+                       MedianFilterStripeSet *stripes = nullptr,
+                       int stride = 0) {
+    static const unsigned long memsize = MedianFilterCacheSize();
+
+    arma::Mat<unsigned short> filslice(rows, cols);
+    MedianFilterStripes(rows, filtsize, stripes, [&](MedianFilterContext *context, int first, int last) {
+        MedianFilterRange(context,
+                          frame,
+                          filslice.memptr(),
+                          rows, cols, (stride > 0) ? stride : rows, rows,
+                          filtsize, 1, first, last, memsize);
+    });
+    filtered = arma::conv_to<arma::mat>::from(filslice);
+    return;
+}
+
+// As above for 32-bit float frames, whose values are truncated
+// to 16-bit (as when converting to unsigned short) for filtering
+void MedianFilterFrame(const float *frame,
+                       int rows,
+                       int cols,
+                       arma::mat &filtered,
+                       int filtsize,
+                       MedianFilterStripeSet *stripes = nullptr,
+                       int stride = 0) {
+    static const unsigned long memsize = MedianFilterCacheSize();
+
+    arma::Mat<unsigned short> filslice(rows, cols);
+    MedianFilterStripes(rows, filtsize, stripes, [&](MedianFilterContext *context, int first, int last) {
+        MedianFilterRangeFloat(context,
+                               frame,
+                               filslice.memptr(),
+                               rows, cols, (stride > 0) ? stride : rows, rows,
+                               filtsize, 1.f, first, last, memsize);
+    });
+    filtered = arma::conv_to<arma::mat>::from(filslice);
+    return;
+}
+
+// Median filter one frame, as done for the whole sequence
+// before motion estimation
+void MedianFilterFrame(const arma::mat &frame,
+                       arma::mat &filtered,
+                       int filtsize,
+                       MedianFilterStripeSet *stripes = nullptr) {
+    arma::Mat<unsigned short> curslice = arma::conv_to<arma::Mat<unsigned short>>::from(frame);
+    MedianFilterFrame(curslice.memptr(), frame.n_rows, frame.n_cols, filtered, filtsize, stripes);
+    return;
+}
+
+// Holds the T frames of the current window (and the next frame,
+// which is read in the background) instead of the whole sequence.
+// Each frame is read, median filtered for motion estimation and
+// cleaned of hot pixels once, when it first enters a window.
+// Windows must be requested in non-decreasing order of their
+// first frame, so memory only depends on T and the frame size.
+// Frames can either be pulled by Require() from a reader, or
+// pushed in order by Push() as they arrive
+class FrameRing {
+ public:
+        // Fills frame (rows x cols) with frame k of the sequence
+        typedef std::function<void(int, arma::mat &)> Reader;
+
+        FrameRing() {}
+
+        // The number of frames and the reader are only used by
+        // Require(), so can be 0 and empty when pushing frames.
+        // Large frames are median filtered in up to filterthreads
+        // stripes on the pool, and the next frame is read there too
+        void Initialize(int rows,
+                        int cols,
+                        int frames,
+                        int windowsize,
+                        Reader reader,
+                        int MedianSize,
+                        double hotpixelthreshold,
+                        int filterthreads = 1) {
+            Nx = rows;
+            Ny = cols;
+            N = frames;
+            T = windowsize;
+            read = reader;
+            filtsize = MedianSize;
+            threshold = hotpixelthreshold;
+            filterStripes.Resize(std::max(1, filterthreads));
+
+            capacity = T + 1;
+            noisy.assign(capacity, arma::mat());
+            filtered.assign(capacity, arma::mat());
+            medianTime.assign(capacity, 0.);
+            hotpixelTime.assign(capacity, 0.);
+            loaded = 0;
+            return;
+        }
+
+        // Start reading at the given frame rather than the first, for
+        // denoising part of a sequence. Call before Require()
+        void Seek(int frame) {
+            loaded = frame;
+            return;
+        }
+
+        // Make frames [start, start+T) resident, then start reading
+        // the frame after them. This overwrites frame start-1
+        void Require(int start) {
+            int last = std::min(start + T, N);
+            if (pending.valid()) {
+                pending.wait();
+                loaded++;
+            }
+            while (loaded < last) {
+                Load(loaded);
+                loaded++;
+            }
+            // Only one frame ahead, as the ring has one spare slot
+            if (loaded < N && loaded == start + T) {
+                int next = loaded;
+                pending = parallel_task([this, next]() { Load(next); });
+            }
+            return;
+        }
+
+        // Add the next frame of the sequence, overwriting
+        // the frame T+1 before it. Returns its index
+        int Push(const arma::mat &frame) {
+            int k = loaded;
+            noisy[k % capacity] = frame;
+            Prepare(k);
+            loaded++;
+            return k;
+        }
+
+        // Number of frames read or pushed so far
+        int Loaded() const {
+            return loaded;
+        }
+
+        // Noisy (hot-pixel filtered) frames [start, start+T)
+        arma::cube Window(int start) const {
+            arma::cube u(Nx, Ny, T);
+            for (int k = 0; k < T; k++) {
+                u.slice(k) = noisy[(start + k) % capacity];
+            }
+            return u;
+        }
+
+        // Median filtered frame k, normalized to [0, 1]
+        const double *Filtered(int k) const {
+            return filtered[k % capacity].memptr();
+        }
+
+        // Seconds taken to median filter and hot-pixel filter frame k
+        void PrepareTimes(int k,
+                          double &median,
+                          double &hotpixel) const {
+            median = medianTime[k % capacity];
+            hotpixel = hotpixelTime[k % capacity];
+            return;
+        }
+
+ private:
+        int Nx, Ny, N, T, capacity, filtsize;
+        double threshold;
+        Reader read;
+
+        // Frames are kept in slot k % capacity, and those
+        // before loaded are resident (apart from a pending read)
+        std::vector<arma::mat> noisy, filtered;
+        std::vector<double> medianTime, hotpixelTime;
+        int loaded;
+        MedianFilterStripeSet filterStripes;
+        parallel_task pending;
+
+        void Load(int k) {
+            arma::mat &frame = noisy[k % capacity];
+            frame.set_size(Nx, Ny);
+            read(k, frame);
+            Prepare(k);
+            return;
+        }
+
+        void Prepare(int k) {
+            // Frames are prepared one at a time, so large frames
+            // are median filtered in stripes
+            auto stage = std::chrono::steady_clock::now();
+            arma::mat &frame = noisy[k % capacity];
+            MedianFilterFrame(frame, filtered[k % capacity], filtsize, &filterStripes);
+
+            // The motion search is scale-invariant, so a fixed
+            // normalization stands in for the sequence maximum
+            filtered[k % capacity] /= 65535.;
+            medianTime[k % capacity] = Lap(stage);
+            HotPixelFrame(frame, threshold);
+            hotpixelTime[k % capacity] = Lap(stage);
+            return;
+        }
+};
+
+#endif
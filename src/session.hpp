@@ -0,0 +1,279 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Online denoising of frames as they arrive from a detector.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+// C++ headers
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <utility>
+
+// Armadillo library
+#include <armadillo>
+
+// Own headers
+#include "motioncache.hpp"
+#include "noisecache.hpp"
+#include "pgure.hpp"
+#include "pipeline.hpp"
+#include "telemetry.hpp"
+#include "window.hpp"
+
+// Denoising statistics of a session. Latency is the time from
+// the push (or finish) that completes a frame's window to the
+// frame being ready, and a frame misses its deadline if its
+// latency is over the deadline given to the session
+struct SessionStats {
+    int emitted = 0;
+    int misses = 0;
+    double maxLatency = 0.;
+    double meanLatency = 0.;
+};
+
+// Denoises a sequence pushed one frame at a time, keeping the
+// filtered frames of the current window, the motion fields and
+// the previous optimum lambda between frames. Frame t (for
+// t >= framewindow) is ready once frame t+framewindow has been
+// pushed, and the first framewindow frames with it; the last
+// framewindow frames are ready after Finish(). When a frame
+// misses its deadline, the next one is reconstructed with the
+// previous lambda rather than optimized, to catch up. Frames are
+// pushed as any of the input types, and denoised at any of the
+// precisions, of PGURESVT()
+class DenoisingSession {
+ public:
+        DenoisingSession() {}
+        ~DenoisingSession() {}
+
+        void Initialize(int rows,
+                        int cols,
+                        int blocksize,
+                        int blockoverlap,
+                        int trajectory,
+                        bool pgure,
+                        double userlambda,
+                        double alphaIn,
+                        double muIn,
+                        double sigmaIn,
+                        int MotionP,
+                        double tolerance,
+                        int MedianSize,
+                        double hotpixelthreshold,
+                        int windowreuse,
+                        int lambdasweep,
+                        int svdmethod,
+                        bool usegpu,
+                        double deadlineIn,
+                        int inputtype,
+                        int precision,
+                        int lambdamethod,
+                        int lambdaevals,
+                        double blockadaptive,
+                        bool lambdapyramid,
+                        unsigned seed,
+                        int filterthreads = 1) {
+            Nx = rows;
+            Ny = cols;
+            Bs = blocksize;
+            Bo = blockoverlap;
+            T = trajectory;
+            framewindow = T / 2;
+            pgureOpt = pgure;
+            userLambda = userlambda;
+            lambda = (userlambda >= 0.) ? userlambda : 0.;
+            alpha = alphaIn;
+            mu = muIn;
+            sigma = sigmaIn;
+            deadline = deadlineIn;
+            InputType = inputtype;
+            Precision = precision;
+
+            ring.Initialize(Nx, Ny, 0, T, FrameRing::Reader(), MedianSize, hotpixelthreshold, filterthreads);
+            motioncache.Initialize(Nx, Ny, 0,
+                                   [this](int k) { return ring.Filtered(k); },
+                                   Bs, MotionP);
+            noisecache.Initialize(0, 4);
+
+            // Only the window type of the chosen precision is used
+            auto&& initialize = [&]( auto &window )
+            {
+                window.Initialize(&motioncache, &noisecache,
+                                  Bs, Bo, framewindow, windowreuse,
+                                  pgureOpt, tolerance, NoiseMethod,
+                                  svdmethod, usegpu, seed, blockadaptive,
+                                  lambdamethod, lambdaevals,
+                                  lambdasweep, lambdapyramid);
+            };
+            initialize(doublewindow);
+            initialize(floatwindow);
+            initialize(mixedwindow);
+            return;
+        }
+
+        // Add the next frame (Nx x Ny, column-major, of the input
+        // type), denoising any frames whose windows it completes.
+        // Returns the number of frames ready to pop, or -1 after Finish()
+        int Push(const void *frame) {
+            if (finished) {
+                return -1;
+            }
+            auto arrival = std::chrono::steady_clock::now();
+            arma::mat pushed(Nx, Ny);
+            ReadFrame(frame, InputType, 0, pushed);
+            ring.Push(pushed);
+            int N = ring.Loaded();
+            motioncache.Extend(N);
+            noisecache.Extend(N);
+            if (N >= T) {
+                while (next < N - framewindow) {
+                    Denoise(next++, arrival);
+                }
+            }
+            return static_cast<int>(output.size());
+        }
+
+        // End of the sequence: denoise the remaining frames. Returns
+        // the number of frames ready to pop, or -1 if fewer than T
+        // frames were pushed
+        int Finish() {
+            auto arrival = std::chrono::steady_clock::now();
+            finished = true;
+            int N = ring.Loaded();
+            if (N < T) {
+                return -1;
+            }
+            while (next < N) {
+                Denoise(next++, arrival);
+            }
+            return static_cast<int>(output.size());
+        }
+
+        // Copy the oldest ready frame into frame (Nx x Ny), with its
+        // index in the sequence. Returns false if none is ready
+        bool Pop(double *frame, int &index) {
+            if (output.empty()) {
+                return false;
+            }
+            index = output.front().first;
+            std::copy(output.front().second.begin(), output.front().second.end(), frame);
+            output.pop_front();
+            return true;
+        }
+
+        // Frames a pushed frame waits for before it can be denoised
+        int Latency() const {
+            return framewindow;
+        }
+
+        SessionStats Stats() const {
+            return stats;
+        }
+
+ private:
+        int Nx, Ny, Bs, Bo, T, framewindow;
+        bool pgureOpt;
+        double userLambda, lambda, alpha, mu, sigma, deadline;
+        int InputType, Precision;
+        int NoiseMethod = 4;
+
+        FrameRing ring;
+        MotionCache motioncache;
+        NoiseCache noisecache;
+
+        // Decomposition carried forward between windows,
+        // at each precision
+        WindowDenoiser<PGURE<double>> doublewindow;
+        WindowDenoiser<PGURE<float>> floatwindow;
+        WindowDenoiser<PGURE<float, double>> mixedwindow;
+
+        int next = 0;
+        bool finished = false;
+        bool missed = false;
+        std::deque<std::pair<int, arma::mat>> output;
+        SessionStats stats;
+
+        // As the loop body of PGURESVT(), for the window of frame
+        // timeiter over the frames pushed so far
+        void Denoise(int timeiter,
+                     std::chrono::steady_clock::time_point arrival) {
+            FrameTelemetry record = {};
+            record.start = Telemetry::instance().Now();
+            int N = ring.Loaded();
+            int start = (timeiter < framewindow) ? 0
+                        : (timeiter >= (N - framewindow)) ? N-2*framewindow-1
+                        : timeiter - framewindow;
+            arma::cube u = ring.Window(start);
+            // Stages are timed from here, so reading the window
+            // only counts towards the time of the frame as a whole
+            auto stage = std::chrono::steady_clock::now();
+
+            // Noise parameters are estimated afresh for each window
+            // unless given. The search starts from the previous frame's
+            // optimum, and is skipped to catch up after a missed deadline
+            double windowalpha = alpha, windowmu = mu, windowsigma = sigma;
+            double windowlambda = !pgureOpt ? userLambda
+                                  : (timeiter == 0) ? -1. : lambda;
+            bool search = pgureOpt && !missed;
+            arma::mat clean;
+            switch (Precision) {
+                case PRECISION_FLOAT:
+                    clean = floatwindow.Denoise(u, timeiter, start, N,
+                                                windowalpha, windowmu, windowsigma, windowlambda,
+                                                search, record, stage);
+                    break;
+                case PRECISION_MIXED:
+                    clean = mixedwindow.Denoise(u, timeiter, start, N,
+                                                windowalpha, windowmu, windowsigma, windowlambda,
+                                                search, record, stage);
+                    break;
+                default:
+                    clean = doublewindow.Denoise(u, timeiter, start, N,
+                                                 windowalpha, windowmu, windowsigma, windowlambda,
+                                                 search, record, stage);
+                    break;
+            }
+            lambda = pgureOpt ? windowlambda : lambda;
+            output.emplace_back(timeiter, std::move(clean));
+
+            // Later windows start at or after this one
+            motioncache.Evict(start);
+            noisecache.Evict(start);
+
+            // Deadline accounting
+            double latency = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - arrival).count();
+            missed = (deadline > 0.) && (latency > deadline);
+            stats.misses += missed ? 1 : 0;
+            stats.maxLatency = std::max(stats.maxLatency, latency);
+            stats.meanLatency += (latency - stats.meanLatency) / (stats.emitted + 1);
+            stats.emitted++;
+
+            ring.PrepareTimes(timeiter, record.median, record.hotpixel);
+            Telemetry::instance().Publish(record);
+            return;
+        }
+};
+
+#endif
@@ -34,14 +34,32 @@
 #include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <type_traits>
 #include <vector>
 
-// OpenMP library
-#include <omp.h>
-
 // Armadillo library
 #include <armadillo>
 
+// Own headers
+#include "blocksize.hpp"
+#include "jacobi.hpp"
+#include "parallel.hpp"
+
+// Backends for the block decompositions
+enum SVDMethod {
+    SVD_ECON = 0,           // Full economical SVD (LAPACK)
+    SVD_GRAM = 1,           // Eigen-decomposition of the T x T Gram matrix
+    SVD_RANDOMIZED = 2,     // Randomized truncated SVD with adaptive rank
+    SVD_JACOBI = 3          // Batched one-sided Jacobi across blocks
+};
+
+// Block decompositions in element type eT (double or float). Lambda
+// stays in double, and the projections used by PGURE can be formed
+// and accumulated in a wider type than eT
+template <typename eT>
 class SVT {
  public:
         SVT() {}
@@ -53,8 +71,13 @@ class SVT {
                         int h,
                         int l,
                         int blocksize,
-                        int blockoverlap) {
+                        int blockoverlap,
+                        int svdmethod,
+                        double lambdabound) {
             patches = sequencePatches;
+            method = svdmethod;
+            lambdaBound = lambdabound;
+            selected.reset();
 
             Nx = w;
             Ny = h;
@@ -63,20 +86,485 @@ class SVT {
             Bs = blocksize;
             Bo = blockoverlap;
             vecSize = (1+(Nx-Bs)/Bo)*(1+(Ny-Bs)/Bo);
+
+            // Rank of the economical SVD of each block, and the
+            // slab stride per block padded to a 64-byte cache line
+            const int line = 64 / sizeof(eT);
+            K = std::min(Bs*Bs, T);
+            blockStride = ((Bs*Bs*K + K + T*K + line-1) / line) * line;
+            return;
+        }
+
+        // Largest lambda the truncated factors must keep every
+        // surviving singular value for
+        void SetLambdaBound(double lambdabound) {
+            lambdaBound = lambdabound;
             return;
         }
 
         // Perform SVD on each block in the image sequence,
         // subject to the block overlap restriction
-        void Decompose(const arma::cube &u) {
-            // Do the local SVDs
-            arma::mat Ublock, Vblock;
-            arma::vec Sblock;
+        void Decompose(const arma::Cube<eT> &u) {
+            // Blocks of the grid, or those picked by SelectBlocks()
+            actualpatches = selected.is_empty() ? GridBlocks() : selected;
+
+            // Get new vector size
+            newVecSize = actualpatches.n_elem;
+            weightsValid = false;
+
+            // Memory allocation (every entry is written below,
+            // so the slab is not zero-filled)
+            AllocateFactors();
+
+            // Do the local SVDs, with chunks of blocks handed out as
+            // pool threads become free, since the LAPACK cost varies
+            // from block to block. Workspaces are reused within a chunk
+            if (method == SVD_JACOBI) {
+                DecomposeBatched(u);
+                return;
+            }
 
-            Ublock.set_size(Bs*Bs, T);
-            Sblock.set_size(T);
-            Vblock.set_size(T, T);
+            parallel_chunks([&](int first, int last) {
+                arma::Mat<eT> block(Bs*Bs, T);
+                Workspace ws;
+                for (int it = first; it < last; it++) {
+                    // Extract block
+                    Gather(it, u, block);
 
+                    // Do the SVD
+                    DecomposeBlock(it, block, ws);
+                }
+            }, 0, newVecSize, BlockGrain);
+            return;
+        }
+
+        // Adaptive tiling. Of the blocks on the block overlap grid, keep
+        // those at multiples of stride, those for which textured(mean,
+        // detail) holds, where mean and detail are the mean and pixel
+        // variance of the block averaged along its trajectory, and as
+        // many others as it takes to cover what the whole grid covers.
+        // Flat regions are then tiled with little overlap, and textured
+        // ones as before. Decompose() and Slide() work on the kept
+        // blocks until the next Initialize(). Returns how many are kept
+        template <typename F>
+        int SelectBlocks(const arma::Cube<eT> &u,
+                         int stride,
+                         F textured) {
+            actualpatches = GridBlocks();
+            newVecSize = actualpatches.n_elem;
+            arma::uvec keep = arma::zeros<arma::uvec>(newVecSize);
+
+            parallel_chunks([&](int first, int last) {
+                arma::Mat<eT> block(Bs*Bs, T);
+                for (int it = first; it < last; it++) {
+                    if (GridRow(it) % stride == 0 && GridCol(it) % stride == 0) {
+                        keep(it) = 1;
+                        continue;
+                    }
+                    Gather(it, u, block);
+                    arma::Col<eT> average = arma::mean(block, 1);
+                    keep(it) = textured(static_cast<double>(arma::mean(average)),
+                                        static_cast<double>(arma::var(average))) ? 1 : 0;
+                }
+            }, 0, newVecSize, BlockGrain);
+
+            // Fill in any pixels left uncovered, in grid order
+            arma::umat mask = arma::zeros<arma::umat>(Nx, Ny);
+            for (int pass = 0; pass < 2; pass++) {
+                for (int it = 0; it < newVecSize; it++) {
+                    auto area = mask(arma::span(GridRow(it), GridRow(it)+Bs-1),
+                                     arma::span(GridCol(it), GridCol(it)+Bs-1));
+                    if (pass == 1 && keep(it) == 0 && area.min() == 0) {
+                        keep(it) = 1;
+                    }
+                    if (keep(it) == 1) {
+                        area.ones();
+                    }
+                }
+            }
+            selected = actualpatches.elem(arma::find(keep));
+            return selected.n_elem;
+        }
+
+        // Use the blocks picked by another SVT's SelectBlocks()
+        void SetBlocks(const arma::uvec &blocks) {
+            selected = blocks;
+            return;
+        }
+
+        // Blocks picked by SelectBlocks() (empty for the whole grid)
+        const arma::uvec &SelectedBlocks() const {
+            return selected;
+        }
+
+        // Block trajectories of the window
+        const arma::icube &Patches() const {
+            return patches;
+        }
+
+        // Check that the block trajectories cover every pixel of a frame,
+        // which is required for an accurate reconstruction of that frame
+        bool Covers(const arma::icube &sequencePatches, int frame) {
+            arma::umat mask = arma::zeros<arma::umat>(Nx, Ny);
+            for (int it = 0; it < newVecSize; it++) {
+                int newy = sequencePatches(0, actualpatches(it), frame);
+                int newx = sequencePatches(1, actualpatches(it), frame);
+                mask(arma::span(newy, newy+Bs-1),
+                     arma::span(newx, newx+Bs-1)).ones();
+            }
+            return (mask.min() > 0);
+        }
+
+        // Slide the block SVDs forward by one frame.
+        // Frames 1..T-1 of the previous window must be frames 0..T-2
+        // of this one, with the same normalization and trajectories.
+        // Only the r previous factors that can survive thresholding
+        // matter, so each block's new factors are found by RangeFactors()
+        // in the span of their right factors shifted by one frame, the
+        // new frame and a few random directions. That costs O(Bs^2 T r)
+        // rather than the O(Bs^2 T^2) of a full decomposition. Blocks
+        // for which that isn't accepted, or whose r is large enough that
+        // it wouldn't save much, are decomposed in full
+        void Slide(const arma::Cube<eT> &u,
+                   const arma::icube &sequencePatches) {
+            patches = sequencePatches;
+            weightsValid = false;
+
+            parallel_chunks([&](int first, int last) {
+                arma::Mat<eT> block(Bs*Bs, T);
+                Workspace ws;
+                for (int it = first; it < last; it++) {
+                    // Extract block
+                    Gather(it, u, block);
+                    if (!SlideBlock(it, block, ws)) {
+                        DecomposeBlock(it, block, ws);
+                    }
+                }
+            }, 0, newVecSize, BlockGrain);
+            return;
+        }
+
+        // Reconstruct block in the image sequence after thresholding
+        arma::Cube<eT> Reconstruct(double lambda) {
+            arma::Cube<eT> v;
+            Reconstruct(lambda, v);
+            return v;
+        }
+
+        // As above into v, which keeps its memory if it is already
+        // Nx x Ny x T, so can be reused from one lambda to the next
+        void Reconstruct(double lambda, arma::Cube<eT> &v) {
+            v.zeros(Nx, Ny, T);
+
+            // Overlapping blocks all += into v, so work in batches:
+            // the blocks of a batch are rebuilt in parallel, then
+            // scattered with each thread owning whole frames
+            int batchSize = BatchSize();
+            blocks.set_size(Bs*Bs, T, batchSize);
+
+            for (int first = 0; first < newVecSize; first += batchSize) {
+                int last = std::min(first + batchSize, newVecSize);
+
+                ReconstructBlocks(lambda, first, last, blocks);
+                ScatterBlocks(blocks, first, last, v);
+            }
+
+            // Include the weighting
+            const eT *invw = InverseWeights().memptr();
+            eT *vptr = v.memptr();
+            parallel_chunks([&](arma::uword first, arma::uword last) {
+                for (arma::uword i = first; i < last; i++) {
+                    vptr[i] *= invw[i];
+                }
+            }, arma::uword(0), v.n_elem, ElementGrain);
+            return;
+        }
+
+        // Number of blocks after the block overlap restriction
+        int NumBlocks() const {
+            return newVecSize;
+        }
+
+        // Raw slab of factors and its layout (see FactorU/S/V),
+        // for handing the decomposition to another device
+        const eT *FactorData() const {
+            return factors.get();
+        }
+        int FactorStride() const {
+            return blockStride;
+        }
+        int MaxRank() const {
+            return K;
+        }
+        int BlockRank(int it) const {
+            return ranks(it);
+        }
+
+        // Top-left corner of block it in frame k
+        int BlockRow(int it, int k) const {
+            return patches(0, actualpatches(it), k);
+        }
+        int BlockCol(int it, int k) const {
+            return patches(1, actualpatches(it), k);
+        }
+
+        // Number of rebuilt blocks to hold at once, keeping
+        // a batch to around 8 MB
+        int BatchSize() const {
+            return std::max(1, std::min(newVecSize, (1 << 20) / (Bs*Bs*T)));
+        }
+
+        // Threshold the singular values of a block
+        arma::Col<eT> Threshold(const arma::Col<eT> &Sblock, double lambda) const {
+            // Basic singular value thresholding
+            // arma::Col<eT> Snew = arma::sign(Sblock)
+            //                      % arma::max(
+            //                          arma::abs(Sblock) - lambda,
+            //                          arma::zeros<arma::Col<eT>>(T));
+
+            // Gaussian-weighted singular value thresholding
+            arma::Col<eT> wvec = arma::abs(Sblock.max()
+                                           * arma::exp(-1
+                                                * static_cast<eT>(lambda)
+                                                * arma::square(Sblock)/2));
+
+            // Apply threshold
+            return arma::sign(Sblock)
+                     % arma::max(arma::abs(Sblock) - wvec,
+                                 arma::zeros<arma::Col<eT>>(Sblock.n_elem));
+        }
+
+        // Threshold the singular values of a block and rebuild it
+        void ReconstructBlock(int it, double lambda, arma::Mat<eT> &block) const {
+            arma::Col<eT> Snew = Threshold(FactorS(it), lambda);
+
+            // Reconstruct from SVD
+            block = FactorU(it) * diagmat(Snew) * FactorV(it).t();
+            return;
+        }
+
+        // Rebuild blocks first..last-1 in parallel, block it into
+        // slice it - first of blocks, ready for ScatterBlocks()
+        void ReconstructBlocks(double lambda,
+                               int first,
+                               int last,
+                               arma::Cube<eT> &blocks) const {
+            parallel_chunks([&](int begin, int end) {
+                for (int it = begin; it < end; it++) {
+                    ReconstructBlock(it, lambda, blocks.slice(it - first));
+                }
+            }, first, last, BlockGrain);
+            return;
+        }
+
+        // Precomputed projections for lambda-independent evaluation.
+        // Since each rebuilt block is sum_i f(S_i) u_i v_i', the inner
+        // product of a reconstruction with a fixed cube c is
+        // sum_blocks sum_i f(S_i) * u_i' C_b v_i, where C_b is c gathered
+        // along the block trajectory. Column it holds the u_i' C_b v_i,
+        // formed in the element type aT of c
+        template <typename aT>
+        arma::Mat<aT> Project(const arma::Cube<aT> &c) const {
+            arma::Mat<aT> proj = arma::zeros<arma::Mat<aT>>(K, newVecSize);
+
+            parallel_chunks([&](int first, int last) {
+                arma::Mat<aT> Cblock(Bs*Bs, T);
+                for (int it = first; it < last; it++) {
+                    Gather(it, c, Cblock);
+                    if constexpr (std::is_same<aT, eT>::value) {
+                        proj(arma::span(0, ranks(it)-1), it) =
+                            arma::sum((FactorU(it).t() * Cblock) % FactorV(it).t(), 1);
+                    } else {
+                        arma::Mat<aT> Ub = arma::conv_to<arma::Mat<aT>>::from(FactorU(it));
+                        arma::Mat<aT> Vb = arma::conv_to<arma::Mat<aT>>::from(FactorV(it));
+                        proj(arma::span(0, ranks(it)-1), it) =
+                            arma::sum((Ub.t() * Cblock) % Vb.t(), 1);
+                    }
+                }
+            }, 0, newVecSize, BlockGrain);
+            return proj;
+        }
+
+        // Inner product of the reconstruction with the cube
+        // used to form proj, for any lambda, accumulated in aT
+        // (per chunk of blocks, then in order, so it doesn't
+        // depend on the number of threads)
+        template <typename aT>
+        double ProjectedDot(double lambda, const arma::Mat<aT> &proj) const {
+            std::vector<aT> partial(parallel_chunk_count(0, newVecSize, BlockGrain), aT(0));
+            parallel_chunks([&](int first, int last) {
+                aT result = 0;
+                for (int it = first; it < last; it++) {
+                    arma::Col<eT> Snew = Threshold(FactorS(it), lambda);
+                    const aT *pptr = proj.colptr(it);
+                    aT sum = 0;
+                    for (int i = 0; i < static_cast<int>(ranks(it)); i++) {
+                        sum += static_cast<aT>(Snew(i)) * pptr[i];
+                    }
+                    result += sum;
+                }
+                partial[first / BlockGrain] = result;
+            }, 0, newVecSize, BlockGrain);
+            aT result = 0;
+            for (aT sum : partial) {
+                result += sum;
+            }
+            return result;
+        }
+
+        // Weighted sum of squared block errors, which since
+        // M_b = U_b S_b V_b' reduces to sum_b w_b sum_i (f(S_i) - S_i)^2.
+        // Singular values dropped by truncation have f(S_i) = 0.
+        // With w_b the mean inverse weight along each block this
+        // approximates (by convexity, from above) |Uhat - U|^2
+        template <typename aT>
+        double ProjectedError(double lambda, const arma::Col<aT> &blockweights) const {
+            std::vector<aT> partial(parallel_chunk_count(0, newVecSize, BlockGrain), aT(0));
+            parallel_chunks([&](int first, int last) {
+                aT result = 0;
+                for (int it = first; it < last; it++) {
+                    arma::Col<eT> Sblock = FactorS(it);
+                    arma::Col<eT> Snew = Threshold(Sblock, lambda);
+                    aT sum = static_cast<aT>(tailEnergy(it));
+                    for (arma::uword i = 0; i < Sblock.n_elem; i++) {
+                        aT d = static_cast<aT>(Snew(i)) - static_cast<aT>(Sblock(i));
+                        sum += d * d;
+                    }
+                    result += blockweights(it) * sum;
+                }
+                partial[first / BlockGrain] = result;
+            }, 0, newVecSize, BlockGrain);
+            aT result = 0;
+            for (aT sum : partial) {
+                result += sum;
+            }
+            return result;
+        }
+
+        // Mean of a cube along each block trajectory
+        template <typename aT>
+        arma::Col<aT> BlockMeans(const arma::Cube<aT> &c) const {
+            arma::Col<aT> means(newVecSize);
+            parallel_chunks([&](int first, int last) {
+                arma::Mat<aT> Cblock(Bs*Bs, T);
+                for (int it = first; it < last; it++) {
+                    Gather(it, c, Cblock);
+                    means(it) = arma::mean(arma::vectorise(Cblock));
+                }
+            }, 0, newVecSize, BlockGrain);
+            return means;
+        }
+
+        // Gather a cube along a block trajectory into a (Bs*Bs x T) block
+        template <typename aT>
+        void Gather(int it, const arma::Cube<aT> &c, arma::Mat<aT> &block) const {
+            DispatchBlockSize(Bs, [&](auto B) {
+                GatherFixed<decltype(B)::value>(it, c, block);
+            });
+            return;
+        }
+
+        // As Gather(), for block size B (see blocksize.hpp)
+        template <int B, typename aT>
+        void GatherFixed(int it, const arma::Cube<aT> &c, arma::Mat<aT> &block) const {
+            const int n = (B > 0) ? B : Bs;
+            const arma::uword ld = c.n_rows;
+            for (int k = 0; k < T; k++) {
+                int newy = patches(0, actualpatches(it), k);
+                int newx = patches(1, actualpatches(it), k);
+                const aT *cptr = c.slice_memptr(k) + newx*ld + newy;
+                aT *bptr = block.colptr(k);
+                for (int x = 0; x < n; x++, cptr += ld, bptr += n) {
+                    for (int y = 0; y < n; y++) {
+                        bptr[y] = cptr[y];
+                    }
+                }
+            }
+            return;
+        }
+
+        // Add blocks first..last-1 (held in slices 0..last-first-1)
+        // into v along their trajectories. Each thread owns whole
+        // frames, so overlapping blocks don't race. v can be of
+        // a wider type than the blocks
+        template <typename aT>
+        void ScatterBlocks(const arma::Cube<eT> &blocks,
+                           int first,
+                           int last,
+                           arma::Cube<aT> &v) const {
+            DispatchBlockSize(Bs, [&](auto B) {
+                ScatterBlocksFixed<decltype(B)::value>(blocks, first, last, v);
+            });
+            return;
+        }
+
+        // As ScatterBlocks(), for block size B (see blocksize.hpp)
+        template <int B, typename aT>
+        void ScatterBlocksFixed(const arma::Cube<eT> &blocks,
+                                int first,
+                                int last,
+                                arma::Cube<aT> &v) const {
+            const int n = (B > 0) ? B : Bs;
+            const arma::uword ld = v.n_rows;
+            parallel([&](int k) {
+                aT *slice = v.slice_memptr(k);
+                for (int it = first; it < last; it++) {
+                    int newy = patches(0, actualpatches(it), k);
+                    int newx = patches(1, actualpatches(it), k);
+                    const eT *bptr = blocks.slice(it - first).colptr(k);
+                    aT *vptr = slice + newx*ld + newy;
+                    for (int x = 0; x < n; x++, vptr += ld, bptr += n) {
+                        for (int y = 0; y < n; y++) {
+                            vptr[y] += bptr[y];
+                        }
+                    }
+                }
+            }, 0, T);
+            return;
+        }
+
+        // Number of blocks covering each pixel
+        // (TODO: currently all block weights = 1)
+        arma::Cube<eT> Weights() const {
+            arma::Cube<eT> weights = arma::zeros<arma::Cube<eT>>(Nx, Ny, T);
+            parallel([&](int k) {
+                for (int it = 0; it < newVecSize; it++) {
+                    int newy = patches(0, actualpatches(it), k);
+                    int newx = patches(1, actualpatches(it), k);
+                    weights.slice(k)(arma::span(newy, newy+Bs-1),
+                                     arma::span(newx, newx+Bs-1)) += 1.;
+                }
+            }, 0, T);
+            return weights;
+        }
+
+        // 1 / Weights(), and 0 for pixels no block covers. It only
+        // depends on the trajectories, so is formed on first use after
+        // Decompose() or Slide() and then shared by every reconstruction
+        const arma::Cube<eT> &InverseWeights() {
+            if (!weightsValid) {
+                invWeights = 1 / Weights();
+                invWeights.elem(arma::find_nonfinite(invWeights)).zeros();
+                weightsValid = true;
+            }
+            return invWeights;
+        }
+
+ private:
+        int Nx, Ny, T, Bs, Bo, vecSize, newVecSize;
+        int K, blockStride, method;
+        double lambdaBound;
+        arma::icube patches;
+        arma::uvec actualpatches, selected;
+
+        // Overlap weighting, and the rebuilt blocks of a batch
+        arma::Cube<eT> invWeights, blocks;
+        bool weightsValid = false;
+
+        // Blocks on the block overlap grid, which must include
+        // the right and bottom edges of the image sequence
+        // for an accurate PGURE reconstruction
+        arma::uvec GridBlocks() const {
             // Fix block overlap parameter
             arma::uvec firstpatches(vecSize);
             int kiter = 0;
@@ -87,9 +575,6 @@ class SVT {
                 }
             }
 
-            // Code must include right and bottom edges
-            // of the image sequence to ensure an
-            // accurate PGURE reconstruction
             arma::uvec patchesbottomedge(1+(Ny-Bs)/Bo);
             for (int i = 0; i < 1+(Ny-Bs); i+=Bo) {
                 patchesbottomedge(i/Bo) = (Ny-Bs+1)*i + (Nx-Bs);
@@ -111,114 +596,281 @@ class SVT {
             joinpatches(
                 arma::span(vecSize+(Ny-Bs)/Bo+1,
                            vecSize+(Ny-Bs)/Bo+1+(Nx-Bs)/Bo)) = patchesbottomedge;
-            actualpatches = arma::sort(joinpatches.elem(arma::find_unique(joinpatches)));
+            return arma::sort(joinpatches.elem(arma::find_unique(joinpatches)));
 
-            // Get new vector size
-            newVecSize = actualpatches.n_elem;
+        }
 
-            // Memory allocation
-            U.resize(newVecSize);
-            S.resize(newVecSize);
-            V.resize(newVecSize);
-            for (int it = 0; it < newVecSize; it++) {
-                U[it] = arma::zeros<arma::mat>(Bs*Bs, T);
-                S[it] = arma::zeros<arma::vec>(T);
-                V[it] = arma::zeros<arma::mat>(T, T);
+        // Position of block it in the frame the grid was laid out in
+        int GridRow(int it) const {
+            return actualpatches(it) % (1+(Ny-Bs));
+        }
+        int GridCol(int it) const {
+            return actualpatches(it) / (1+(Nx-Bs));
+        }
+
+        // Blocks, and pixels, in each chunk handed to a pool thread
+        static constexpr int BlockGrain = 16;
+        static constexpr arma::uword ElementGrain = 16384;
+
+        // Relative error allowed in the singular values kept by the
+        // truncated factors (see RangeFactors())
+        static constexpr double FactorTolerance = 1E-2;
+
+        // Per-chunk scratch for the block decompositions
+        struct Workspace {
+            arma::Mat<eT> U, V, G, Gvecs, Q, R, Omega;
+            arma::Col<eT> S, Gvals;
+        };
+
+        // Whether a singular value s survives the threshold for any
+        // lambda in [0, lambdaBound]. s - Smax*exp(-lambda*s^2/2) grows
+        // with both s and lambda, so if s is set to zero by Threshold()
+        // then so is every smaller value
+        bool Survives(double s, double smax) const {
+            return s > smax * std::exp(-lambdaBound * s * s / 2);
+        }
+
+        // Decompose one block with the selected backend
+        void DecomposeBlock(int it, const arma::Mat<eT> &block, Workspace &ws) {
+            switch (method) {
+                case SVD_GRAM:
+                    ws.G = block.t() * block;
+                    if (GramFactors(block, ws)) {
+                        StoreFactors(it, ws, K, 0.);
+                        return;
+                    }
+                    break;
+                case SVD_RANDOMIZED:
+                    RandomizedFactors(it, block, ws);
+                    return;
+                default:
+                    break;
+            }
+            if (arma::svd_econ(ws.U, ws.S, ws.V, block)) {
+                StoreFactors(it, ws, K, 0.);
+            } else {
+                std::fill_n(BlockPtr(it), blockStride, eT(0));
+                ranks(it) = K;
+                tailEnergy(it) = 0.;
             }
+            return;
+        }
 
-            //#pragma omp parallel for private(Ublock, Sblock, Vblock)
-            for (int it = 0; it < newVecSize; it++) {
-                arma::mat block(Bs*Bs, T);
+        // Decompose the blocks in groups of JacobiSVD::Lanes,
+        // each group factorized together by one thread
+        void DecomposeBatched(const arma::Cube<eT> &u) {
+            const int L = JacobiSVD<eT>::Lanes;
+            int numGroups = (newVecSize + L - 1) / L;
+
+            parallel_chunks([&](int begin, int end) {
+                arma::Mat<eT> block(Bs*Bs, T);
+                Workspace ws;
+                JacobiSVD<eT> jacobi;
+                jacobi.Initialize(Bs*Bs, T);
+                for (int g = begin; g < end; g++) {
+                    int first = g * L;
+                    int last = std::min(first + L, newVecSize);
+
+                    jacobi.Clear();
+                    for (int it = first; it < last; it++) {
+                        Gather(it, u, block);
+                        jacobi.Load(it - first, block);
+                    }
+                    jacobi.Factorize();
+                    for (int it = first; it < last; it++) {
+                        jacobi.Extract(it - first, ws.U, ws.S, ws.V);
+                        StoreFactors(it, ws, K, 0.);
+                    }
+                }
+            }, 0, numGroups, 2);
+            return;
+        }
 
-                // Extract block
-                for (int k = 0; k < T; k++) {
-                    int newy = patches(0, actualpatches(it), k);
-                    int newx = patches(1, actualpatches(it), k);
-                    block.col(k) = arma::vectorise(
-                                     u(arma::span(newy, newy+Bs-1),
-                                       arma::span(newx, newx+Bs-1),
-                                       arma::span(k)));
+        // SVD of a block from the eigen-decomposition of its Gram
+        // matrix ws.G = M' * M. eig_sym() returns ascending eigenvalues,
+        // so flip to match the ordering and rank of svd_econ()
+        bool GramFactors(const arma::Mat<eT> &block, Workspace &ws) {
+            if (!arma::eig_sym(ws.Gvals, ws.Gvecs, ws.G)) {
+                return false;
+            }
+            ws.S = arma::sqrt(arma::max(arma::flipud(ws.Gvals.tail(K)),
+                                        arma::zeros<arma::Col<eT>>(K)));
+            ws.V = arma::fliplr(ws.Gvecs.tail_cols(K));
+
+            // Recover the left singular vectors, U = M * V / S,
+            // discarding numerically null directions
+            ws.U = block * ws.V;
+            eT Stol = ws.S(0) * T * arma::Datum<eT>::eps;
+            for (int k = 0; k < K; k++) {
+                ws.U.col(k) *= (ws.S(k) > Stol) ? 1 / ws.S(k) : eT(0);
+            }
+            return true;
+        }
+
+        // Randomized range finder with one power iteration, doubling
+        // the rank until RangeFactors() accepts the factors, and the
+        // exact SVD once the rank would reach K
+        void RandomizedFactors(int it, const arma::Mat<eT> &block, Workspace &ws) {
+            std::mt19937_64 generator(it);
+            std::normal_distribution<eT> normal(0., 1.);
+
+            double energy = arma::accu(arma::square(block));
+            for (int l = std::min(K, 8); l < K; l = std::min(K, 2*l)) {
+                ws.Omega.set_size(T, l);
+                ws.Omega.imbue([&]() { return normal(generator); });
+                int rank;
+                double tail;
+                if (RangeFactors(block, energy, true, ws, rank, tail)) {
+                    StoreFactors(it, ws, rank, tail);
+                    return;
                 }
+            }
+            if (!arma::svd_econ(ws.U, ws.S, ws.V, block)) {
+                std::fill_n(BlockPtr(it), blockStride, eT(0));
+                ranks(it) = K;
+                tailEnergy(it) = 0.;
+                return;
+            }
 
-                // Do the SVD
-                arma::svd_econ(Ublock, Sblock, Vblock, block);
-                U[it] = Ublock;
-                S[it] = Sblock;
-                V[it] = Vblock;
+            // Drop the trailing values that are always thresholded away
+            int rank = 1;
+            while (rank < static_cast<int>(ws.S.n_elem) && Survives(ws.S(rank), ws.S(0))) {
+                rank++;
             }
+            StoreFactors(it, ws, rank, arma::accu(arma::square(ws.S.tail(ws.S.n_elem - rank))));
             return;
         }
 
-        // Reconstruct block in the image sequence after thresholding
-        arma::cube Reconstruct(double lambda) {
-            arma::cube v = arma::zeros<arma::cube>(Nx, Ny, T);
-            arma::cube weights = arma::zeros<arma::cube>(Nx, Ny, T);
-
-            arma::mat block, Ublock, Vblock;
-            arma::vec Sblock;
-
-            block.set_size(Bs*Bs, T);
-            Ublock.set_size(Bs*Bs, T);
-            Sblock.set_size(T);
-            Vblock.set_size(T, T);
-
-            /*
-            #pragma omp parallel for shared(v, weights) \
-                       private(block, Ublock, Sblock, Vblock)
-            */
-            for (int it = 0; it < newVecSize; it++) {
-                Ublock = U[it];
-                Sblock = S[it];
-                Vblock = V[it];
-
-                // Basic singular value thresholding
-                // arma::vec Snew = arma::sign(Sblock)
-                //                      % arma::max(
-                //                          arma::abs(Sblock) - lambda,
-                //                          arma::zeros<arma::vec>(T));
-
-                // Gaussian-weighted singular value thresholding
-                arma::vec wvec = arma::abs(Sblock.max()
-                                           * arma::exp(-1
-                                                * lambda
-                                                * arma::square(Sblock)/2));
+        // Truncated factors of a block from the range of block * ws.Omega
+        // (after a power iteration if power is set), which are the SVD of
+        // Q*Q'*M for Q an orthonormal basis of that range, rather than of
+        // M itself. With E = M - Q*Q'*M, M'M = (Q*Q'*M)'(Q*Q'*M) + E'E, so
+        // each exact singular value s of M and its estimate t satisfy
+        // t <= s <= sqrt(t^2 + |E|^2), where |E|^2 = |M|^2 - |Q'M|^2
+        // is known exactly. The factors are accepted (returning true) if
+        // that bound keeps every kept value, Smax included, within
+        // FactorTolerance of the exact one, and shows that no dropped
+        // value would survive thresholding for lambda <= lambdaBound.
+        // The rank kept and the energy left out are returned
+        bool RangeFactors(const arma::Mat<eT> &block,
+                          double energy,
+                          bool power,
+                          Workspace &ws,
+                          int &rank,
+                          double &tail) {
+            arma::qr_econ(ws.Q, ws.R, block * ws.Omega);
+            if (power) {
+                arma::qr_econ(ws.Q, ws.R, block * (block.t() * ws.Q));
+            }
+            if (!arma::svd_econ(ws.U, ws.S, ws.V, ws.Q.t() * block)) {
+                return false;
+            }
+            ws.U = ws.Q * ws.U;
+
+            double outside = std::max(energy - static_cast<double>(arma::accu(arma::square(ws.S))), 0.);
+            double smax = ws.S(0);
+            if (Survives(std::sqrt(outside), smax)) {
+                return false;
+            }
+            rank = 1;
+            while (rank < static_cast<int>(ws.S.n_elem)
+                   && Survives(std::sqrt(static_cast<double>(ws.S(rank))*ws.S(rank) + outside), smax)) {
+                rank++;
+            }
+            double smin = ws.S(rank-1);
+            double tolerance = (1. + FactorTolerance) * (1. + FactorTolerance) - 1.;
+            if (!(outside <= tolerance * smin * smin)) {
+                return false;
+            }
+            tail = outside + arma::accu(arma::square(ws.S.tail(ws.S.n_elem - rank)));
+            return true;
+        }
 
-                // Apply threshold
-                arma::vec Snew = arma::sign(Sblock)
-                                   % arma::max(
-                                        arma::abs(Sblock) - wvec,
-                                        arma::zeros<arma::vec>(T));
+        // Update the factors of block it, holding the new window M,
+        // from its previous factors (see Slide()). Returns false, leaving
+        // them unchanged, if they have to be decomposed in full instead
+        bool SlideBlock(int it, const arma::Mat<eT> &block, Workspace &ws) {
+            const int oversample = 2;
+            arma::Col<eT> Sprev = FactorS(it);
+            if (Sprev.n_elem == 0) {
+                return false;
+            }
+            int r = 1;
+            while (r < static_cast<int>(Sprev.n_elem) && Survives(Sprev(r), Sprev(0))) {
+                r++;
+            }
+            int l = r + 1 + oversample;
+            if (2*l > K) {
+                return false;
+            }
 
-                // Reconstruct from SVD
-                block = Ublock * diagmat(Snew) * Vblock.t();
+            std::mt19937_64 generator(it);
+            std::normal_distribution<eT> normal(0., 1.);
+            ws.Omega.zeros(T, l);
+            ws.Omega(arma::span(0, T-2), arma::span(0, r-1)) =
+                FactorV(it)(arma::span(1, T-1), arma::span(0, r-1));
+            ws.Omega(T-1, r) = 1;
+            ws.Omega.cols(r+1, l-1).imbue([&]() { return normal(generator); });
+
+            int rank;
+            double tail;
+            if (!RangeFactors(block, arma::accu(arma::square(block)), false, ws, rank, tail)) {
+                return false;
+            }
+            StoreFactors(it, ws, rank, tail);
+            return true;
+        }
 
-                // Deal with block weights (TODO: currently all weights = 1)
-                for (int k = 0; k < T; k++) {
-                    int newy = patches(0, actualpatches(it), k);
-                    int newx = patches(1, actualpatches(it), k);
-                    v(arma::span(newy, newy+Bs-1),
-                      arma::span(newx, newx+Bs-1),
-                      arma::span(k, k)) += arma::reshape(block.col(k), Bs, Bs);
-                    weights(arma::span(newy, newy+Bs-1),
-                            arma::span(newx, newx+Bs-1),
-                            arma::span(k, k)) += arma::ones<arma::mat>(Bs, Bs);
+        // Copy the leading rank factors of a block into the slab
+        void StoreFactors(int it, const Workspace &ws, int rank, double tail) {
+            ranks(it) = rank;
+            tailEnergy(it) = tail;
+            FactorU(it) = ws.U.head_cols(rank);
+            FactorS(it) = ws.S.head(rank);
+            FactorV(it) = ws.V.head_cols(rank);
+            return;
+        }
+
+        // Collate U, S, V in one cache-aligned slab, laid out
+        // block by block as [U (Bs*Bs x K) | S (K) | V (T x K)],
+        // of which the leading ranks(it) columns are in use
+        struct FreeDeleter {
+            void operator()(eT *p) const { std::free(p); }
+        };
+        std::unique_ptr<eT[], FreeDeleter> factors;
+        size_t factorsSize = 0;
+        arma::uvec ranks;
+        arma::vec tailEnergy;
+
+        void AllocateFactors() {
+            size_t required = static_cast<size_t>(newVecSize) * blockStride;
+            if (required != factorsSize) {
+                factors.reset(static_cast<eT *>(
+                    std::aligned_alloc(64, std::max(required * sizeof(eT), size_t(64)))));
+                if (!factors) {
+                    throw std::bad_alloc();
                 }
+                factorsSize = required;
             }
-
-            // Include the weighting
-            v /= weights;
-            v.elem(find_nonfinite(v)).zeros();
-            return v;
+            ranks.set_size(newVecSize);
+            tailEnergy.set_size(newVecSize);
+            return;
         }
 
- private:
-        int Nx, Ny, T, Bs, Bo, vecSize, newVecSize;
-        arma::icube patches;
-        arma::uvec actualpatches;
+        eT *BlockPtr(int it) const {
+            return factors.get() + static_cast<size_t>(it) * blockStride;
+        }
 
-        // Collate U, S, V
-        std::vector<arma::mat> U, V;
-        std::vector<arma::vec> S;
+        // Views of the factors of one block, aliasing the slab
+        arma::Mat<eT> FactorU(int it) const {
+            return arma::Mat<eT>(BlockPtr(it), Bs*Bs, ranks(it), false, true);
+        }
+        arma::Col<eT> FactorS(int it) const {
+            return arma::Col<eT>(BlockPtr(it) + Bs*Bs*K, ranks(it), false, true);
+        }
+        arma::Mat<eT> FactorV(int it) const {
+            return arma::Mat<eT>(BlockPtr(it) + Bs*Bs*K + K, T, ranks(it), false, true);
+        }
 };
 
 #endif
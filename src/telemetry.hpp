@@ -0,0 +1,222 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Per-frame timings and estimates, published as frames are denoised.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// C++ headers
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Peak memory
+#include <sys/resource.h>
+
+// One denoised frame. Plain data, so it can be passed through
+// the C API (and mirrored by a ctypes Structure). Stage times
+// are in seconds, and the median filter and hot-pixel times
+// are those of the frame itself, when it was first read
+struct FrameTelemetry {
+    int frame;              // Index in the sequence
+    int windowstart;        // First frame of its window
+    int slid;               // 1 if the window slid on from the last one
+    int evaluations;        // PGURE evaluations in the lambda search
+    double start;           // Seconds since telemetry was enabled
+    double end;
+    double median;
+    double hotpixel;
+    double noise;
+    double motion;
+    double decompose;       // Decomposition (or sliding it on)
+    double optimize;        // Lambda search
+    double reconstruct;
+    double lambda;
+    double alpha;
+    double mu;
+    double sigma;
+    double peakmemory;      // Peak resident memory of the process, bytes
+};
+
+// Called from the thread that denoised the frame
+typedef void (*TelemetryCallback)(const FrameTelemetry *record, void *user);
+
+// Seconds since t, moving t on to now, for timing consecutive stages
+inline double Lap(std::chrono::steady_clock::time_point &t) {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - t).count();
+    t = now;
+    return seconds;
+}
+
+// Peak resident memory of the process, in bytes
+inline double PeakMemory() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.;
+    }
+    #if defined(__APPLE__)
+      return static_cast<double>(usage.ru_maxrss);
+    #else
+      return 1024. * usage.ru_maxrss;
+    #endif
+}
+
+// Records are published by the frame-level threads into a bounded
+// lock-free queue (Vyukov's, with a sequence number per slot) and
+// read back in order by one consumer, and/or passed to a callback.
+// Records are dropped rather than blocking when the queue is full.
+// Off until enabled, when publishing is a single atomic load
+class Telemetry {
+ public:
+        static Telemetry &instance() {
+            static Telemetry telemetry;
+            return telemetry;
+        }
+
+        // Keep up to capacity records (rounded up to a power of 2,
+        // 0 for none) and/or call callback for each. Must not be
+        // called while frames are being denoised
+        void Enable(int capacity,
+                    TelemetryCallback callbackIn,
+                    void *userIn) {
+            enabled.store(false);
+            size = 0;
+            if (capacity > 0) {
+                size = 1;
+                while (size < static_cast<size_t>(capacity)) {
+                    size <<= 1;
+                }
+                slots.reset(new Slot[size]);
+                for (size_t i = 0; i < size; i++) {
+                    slots[i].sequence.store(i, std::memory_order_relaxed);
+                }
+            } else {
+                slots.reset();
+            }
+            head.store(0);
+            tail.store(0);
+            dropped.store(0);
+            callback = callbackIn;
+            user = userIn;
+            epoch = std::chrono::steady_clock::now();
+            enabled.store(size > 0 || callback != nullptr);
+            return;
+        }
+
+        // Stop publishing. Records already queued can still be read
+        void Disable() {
+            enabled.store(false);
+            return;
+        }
+
+        bool Enabled() const {
+            return enabled.load(std::memory_order_relaxed);
+        }
+
+        // Seconds since Enable(), for FrameTelemetry::start and end
+        double Now() const {
+            return std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        // Stamp the record with its end time and the peak memory
+        // so far, and pass it on. Safe from any number of threads
+        void Publish(FrameTelemetry record) {
+            if (!Enabled()) {
+                return;
+            }
+            record.end = Now();
+            record.peakmemory = PeakMemory();
+            if (callback != nullptr) {
+                callback(&record, user);
+            }
+            if (size == 0) {
+                return;
+            }
+            size_t pos = tail.load(std::memory_order_relaxed);
+            Slot *slot;
+            for (;;) {
+                slot = &slots[pos & (size - 1)];
+                size_t seq = slot->sequence.load(std::memory_order_acquire);
+                std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+                if (dif == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+            slot->record = record;
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            return;
+        }
+
+        // Move up to max of the oldest records into records,
+        // returning how many. Only one thread may read at a time
+        int Read(FrameTelemetry *records,
+                 int max) {
+            int n = 0;
+            while (n < max && size > 0) {
+                size_t pos = head.load(std::memory_order_relaxed);
+                Slot *slot = &slots[pos & (size - 1)];
+                size_t seq = slot->sequence.load(std::memory_order_acquire);
+                if (seq != pos + 1) {
+                    break;
+                }
+                head.store(pos + 1, std::memory_order_relaxed);
+                records[n++] = slot->record;
+                slot->sequence.store(pos + size, std::memory_order_release);
+            }
+            return n;
+        }
+
+        // Records lost to a full queue since Enable()
+        long Dropped() const {
+            return dropped.load();
+        }
+
+ private:
+        Telemetry() {}
+
+        struct Slot {
+            std::atomic<size_t> sequence;
+            FrameTelemetry record;
+        };
+        std::unique_ptr<Slot[]> slots;
+        size_t size = 0;
+        std::atomic<size_t> head{0}, tail{0};
+        std::atomic<long> dropped{0};
+        std::atomic<bool> enabled{false};
+
+        TelemetryCallback callback = nullptr;
+        void *user = nullptr;
+        std::chrono::steady_clock::time_point epoch;
+};
+
+#endif
@@ -0,0 +1,415 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Reading and writing of multi-page TIFF stacks.
+
+    This file is part of PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef TIFFSTACK_H
+#define TIFFSTACK_H
+
+// C++ headers
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// POSIX memory mapping
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Armadillo library
+#include <armadillo>
+
+// LibTIFF
+namespace libtiff {
+    #include "tiffio.h"
+}
+
+// Own headers
+#include "parallel.hpp"
+
+// Reads frames from a multi-page TIFF of equally sized 8-bit or
+// 16-bit single-channel frames. BigTIFF files are read in the
+// same way. The strip offsets of every directory are scanned
+// once on opening, so any frame can be read without walking the
+// directory chain. Uncompressed frames are copied straight from
+// a memory map of the file, and other frames are decoded by
+// libtiff, with one handle per thread when reading in parallel.
+// Frames come out as arma::Mat<unsigned short> (height x width),
+// with 8-bit values kept in [0, 255]
+class TiffStack {
+ public:
+        TiffStack() {}
+        ~TiffStack() {
+            Close();
+        }
+
+        // Returns false if the file can't be opened, or its frames
+        // differ in size or depth from the first one
+        bool Open(const std::string &filename) {
+            Close();
+            name = filename;
+            tif = libtiff::TIFFOpen(name.c_str(), "r");
+            if (tif == nullptr) {
+                return false;
+            }
+            libtiff::TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+            libtiff::TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+            libtiff::TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &depth);
+            swapped = libtiff::TIFFIsByteSwapped(tif);
+            bigtiff = libtiff::TIFFIsBigTIFF(tif);
+
+            // Scan the directories
+            do {
+                uint32_t w = 0, h = 0, rps = 0;
+                uint16_t d = 0, compression = 0, planar = 0;
+                libtiff::TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+                libtiff::TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+                libtiff::TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &d);
+                if (w != width || h != height || d != depth) {
+                    Close();
+                    return false;
+                }
+                libtiff::TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+                libtiff::TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+                libtiff::TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+
+                Page page;
+                page.rowsPerStrip = std::min(rps, height);
+                page.raw = (compression == COMPRESSION_NONE)
+                           && (planar == PLANARCONFIG_CONTIG)
+                           && !libtiff::TIFFIsTiled(tif);
+                if (page.raw) {
+                    libtiff::toff_t *offsets = nullptr, *counts = nullptr;
+                    libtiff::TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets);
+                    libtiff::TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &counts);
+                    int strips = libtiff::TIFFNumberOfStrips(tif);
+                    page.offsets.assign(offsets, offsets + strips);
+                    page.counts.assign(counts, counts + strips);
+                }
+                pages.push_back(std::move(page));
+            } while (libtiff::TIFFReadDirectory(tif));
+            libtiff::TIFFSetDirectory(tif, 0);
+            dir = 0;
+
+            // Map the file for the uncompressed frames, falling
+            // back to libtiff if it can't be mapped
+            int fd = ::open(name.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd >= 0 && ::fstat(fd, &st) == 0 && st.st_size > 0) {
+                void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    map = static_cast<const unsigned char *>(p);
+                    mapSize = st.st_size;
+                    ::madvise(p, mapSize, MADV_SEQUENTIAL);
+                }
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return true;
+        }
+
+        void Close() {
+            if (tif != nullptr) {
+                libtiff::TIFFClose(tif);
+                tif = nullptr;
+            }
+            if (map != nullptr) {
+                ::munmap(const_cast<unsigned char *>(map), mapSize);
+                map = nullptr;
+            }
+            pages.clear();
+            return;
+        }
+
+        int Width() const {
+            return width;
+        }
+        int Height() const {
+            return height;
+        }
+        int Depth() const {
+            return depth;
+        }
+        int Frames() const {
+            return static_cast<int>(pages.size());
+        }
+        bool BigTIFF() const {
+            return bigtiff;
+        }
+
+        // Read frame k. Not safe to call from several threads at once
+        void ReadFrame(int k, arma::Mat<unsigned short> &frame) {
+            std::vector<unsigned char> buffer;
+            DecodeFrame(k, tif, dir, buffer, frame);
+            return;
+        }
+
+        // Read frames first..first+count-1 in parallel, passing each
+        // to sink along with its index from 0. The sink is called from
+        // several threads at once, but only once for each frame
+        void ReadFrames(int first,
+                        int count,
+                        const std::function<void(int, const arma::Mat<unsigned short> &)> &sink) {
+            int chunks = std::max(1, std::min(count, static_cast<int>(thread_pool::instance().size())));
+            auto&& readchunk = [&](int c) {
+                // Consecutive frames, so a libtiff handle only ever
+                // steps on to the next directory
+                libtiff::TIFF *handle = nullptr;
+                int handleDir = -1;
+                std::vector<unsigned char> buffer;
+                arma::Mat<unsigned short> frame;
+                for (int j = c*count/chunks; j < (c+1)*count/chunks; j++) {
+                    if (!Mapped(first + j) && handle == nullptr) {
+                        handle = libtiff::TIFFOpen(name.c_str(), "r");
+                        handleDir = 0;
+                    }
+                    DecodeFrame(first + j, handle, handleDir, buffer, frame);
+                    sink(j, frame);
+                }
+                if (handle != nullptr) {
+                    libtiff::TIFFClose(handle);
+                }
+            };
+            parallel(readchunk, chunks);
+            return;
+        }
+
+ private:
+        // Strip layout of one directory, kept for uncompressed frames
+        struct Page {
+            bool raw = false;
+            uint32_t rowsPerStrip = 0;
+            std::vector<uint64_t> offsets, counts;
+        };
+
+        std::string name;
+        libtiff::TIFF *tif = nullptr;
+        int dir = 0;
+        uint32_t width = 0, height = 0;
+        uint16_t depth = 0;
+        bool swapped = false, bigtiff = false;
+        std::vector<Page> pages;
+
+        const unsigned char *map = nullptr;
+        size_t mapSize = 0;
+
+        size_t FrameBytes() const {
+            return static_cast<size_t>(width) * height * (depth / 8);
+        }
+
+        // Whether frame k can be copied from the map
+        bool Mapped(int k) const {
+            const Page &page = pages[k];
+            if (map == nullptr || !page.raw) {
+                return false;
+            }
+            for (size_t s = 0; s < page.offsets.size(); s++) {
+                if (page.offsets[s] + page.counts[s] > mapSize) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Decode frame k into buffer (row-major, as stored) and then
+        // into frame, using handle (currently at directory handleDir)
+        // if it can't be copied from the map
+        void DecodeFrame(int k,
+                         libtiff::TIFF *handle,
+                         int &handleDir,
+                         std::vector<unsigned char> &buffer,
+                         arma::Mat<unsigned short> &frame) {
+            size_t bytes = FrameBytes();
+            buffer.resize(bytes);
+            if (Mapped(k)) {
+                const Page &page = pages[k];
+                size_t pos = 0;
+                for (size_t s = 0; s < page.offsets.size() && pos < bytes; s++) {
+                    size_t n = std::min<size_t>(page.counts[s], bytes - pos);
+                    std::memcpy(buffer.data() + pos, map + page.offsets[s], n);
+                    pos += n;
+                }
+            } else {
+                if (k == handleDir + 1) {
+                    libtiff::TIFFReadDirectory(handle);
+                } else if (k != handleDir) {
+                    libtiff::TIFFSetDirectory(handle, k);
+                }
+                handleDir = k;
+                size_t pos = 0;
+                int strips = libtiff::TIFFNumberOfStrips(handle);
+                for (int s = 0; s < strips && pos < bytes; s++) {
+                    libtiff::tmsize_t n = libtiff::TIFFReadEncodedStrip(handle, s, buffer.data() + pos,
+                                                                        static_cast<libtiff::tmsize_t>(bytes - pos));
+                    if (n <= 0) {
+                        break;
+                    }
+                    pos += n;
+                }
+            }
+
+            // libtiff already swaps what it decodes
+            bool swap = swapped && Mapped(k);
+
+            // Transpose from rows of width to height x width
+            frame.set_size(height, width);
+            unsigned short *out = frame.memptr();
+            if (depth == 16) {
+                const unsigned char *in = buffer.data();
+                for (uint32_t r = 0; r < height; r++) {
+                    for (uint32_t c = 0; c < width; c++) {
+                        uint16_t v;
+                        std::memcpy(&v, in + 2*(static_cast<size_t>(r)*width + c), 2);
+                        out[r + static_cast<size_t>(c)*height] = swap ? static_cast<uint16_t>((v >> 8) | (v << 8)) : v;
+                    }
+                }
+            } else {
+                for (uint32_t r = 0; r < height; r++) {
+                    for (uint32_t c = 0; c < width; c++) {
+                        out[r + static_cast<size_t>(c)*height] = buffer[static_cast<size_t>(r)*width + c];
+                    }
+                }
+            }
+            return;
+        }
+};
+
+// Writes 16-bit frames to a multi-page TIFF in the background,
+// so encoding and disk writes overlap with denoising. Frames are
+// written in the order they are queued, one strip per frame, and
+// the file is BigTIFF if it could reach 4 GB
+class TiffWriter {
+ public:
+        TiffWriter() {}
+        ~TiffWriter() {
+            Close();
+        }
+
+        // Returns false if the file can't be created. Up to
+        // queuesize frames wait to be written before Write() blocks
+        bool Open(const std::string &filename,
+                  int w,
+                  int h,
+                  int frames,
+                  int queuesize = 8) {
+            width = w;
+            height = h;
+            total = frames;
+            capacity = std::max(1, queuesize);
+
+            // Leave room for the directories below 4 GB
+            uint64_t bytes = static_cast<uint64_t>(width) * height * 2 * frames;
+            bool big = bytes > (uint64_t(0xFFFFFFFF) - (uint64_t(1) << 26));
+            tif = libtiff::TIFFOpen(filename.c_str(), big ? "w8" : "w");
+            if (tif == nullptr) {
+                return false;
+            }
+            stopping = false;
+            worker = std::thread([this]() { Run(); });
+            return true;
+        }
+
+        // Queue frame (height x width) as the given page
+        void Write(int page, arma::Mat<unsigned short> frame) {
+            std::unique_lock<std::mutex> lock(mutex);
+            space.wait(lock, [this]() { return static_cast<int>(queue.size()) < capacity; });
+            queue.emplace_back(page, std::move(frame));
+            ready.notify_one();
+            return;
+        }
+
+        // Write out the remaining frames and close the file
+        void Close() {
+            if (tif == nullptr) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            ready.notify_one();
+            worker.join();
+            libtiff::TIFFClose(tif);
+            tif = nullptr;
+            return;
+        }
+
+ private:
+        libtiff::TIFF *tif = nullptr;
+        int width = 0, height = 0, total = 0, capacity = 1;
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable ready, space;
+        std::deque<std::pair<int, arma::Mat<unsigned short>>> queue;
+        bool stopping = false;
+
+        void Run() {
+            std::vector<unsigned short> rows(static_cast<size_t>(width) * height);
+            for (;;) {
+                std::pair<int, arma::Mat<unsigned short>> item;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+                    if (queue.empty()) {
+                        return;
+                    }
+                    item = std::move(queue.front());
+                    queue.pop_front();
+                }
+                space.notify_one();
+
+                libtiff::TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+                libtiff::TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+                libtiff::TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
+                libtiff::TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+                libtiff::TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, height);
+                libtiff::TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+                libtiff::TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+                libtiff::TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+                libtiff::TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+                libtiff::TIFFSetField(tif, TIFFTAG_PAGENUMBER, item.first, total);
+
+                // Transpose back to rows of width
+                const unsigned short *in = item.second.memptr();
+                for (int c = 0; c < width; c++) {
+                    for (int r = 0; r < height; r++) {
+                        rows[static_cast<size_t>(r)*width + c] = in[r + static_cast<size_t>(c)*height];
+                    }
+                }
+                libtiff::TIFFWriteEncodedStrip(tif, 0, rows.data(),
+                                               static_cast<libtiff::tmsize_t>(rows.size() * sizeof(unsigned short)));
+                libtiff::TIFFWriteDirectory(tif);
+            }
+        }
+};
+
+#endif
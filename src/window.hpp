@@ -0,0 +1,230 @@
+/***************************************************************************
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Denoising of one frame from the window of frames around it.
+
+    This file is part of  PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+#ifndef WINDOW_H
+#define WINDOW_H
+
+// C++ headers
+#include <algorithm>
+#include <chrono>
+
+// Armadillo library
+#include <armadillo>
+
+// Own headers
+#include "motioncache.hpp"
+#include "noisecache.hpp"
+#include "pgure.hpp"
+#include "telemetry.hpp"
+
+// The loop body shared by PGURESVT(), the executable and the
+// sessions: normalizes a window, estimates its noise, decomposes
+// it (or slides the previous window's decomposition on by a frame)
+// and thresholds it. The decomposition and trajectories are kept
+// between consecutive windows, so each run of windows (or session)
+// has its own. Optimizer is one of the PGURE<> types picked by the
+// precision option
+template <class Optimizer>
+class WindowDenoiser {
+ public:
+        WindowDenoiser() {}
+        ~WindowDenoiser() {
+            delete optimizer;
+        }
+
+        // Windows are T = 2*framewindow+1 frames long, and up to
+        // reuse consecutive windows share one decomposition
+        void Initialize(MotionCache *motioncacheIn,
+                        NoiseCache *noisecacheIn,
+                        int blocksize,
+                        int blockoverlap,
+                        int framewindowIn,
+                        int windowreuse,
+                        bool pgure,
+                        double tolerance,
+                        int noisemethod,
+                        int svdmethod,
+                        bool usegpu,
+                        unsigned seed,
+                        double blockadaptive,
+                        int lambdamethod,
+                        int lambdaevals,
+                        int lambdasweep,
+                        bool lambdapyramid) {
+            motioncache = motioncacheIn;
+            noisecache = noisecacheIn;
+            Bs = blocksize;
+            Bo = blockoverlap;
+            framewindow = framewindowIn;
+            reuse = std::max(1, windowreuse);
+            pgureOpt = pgure;
+            tol = tolerance;
+            NoiseMethod = noisemethod;
+            SVDMethod = svdmethod;
+            UseGPU = usegpu;
+            Seed = seed;
+            BlockAdaptive = blockadaptive;
+            LambdaMethod = lambdamethod;
+            LambdaEvals = lambdaevals;
+            LambdaSweep = lambdasweep;
+            LambdaPyramid = lambdapyramid;
+            return;
+        }
+
+        // Denoise frame timeiter of a sequence of N frames from its
+        // window u, which starts at frame start and is normalized in
+        // place. The noise parameters are estimated unless PGURE is
+        // off, in which case the given ones are used. If search, the
+        // optimum lambda is found, starting from lambda if > 0 (and
+        // from the window mean otherwise), else u is thresholded with
+        // lambda. Returns the frame at the scale of u, with
+        // lambda set to the threshold used and the stage timings
+        // in record (from stage, which is reset)
+        arma::mat Denoise(arma::cube &u,
+                          int timeiter,
+                          int start,
+                          int N,
+                          double &alpha,
+                          double &mu,
+                          double &sigma,
+                          double &lambda,
+                          bool search,
+                          FrameTelemetry &record,
+                          std::chrono::steady_clock::time_point &stage) {
+            // Only windows in the middle of the sequence move with timeiter,
+            // so only those can slide on from the previous window
+            bool slide = (optimizer != nullptr)
+                         && (reused < reuse)
+                         && (timeiter > framewindow)
+                         && (timeiter < (N - framewindow));
+
+            // Carry the motion estimation forward, falling back to a
+            // fresh window if the trajectories no longer cover the frame
+            if (slide) {
+                motioncache->Slide(sequencePatches, timeiter, framewindow);
+                slide = optimizer->Covers(sequencePatches, framewindow);
+            }
+
+            // Basic sequence normalization
+            // (sliding windows keep the normalization of the first window)
+            if (!slide) {
+                inputmax = u.max();
+            }
+            u /= inputmax;
+            record.motion = Lap(stage);
+
+            // Perform noise estimation
+            if (pgureOpt) {
+                noisecache->Estimate(u,
+                                     start,
+                                     inputmax,
+                                     alpha,
+                                     mu,
+                                     sigma,
+                                     NoiseMethod);
+            }
+            record.noise = Lap(stage);
+
+            // Largest lambda the block decompositions will be thresholded with
+            double lambdabound = pgureOpt ? u.max() : lambda;
+
+            if (slide) {
+                // Update the previous window's decomposition
+                optimizer->Slide(u,
+                                 sequencePatches,
+                                 alpha,
+                                 mu,
+                                 sigma,
+                                 lambdabound);
+                reused++;
+            } else {
+                delete optimizer;
+
+                // Perform motion estimation
+                sequencePatches = motioncache->Window(timeiter, framewindow);
+                record.motion += Lap(stage);
+
+                // Perform PGURE optimization
+                optimizer = new Optimizer;
+                optimizer->Initialize(u,
+                                      sequencePatches,
+                                      Bs,
+                                      Bo,
+                                      alpha,
+                                      mu,
+                                      sigma,
+                                      SVDMethod,
+                                      lambdabound,
+                                      UseGPU,
+                                      start,
+                                      Seed,
+                                      BlockAdaptive);
+                reused = 1;
+            }
+            record.decompose = Lap(stage);
+
+            // Determine optimum threshold value (max LambdaEvals evaluations)
+            if (search) {
+                int T = static_cast<int>(u.n_slices);
+                bool cold = (lambda <= 0.);
+                lambda = cold ? arma::accu(u)/(u.n_rows*u.n_cols*T) : lambda;
+                // Optionally start cold searches from the binned window
+                lambda = (LambdaPyramid && cold) ? optimizer->PyramidStart(tol, lambda, u.max(), LambdaEvals, LambdaMethod) : lambda;
+                // Optionally start from a dense sweep of the projected PGURE
+                lambda = (LambdaSweep > 0) ? optimizer->Sweep(u.max(), LambdaSweep) : lambda;
+                lambda = optimizer->Optimize(tol, lambda, u.max(), LambdaEvals, LambdaMethod);
+                record.evaluations = optimizer->Evaluations();
+                record.optimize = Lap(stage);
+            }
+            arma::cube v = optimizer->Reconstruct(lambda);
+            record.reconstruct = Lap(stage);
+
+            record.frame = timeiter;
+            record.windowstart = start;
+            record.slid = slide ? 1 : 0;
+            record.lambda = lambda;
+            record.alpha = alpha;
+            record.mu = mu;
+            record.sigma = sigma;
+
+            // Rescale back to original range
+            return inputmax * v.slice(timeiter-start);
+        }
+
+ private:
+        MotionCache *motioncache = nullptr;
+        NoiseCache *noisecache = nullptr;
+        int Bs, Bo, framewindow, reuse;
+        bool pgureOpt, UseGPU, LambdaPyramid;
+        double tol, BlockAdaptive;
+        int NoiseMethod, SVDMethod, LambdaMethod, LambdaEvals, LambdaSweep;
+        unsigned Seed;
+
+        // Decomposition carried forward between windows
+        Optimizer *optimizer = nullptr;
+        arma::icube sequencePatches;
+        double inputmax = 1.;
+        int reused = 0;
+};
+
+#endif
@@ -0,0 +1,146 @@
+/***************************************************************************
+
+    Regression test for the noise estimator
+
+    Copyright (C) 2015-16 Tom Furnival
+
+    Checks the Laplacian residual of NoiseEstimator::ConvolveFIR, which
+    is applied as separable box sums, against a direct 3x3 convolution
+    with the intended weights (1/8 off the centre, -1 at the centre) and
+    the same wrapped edges, that RobustVarEstimate recovers a known
+    sigma from Gaussian noise, directly and through the residual, and
+    that Estimate recovers the parameters of Poisson-Gaussian noise.
+    Returns non-zero if any check fails.
+
+    This file is part of PGURE-SVT.
+
+    PGURE-SVT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PGURE-SVT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PGURE-SVT. If not, see <http://www.gnu.org/licenses/>.
+
+***************************************************************************/
+
+// C++ headers
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+
+// Armadillo library
+#include <armadillo>
+
+// Own headers
+#include "../src/noise.hpp"
+
+// Access to the private helpers of NoiseEstimator
+struct NoiseEstimatorTest {
+    static arma::mat ConvolveFIR(const NoiseEstimator &estimator, const arma::mat &in) {
+        return estimator.ConvolveFIR(in);
+    }
+    static double RobustVarEstimate(NoiseEstimator &estimator, const arma::vec &A) {
+        return estimator.RobustVarEstimate(A);
+    }
+};
+
+static int failures = 0;
+
+static void Check(bool passed, const std::string &name, double value) {
+    std::cout << (passed ? "PASS  " : "FAIL  ") << name << " = " << value << std::endl;
+    failures += passed ? 0 : 1;
+}
+
+// Edge wrap of the original per-patch ConvolveFIR
+static int Wrap(int i, int N) {
+    return (i < 0) ? N-2 : ((i == N) ? 1 : i);
+}
+
+// Direct 3x3 convolution giving the residual -laplacian*in
+static arma::mat DirectResidual(const arma::mat &in) {
+    arma::mat kernel = arma::ones<arma::mat>(3, 3) / 8.;
+    kernel(1, 1) = -1.;
+    int R = in.n_rows;
+    int C = in.n_cols;
+    arma::mat out(R, C);
+    for (int x = 0; x < C; x++) {
+        for (int y = 0; y < R; y++) {
+            double sum = 0.;
+            for (int dx = -1; dx <= 1; dx++) {
+                for (int dy = -1; dy <= 1; dy++) {
+                    sum -= kernel(1+dy, 1+dx) * in(Wrap(y+dy, R), Wrap(x+dx, C));
+                }
+            }
+            out(y, x) = sum;
+        }
+    }
+    return out;
+}
+
+int main() {
+    arma::arma_rng::set_seed(1);
+    NoiseEstimator estimator;
+
+    // Separable kernel against the direct convolution, on square
+    // and non-square frames
+    int sizes[3][2] = {{32, 32}, {37, 29}, {8, 64}};
+    for (auto &size : sizes) {
+        arma::mat frame = arma::randu<arma::mat>(size[0], size[1]);
+        double diff = arma::abs(NoiseEstimatorTest::ConvolveFIR(estimator, frame) - DirectResidual(frame)).max();
+        Check(diff < 1E-12, "ConvolveFIR max difference (" + std::to_string(size[0])
+                            + "x" + std::to_string(size[1]) + ")", diff);
+    }
+
+    // The weights sum to zero, so a flat frame leaves no residual
+    arma::mat flat(40, 40);
+    flat.fill(3.7);
+    double flatResidual = arma::abs(NoiseEstimatorTest::ConvolveFIR(estimator, flat)).max();
+    Check(flatResidual < 1E-12, "ConvolveFIR flat frame residual", flatResidual);
+
+    // Known sigma from Gaussian noise, directly, and from the residual,
+    // which for white noise has variance (1 + 8/64) sigma^2
+    const double sigma = 3.5;
+    arma::mat noise = 10. + sigma * arma::randn<arma::mat>(256, 256);
+    double direct = std::sqrt(NoiseEstimatorTest::RobustVarEstimate(estimator, arma::vectorise(noise)));
+    Check(std::abs(direct/sigma - 1.) < 0.02, "RobustVarEstimate sigma", direct);
+    double residual = std::sqrt(NoiseEstimatorTest::RobustVarEstimate(estimator, 
+                                    arma::vectorise(NoiseEstimatorTest::ConvolveFIR(estimator, noise))) / (9./8.));
+    Check(std::abs(residual/sigma - 1.) < 0.03, "RobustVarEstimate sigma from residual", residual);
+
+    // End to end on Poisson-Gaussian frames, alpha * Poisson(x) + mu
+    // + N(0, sigma^2), each with four flat quadrants so the quadtree
+    // splits, and the lowest at x = 0 so method 4 finds the offset.
+    // The patch variances are those of the residual, so alpha and
+    // sigma^2 come out scaled by its gain of 1 + 8/64
+    const double alpha = 1., mu = 10., sigmaPG = 10.;
+    const int N = 256, frames = 8;
+    std::mt19937 generator(1);
+    std::normal_distribution<double> gaussian(0., sigmaPG);
+    arma::cube sequence(N, N, frames);
+    for (int k = 0; k < frames; k++) {
+        for (int x = 0; x < N; x++) {
+            for (int y = 0; y < N; y++) {
+                int quadrant = (y >= N/2) + 2*(x >= N/2);
+                double level = 60.*k + 15.*quadrant;
+                std::poisson_distribution<int> poisson((level > 0.) ? level : 1.);
+                double count = (level > 0.) ? poisson(generator) : 0.;
+                sequence(y, x, k) = alpha*count + mu + gaussian(generator);
+            }
+        }
+    }
+    double alphaEst = -1., muEst = -1., sigmaEst = -1.;
+    estimator.Estimate(sequence, alphaEst, muEst, sigmaEst, 16, 4);
+    const double gain = 9./8.;
+    Check(std::abs(alphaEst/(gain*alpha) - 1.) < 0.05, "Estimate alpha", alphaEst);
+    Check(std::abs(muEst/mu - 1.) < 0.1, "Estimate mu", muEst);
+    Check(std::abs(sigmaEst/(std::sqrt(gain)*sigmaPG) - 1.) < 0.05, "Estimate sigma", sigmaEst);
+
+    return (failures == 0) ? 0 : 1;
+}